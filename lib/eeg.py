@@ -1,6 +1,7 @@
 import os
 import time
 import csv
+import threading
 import numpy as np
 from pylsl import StreamInlet, resolve_byprop
 from scipy.ndimage import interpolation
@@ -26,6 +27,28 @@ eeg_new_samples_per_frame = int(eeg_sample_rate * params.SHIFT_LENGTH)
 eeg_buffer = np.zeros((eeg_samples_per_frame, params.NUM_EEG_SENSORS))
 ppg_buffer = np.zeros((ppg_samples_per_frame, params.NUM_PPG_SENSORS))
 
+# Samples added to each buffer so far, so the server can tell which rows are new.
+# The loops below swap in each buffer together with its count under buffer_lock.
+eeg_sequence = 0
+ppg_sequence = 0
+buffer_lock = threading.Lock()
+
+def store_buffers(new_eeg_buffer, new_eeg_samples, new_ppg_buffer, new_ppg_samples):
+    global eeg_buffer
+    global ppg_buffer
+    global eeg_sequence
+    global ppg_sequence
+    with buffer_lock:
+        eeg_buffer = new_eeg_buffer
+        ppg_buffer = new_ppg_buffer
+        eeg_sequence += new_eeg_samples
+        ppg_sequence += new_ppg_samples
+
+def get_buffers():
+    """The EEG and PPG buffers with the number of samples added to each so far"""
+    with buffer_lock:
+        return eeg_buffer, eeg_sequence, ppg_buffer, ppg_sequence
+
 def pull_eeg_data():
     global eeg_sample_rate
     global ppg_sample_rate
@@ -85,12 +108,13 @@ def start_fake_eeg_loop():
             eeg_slice = np.array(eeg_slice)
             ppg_slice = np.array(ppg_slice)
 
-            eeg_buffer, eeg_filter_state = util.update_buffer(
+            new_eeg_buffer, eeg_filter_state = util.update_buffer(
                 eeg_buffer, eeg_slice, notch=True,
                 filter_state=eeg_filter_state)
-            ppg_buffer, ppg_filter_state = util.update_buffer(
+            new_ppg_buffer, ppg_filter_state = util.update_buffer(
                 ppg_buffer, ppg_slice, notch=True,
                 filter_state=ppg_filter_state)
+            store_buffers(new_eeg_buffer, len(eeg_slice), new_ppg_buffer, len(ppg_slice))
             time.sleep(params.SHIFT_LENGTH)
             print("data")
     except KeyboardInterrupt:
@@ -126,14 +150,15 @@ def start_eeg_loop(eeg_inlet, ppg_inlet):
                 recording_data = np.concatenate((eeg_timestamp, eeg_data, ppg_data_big), axis=1)
                 recording.writerows(recording_data)
 
-            eeg_buffer, eeg_filter_state = util.update_buffer(
+            new_eeg_buffer, eeg_filter_state = util.update_buffer(
                 eeg_buffer, eeg_data,
                 notch=True,
                 filter_state=eeg_filter_state)
-            ppg_buffer, ppg_filter_state = util.update_buffer(
+            new_ppg_buffer, ppg_filter_state = util.update_buffer(
                 ppg_buffer, ppg_data,
                 notch=False,
                 filter_state=ppg_filter_state)
+            store_buffers(new_eeg_buffer, len(eeg_data), new_ppg_buffer, len(ppg_data))
             print("data")
     except KeyboardInterrupt:
         f.close()
@@ -1,4 +1,5 @@
 import pygame
+import threading
 import time
 import numpy as np
 import lib.params as params
@@ -6,9 +7,13 @@ from lib.fft import compute_fft
 
 NUM_AXES = 2
 joystick_buffer = np.zeros((int(params.JOYSTICK_SAMPLE_RATE_HZ * params.BUFFER_LENGTH), NUM_AXES))
+# Rows added to joystick_buffer so far, swapped in with the buffer under buffer_lock
+joystick_sequence = 0
+buffer_lock = threading.Lock()
 
 def maybe_listen_to_joystick():
     global joystick_buffer
+    global joystick_sequence
     # Initialize pygame and the joystick module
     pygame.init()
     pygame.joystick.init()
@@ -43,13 +48,21 @@ def maybe_listen_to_joystick():
                     # Read the joystick axis values
                     x_axis = joystick.get_axis(0)
                     y_axis = joystick.get_axis(1)
-                    joystick_buffer = np.roll(joystick_buffer, -1, axis=0)
-                    joystick_buffer[-1] = np.array([x_axis, y_axis])
+                    new_buffer = np.roll(joystick_buffer, -1, axis=0)
+                    new_buffer[-1] = np.array([x_axis, y_axis])
+                    with buffer_lock:
+                        joystick_buffer = new_buffer
+                        joystick_sequence += 1
                 elif event.type == pygame.JOYBUTTONDOWN:
                     # Read the button that was pressed
                     button = event.button
                     print("Button pressed:", button)
 
+def get_buffer():
+    """joystick_buffer with the number of rows added to it so far"""
+    with buffer_lock:
+        return joystick_buffer, joystick_sequence
+
 def get_data():
     fft, buckets, bands = compute_fft(joystick_buffer, params.JOYSTICK_SAMPLE_RATE_HZ)
     return {
@@ -1,11 +1,15 @@
+import os
 import asyncio
 import websockets
 import json
 import time
 import numpy as np
+from concurrent.futures import ThreadPoolExecutor
+from urllib.parse import unquote
 from pylsl import StreamInlet, resolve_byprop
 import lib.params as params
 import lib.util as util
+import lib.protocol as protocol
 
 from scipy.signal import lfilter, lfilter_zi, firwin
 
@@ -15,6 +19,17 @@ EEG_SAMPLES_PER_CHUNK = 12
 PPG_SAMPLES_PER_CHUNK = int(EEG_SAMPLES_PER_CHUNK * (PPG_SAMPLE_RATE / EEG_SAMPLE_RATE))
 EEG_FIRWIN_SIZE = 40
 PPG_FIRWIN_SIZE = 10
+SAMPLE_RATES = {'EEG': EEG_SAMPLE_RATE, 'PPG': PPG_SAMPLE_RATE}
+CHANNELS_KEYS = {'EEG': 'eeg_channels', 'PPG': 'ppg_channels'}
+
+# Offer the batched binary protocol to clients that ask for it (see lib/protocol.py)
+BINARY_PROTOCOL = os.getenv("BINARY") == "true"
+
+# Send samples unfiltered and leave filtering to the client (the VCV plugin's filter bank)
+RAW_SAMPLES = os.getenv("RAW") == "true"
+
+# How often to look for headbands that came online after startup (seconds)
+DISCOVERY_INTERVAL = 5
 
 class GenericSignalStreamer:
     def __init__(self, signal_type, sample_rate, num_sensors, samples_per_chunk):
@@ -26,14 +41,8 @@ class GenericSignalStreamer:
         self.window = 5 # what is this?
         self.firwin_size = EEG_FIRWIN_SIZE if self.signal_type == 'EEG' else PPG_FIRWIN_SIZE
 
-    async def setup_stream(self):
-        streams = []
-        while len(streams) == 0:
-            print(f"Waiting for {self.signal_type} stream...")
-            await asyncio.sleep(1)
-            streams = resolve_byprop('type', self.signal_type, timeout=2)
-        print(f"Got {self.signal_type} stream")
-        self.inlet = StreamInlet(streams[0], max_chunklen=self.samples_per_chunk)
+    def setup_stream(self, stream_info):
+        self.inlet = StreamInlet(stream_info, max_chunklen=self.samples_per_chunk)
         print(f"{self.signal_type} sample rate:", self.inlet.info().nominal_srate())
         info = self.inlet.info()
         self.sfreq = info.nominal_srate()
@@ -51,7 +60,7 @@ class GenericSignalStreamer:
         self.data_f = np.zeros((self.n_samples, self.n_chan))
 
 
-    async def pull_samples(self):
+    def pull_samples(self):
         samples, timestamps = self.inlet.pull_chunk(max_samples=self.samples_per_chunk)
         if not timestamps or len(timestamps) == 1:
             return [], []
@@ -66,10 +75,13 @@ class GenericSignalStreamer:
         self.times = self.times[-self.n_samples:]
         self.data = np.vstack([self.data, samples])
         self.data = self.data[-self.n_samples:]
-        filt_samples, self.filt_state = lfilter(
-            self.bf, self.af,
-            samples,
-            axis=0, zi=self.filt_state)
+        if RAW_SAMPLES:
+            filt_samples = samples
+        else:
+            filt_samples, self.filt_state = lfilter(
+                self.bf, self.af,
+                samples,
+                axis=0, zi=self.filt_state)
         self.data_f = np.vstack([self.data_f, filt_samples])
         self.data_f = self.data_f[-self.n_samples:]
 
@@ -77,112 +89,296 @@ class GenericSignalStreamer:
         new_times = self.times[-num_samples:].tolist()
         return new_data, new_times
 
+def device_id(stream_info):
+    """
+    muselsl gives a headband's EEG and PPG streams the same source ID (built from
+    its Bluetooth address); fall back to the stream name for sources without one.
+    """
+    return stream_info.source_id() or stream_info.name()
+
+class Device:
+    """
+    One headband: its EEG and (optional) PPG streams, plus what has been pulled
+    from them but not yet sent.
+    """
+    def __init__(self, index, id, name):
+        self.index = index
+        self.id = id
+        self.name = name
+        self.eeg_streamer = None
+        self.ppg_streamer = None
+        self.eeg_buffer = []
+        self.ppg_buffer = []
+        # Binary message sequence numbers, one count per subscription (see protocol.Subscription.key)
+        self.binary_sequences = {}
+        # Samples waiting to fill a decimation block, keyed by (stream, factor)
+        self.decimation_carry = {}
+        # Per-stream bookkeeping for the console log, keyed by 'EEG' / 'PPG'
+        self.latest_timestamp = {}
+        self.current_second = {}
+        self.datapoints_this_second = {}
+
+    def describe(self):
+        return {'index': self.index, 'id': self.id, 'name': self.name}
+
+    def matches(self, key):
+        """Clients pick a device by index or ID in the URL path; an empty path means the first one"""
+        return key == self.id or key == str(self.index) or (key == '' and self.index == 0)
+
+    def pull_samples(self):
+        """Runs on a worker thread, one device at a time per worker"""
+        eeg_data, eeg_times = self.eeg_streamer.pull_samples()
+        ppg_data, ppg_times = self.ppg_streamer.pull_samples() if self.ppg_streamer else ([], [])
+        return eeg_data, eeg_times, ppg_data, ppg_times
+
 class BioSignalStreamer:
     def __init__(self, host='0.0.0.0', port=8765):
         self.host = host
         self.port = port
-        self.clients = set()
-        self.eeg_streamer = GenericSignalStreamer('EEG', EEG_SAMPLE_RATE, params.NUM_EEG_SENSORS, EEG_SAMPLES_PER_CHUNK)
-        self.ppg_streamer = GenericSignalStreamer('PPG', PPG_SAMPLE_RATE, params.NUM_PPG_SENSORS, PPG_SAMPLES_PER_CHUNK)
-        self.eeg_buffer = []
-        self.ppg_buffer = []
+        # websocket -> the device key from its URL path
+        self.clients = {}
+        # websocket -> the protocol.Subscription it last sent
+        self.subscriptions = {}
+        # Every headband seen, in the order they were found
+        self.devices = []
         self.buffer_lock = asyncio.Lock()
+        # One worker per core, so each device's pull and filter runs alongside the others
+        self.executor = ThreadPoolExecutor(max_workers=os.cpu_count())
+        # All devices share one time base, so group sessions line up
+        self.first_timestamp = None
 
-    async def handle_client(self, websocket, path):
-        print(f"New client connected from {websocket.remote_address}")
-        self.clients.add(websocket)
+    async def handle_client(self, websocket, path=None):
+        # websockets 14 and later pass only the connection, with the path on its request
+        if path is None:
+            request = getattr(websocket, 'request', None)
+            path = request.path if request is not None else getattr(websocket, 'path', '')
+        key = unquote(path.split('?')[0].strip('/'))
+        print(f"New client connected from {websocket.remote_address} for device '{key or 'default'}'")
+        self.clients[websocket] = key
+        self.subscriptions[websocket] = protocol.Subscription()
         try:
-            print(f"Waiting for client {websocket.remote_address} to close")
-            await websocket.wait_closed()
+            await self.send_device_list([websocket])
+            # Clients only send control messages; this ends when the connection closes
+            async for message in websocket:
+                self.handle_message(websocket, message)
+        except websockets.ConnectionClosed:
+            pass
         finally:
-            self.clients.remove(websocket)
+            del self.clients[websocket]
+            del self.subscriptions[websocket]
             print(f"Client disconnected: {websocket.remote_address}")
 
-    async def setup_streams(self):
+    def handle_message(self, websocket, message):
+        if not isinstance(message, str):
+            return
+        try:
+            subscription = protocol.Subscription.parse(message)
+        except ValueError as e:
+            print(f"Ignoring subscription from {websocket.remote_address}: {e}")
+            return
+        if subscription:
+            self.subscriptions[websocket] = subscription
+            print(f"Client {websocket.remote_address} subscribed to {subscription.describe()}")
+
+    def resolve(self, signal_type):
+        return resolve_byprop('type', signal_type, timeout=2)
+
+    async def discover_devices(self):
+        """Add any headband whose EEG stream has appeared since we last looked"""
+        loop = asyncio.get_running_loop()
+        eeg_streams, ppg_streams = await asyncio.gather(
+            loop.run_in_executor(self.executor, self.resolve, 'EEG'),
+            loop.run_in_executor(self.executor, self.resolve, 'PPG'))
+        known = {device.id for device in self.devices}
+        ppg_by_device = {device_id(info): info for info in ppg_streams}
+        added = False
+        for info in eeg_streams:
+            id = device_id(info)
+            if id in known:
+                continue
+            device = Device(len(self.devices), id, info.name())
+            device.eeg_streamer = GenericSignalStreamer('EEG', EEG_SAMPLE_RATE, params.NUM_EEG_SENSORS, EEG_SAMPLES_PER_CHUNK)
+            device.eeg_streamer.setup_stream(info)
+            if id in ppg_by_device:
+                device.ppg_streamer = GenericSignalStreamer('PPG', PPG_SAMPLE_RATE, params.NUM_PPG_SENSORS, PPG_SAMPLES_PER_CHUNK)
+                device.ppg_streamer.setup_stream(ppg_by_device[id])
+            print(f"Got device {device.index}: {device.name} ({id}){'' if device.ppg_streamer else ', no PPG'}")
+            self.devices.append(device)
+            known.add(id)
+            added = True
+        if added:
+            await self.send_device_list(list(self.clients))
+
+    async def send_device_list(self, clients):
+        if not clients:
+            return
+        message = json.dumps({'devices': [device.describe() for device in self.devices]})
         await asyncio.gather(
-            self.eeg_streamer.setup_stream(),
-            self.ppg_streamer.setup_stream()
+            *[client.send(message) for client in clients],
+            return_exceptions=True
         )
 
     async def stream_data(self):
-        await self.setup_streams()
+        while not self.devices:
+            print("Waiting for EEG streams...")
+            await self.discover_devices()
+        last_discovery = time.time()
+        loop = asyncio.get_running_loop()
         while True:
-            await self.pull_samples()
+            if time.time() - last_discovery > DISCOVERY_INTERVAL:
+                asyncio.ensure_future(self.discover_devices())
+                last_discovery = time.time()
+            devices = list(self.devices)
+            pulled = await asyncio.gather(
+                *[loop.run_in_executor(self.executor, device.pull_samples) for device in devices])
+            async with self.buffer_lock:
+                for device, (eeg_data, eeg_times, ppg_data, ppg_times) in zip(devices, pulled):
+                    for i, eeg_time in enumerate(eeg_times):
+                        device.eeg_buffer.append({
+                            'timestamp': eeg_time,
+                            'eeg_channels': eeg_data[i],
+                        })
+                    for i, ppg_time in enumerate(ppg_times):
+                        device.ppg_buffer.append({
+                            'timestamp': ppg_time,
+                            'ppg_channels': ppg_data[i],
+                        })
             await asyncio.sleep(0.01)  # Small delay to allow for collation
 
-    async def pull_samples(self):
-        eeg_data, eeg_times = await self.eeg_streamer.pull_samples()
-        ppg_data, ppg_times = await self.ppg_streamer.pull_samples()
-
-        async with self.buffer_lock:
-            for i, eeg_time in enumerate(eeg_times):
-                datapoint = {
-                    'timestamp': eeg_time,
-                    'eeg_channels': eeg_data[i],
-                }
-                self.eeg_buffer.append(datapoint)
-
-            for i, ppg_time in enumerate(ppg_times):
-                datapoint = {
-                    'timestamp': ppg_time,
-                    'ppg_channels': ppg_data[i],
-                }
-                self.ppg_buffer.append(datapoint)
-
-
     async def send_data_to_clients(self):
         while True:
-            if not self.eeg_buffer or not self.ppg_buffer:
+            if not any(device.eeg_buffer or device.ppg_buffer for device in self.devices):
                 await asyncio.sleep(0.1)
                 continue
-            async with self.buffer_lock:
-                eeg_points = self.eeg_buffer
-                ppg_points = self.ppg_buffer
-                self.eeg_buffer = []
-                self.ppg_buffer = []
-            for datapoint in eeg_points:
-                closest_ppg = min(ppg_points, key=lambda x: abs(x['timestamp'] - datapoint['timestamp']))
-                datapoint['ppg_channels'] = closest_ppg['ppg_channels']
-            for datapoint in eeg_points:
-                await self.send_datapoint_to_clients(datapoint)
+            for device in list(self.devices):
+                async with self.buffer_lock:
+                    eeg_points = device.eeg_buffer
+                    ppg_points = device.ppg_buffer
+                    device.eeg_buffer = []
+                    device.ppg_buffer = []
+                # EEG and PPG are separate streams, each at its native rate with its own timestamps
+                for datapoint in eeg_points:
+                    self.stamp_datapoint(device, datapoint, 'EEG')
+                for datapoint in ppg_points:
+                    self.stamp_datapoint(device, datapoint, 'PPG')
+                await self.send_to_subscribers(device, {'EEG': eeg_points, 'PPG': ppg_points})
             await asyncio.sleep(0.1)  # Adjust this delay as needed
 
+    def device_clients(self, device):
+        return [c for c, key in self.clients.items() if device.matches(key)]
 
-    async def send_datapoint_to_clients(self, datapoint):
-        if hasattr(self, 'latest_timestamp'):
-            if datapoint['timestamp'] < self.latest_timestamp:
-                print("Out of order data", datapoint['timestamp'], self.latest_timestamp)
-        else:
-            self.latest_timestamp = datapoint['timestamp']
-            self.first_timestamp = datapoint['timestamp']
-
-        if hasattr(self, 'current_second'):
-            new_second = int(datapoint['timestamp'])
-            if new_second != self.current_second:
-                print("New second", self.current_second, self.datapoints_this_second)
-                self.current_second = new_second
-                self.datapoints_this_second = 0
-
-        if not hasattr(self, 'datapoints_this_second'):
-            self.datapoints_this_second = 0
-
-
-        self.latest_timestamp = datapoint['timestamp']
-        self.current_second = int(self.latest_timestamp)
-        self.datapoints_this_second += 1
-        datapoint['timestamp'] = datapoint['timestamp'] - self.first_timestamp
-        # print("Sending data", datapoint['timestamp'], self.current_second, self.datapoints_this_second)
-        message = json.dumps(datapoint)
-        if self.clients:
+    async def send_to_subscribers(self, device, points):
+        """
+        Clients with the same protocol and subscription share their messages, so
+        each stream is filtered down to a group's channels, decimated and
+        encoded once per group rather than once per client
+        """
+        groups = {}
+        for client in self.device_clients(device):
+            subscription = self.subscriptions[client]
+            binary = client.subprotocol == protocol.BINARY_SUBPROTOCOL
+            groups.setdefault((binary, subscription.key()), (subscription, []))[1].append(client)
+
+        # Each stream is decimated once per factor, however many groups use it
+        decimated = {}
+        for (binary, _), (subscription, clients) in groups.items():
+            for stream in ('EEG', 'PPG'):
+                if not subscription.channels[stream]:
+                    continue
+                factor = subscription.decimation[stream]
+                if (stream, factor) not in decimated:
+                    carry = device.decimation_carry.setdefault((stream, factor), [])
+                    decimated[(stream, factor)] = protocol.decimate(points[stream], CHANNELS_KEYS[stream], factor, carry)
+                datapoints = decimated[(stream, factor)]
+                if not datapoints:
+                    continue
+                if binary:
+                    await self.send_batch_to_binary_clients(device, clients, subscription, stream, datapoints)
+                else:
+                    await self.send_datapoints_to_json_clients(device, clients, subscription, stream, datapoints)
+        # Leftovers for a factor nobody uses any more would be stale by the time someone does
+        for key in list(device.decimation_carry):
+            if key not in decimated:
+                del device.decimation_carry[key]
+
+    @staticmethod
+    def select_channels(subscription, stream, datapoint):
+        values = datapoint[CHANNELS_KEYS[stream]]
+        if subscription.is_complete(stream):
+            return values
+        return [values[c] for c in subscription.channels[stream]]
+
+    async def send_batch_to_binary_clients(self, device, clients, subscription, stream, datapoints):
+        # Rows that leave channels out say which ones they kept
+        masks = None
+        if not subscription.is_complete(stream):
+            masks = (subscription.mask('EEG'), 0) if stream == 'EEG' else (0, subscription.mask('PPG'))
+        key = subscription.key()
+        messages = []
+        for start in range(0, len(datapoints), protocol.MAX_SAMPLES_PER_MESSAGE):
+            batch = datapoints[start:start + protocol.MAX_SAMPLES_PER_MESSAGE]
+            rows = [self.select_channels(subscription, stream, d) for d in batch]
+            sequence = device.binary_sequences.get(key, 0)
+            messages.append(protocol.encode_batch(
+                [d['timestamp'] for d in batch],
+                rows if stream == 'EEG' else None,
+                rows if stream == 'PPG' else None,
+                SAMPLE_RATES[stream] / subscription.decimation[stream],
+                sequence,
+                masks))
+            device.binary_sequences[key] = sequence + 1
+        for message in messages:
+            await asyncio.gather(
+                *[client.send(message) for client in clients],
+                return_exceptions=True
+            )
+
+    async def send_datapoints_to_json_clients(self, device, clients, subscription, stream, datapoints):
+        channels_key = CHANNELS_KEYS[stream]
+        for datapoint in datapoints:
+            message = {
+                'timestamp': datapoint['timestamp'],
+                channels_key: self.select_channels(subscription, stream, datapoint),
+                'device': device.id,
+            }
+            if not subscription.is_complete(stream):
+                message['channels'] = list(subscription.channels[stream])
+            if subscription.decimation[stream] > 1:
+                message['sample_rate'] = SAMPLE_RATES[stream] / subscription.decimation[stream]
+            message = json.dumps(message)
             await asyncio.gather(
-                *[client.send(message) for client in self.clients],
+                *[client.send(message) for client in clients],
                 return_exceptions=True
             )
 
+    def stamp_datapoint(self, device, datapoint, stream):
+        """Logs a datapoint and moves it onto the time base shared by every device"""
+        timestamp = datapoint['timestamp']
+        if self.first_timestamp is None:
+            self.first_timestamp = timestamp
+
+        if stream in device.latest_timestamp and timestamp < device.latest_timestamp[stream]:
+            print("Out of order data", device.index, stream, timestamp, device.latest_timestamp[stream])
+
+        new_second = int(timestamp)
+        if stream in device.current_second and new_second != device.current_second[stream]:
+            print("New second", device.index, stream, device.current_second[stream], device.datapoints_this_second[stream])
+            device.datapoints_this_second[stream] = 0
+
+        device.latest_timestamp[stream] = timestamp
+        device.current_second[stream] = new_second
+        device.datapoints_this_second[stream] = device.datapoints_this_second.get(stream, 0) + 1
+        # Every stream of every device shares one time base
+        datapoint['timestamp'] = timestamp - self.first_timestamp
+
 
     async def run(self):
-        server = await websockets.serve(self.handle_client, self.host, self.port)
+        subprotocols = [protocol.BINARY_SUBPROTOCOL] if BINARY_PROTOCOL else None
+        server = await websockets.serve(self.handle_client, self.host, self.port,
+                                        subprotocols=subprotocols)
         print(f"WebSocket server started on ws://{self.host}:{self.port}")
+        if BINARY_PROTOCOL:
+            print(f"Offering the {protocol.BINARY_SUBPROTOCOL} protocol")
         print("Waiting for clients to connect...")
         
         await asyncio.gather(
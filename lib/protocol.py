@@ -0,0 +1,160 @@
+import json
+import struct
+import numpy as np
+import lib.params as params
+
+# Binary sample protocol, see vcv/MuseHeadband/src/MuseProtocol.hpp
+# Clients opt in by offering this WebSocket subprotocol; everyone else gets JSON.
+BINARY_SUBPROTOCOL = 'muse-binary-v1'
+BINARY_VERSION = 1
+FLAG_SAMPLE_TIMES = 0x01
+# Two bytes after the header, the EEG and PPG channel masks: the rows carry only those channels
+FLAG_CHANNEL_MASKS = 0x02
+
+# magic, version, flags, eeg channels, ppg channels, sample count,
+# sample rate, sequence, first timestamp
+HEADER_FORMAT = '<2sBBBBHfId'
+MAX_SAMPLES_PER_MESSAGE = 0xFFFF
+# Largest factor a subscription may reduce a stream's rate by
+MAX_DECIMATION = 16
+
+def _rows(rows, count):
+    if rows is None:
+        return np.zeros((count, 0), dtype='<f4')
+    return np.asarray(rows, dtype='<f4').reshape(count, -1)
+
+def encode_batch(timestamps, eeg_rows, ppg_rows, sample_rate, sequence, channel_masks=None):
+    """
+    Packs a batch of samples into one binary message: a header followed by
+    float32 rows of [dt, eeg..., ppg...], where dt is seconds after the first
+    timestamp. Either eeg_rows or ppg_rows may be None, so EEG and PPG can
+    travel as separate streams at their own sample rates. When the rows hold
+    only some channels, channel_masks is (eeg mask, ppg mask) naming them.
+    """
+    timestamps = np.asarray(timestamps, dtype=np.float64)
+    eeg = _rows(eeg_rows, len(timestamps))
+    ppg = _rows(ppg_rows, len(timestamps))
+    first_timestamp = float(timestamps[0])
+    dt = (timestamps - first_timestamp).astype('<f4').reshape(-1, 1)
+    rows = np.hstack([dt, eeg, ppg]).astype('<f4')
+    flags = FLAG_SAMPLE_TIMES | (FLAG_CHANNEL_MASKS if channel_masks else 0)
+    header = struct.pack(HEADER_FORMAT, b'MB', BINARY_VERSION, flags,
+                         eeg.shape[1], ppg.shape[1], len(timestamps),
+                         float(sample_rate), sequence & 0xFFFFFFFF, first_timestamp)
+    if channel_masks:
+        header += struct.pack('<BB', *channel_masks)
+    return header + rows.tobytes()
+
+class Subscription:
+    """
+    What a client asked for in a control message: which channels of each
+    stream, and how many samples to average into one.
+
+      {"subscribe": {"eeg": [0, 1, 2, 3], "ppg": [1], "eeg_decimation": 1, "ppg_decimation": 2}}
+
+    Clients that never send one get every channel at the native rate.
+    """
+    NUM_CHANNELS = {'EEG': params.NUM_EEG_SENSORS, 'PPG': params.NUM_PPG_SENSORS}
+
+    def __init__(self, eeg=None, ppg=None, eeg_decimation=1, ppg_decimation=1):
+        self.channels = {
+            'EEG': tuple(range(params.NUM_EEG_SENSORS)) if eeg is None else tuple(sorted(set(eeg))),
+            'PPG': tuple(range(params.NUM_PPG_SENSORS)) if ppg is None else tuple(sorted(set(ppg))),
+        }
+        self.decimation = {'EEG': eeg_decimation, 'PPG': ppg_decimation}
+
+    @classmethod
+    def parse(cls, message):
+        """The subscription in a text message, None if it isn't one. Raises ValueError if it is malformed."""
+        try:
+            request = json.loads(message)
+        except ValueError:
+            return None
+        if not isinstance(request, dict) or 'subscribe' not in request:
+            return None
+        fields = request['subscribe']
+        if not isinstance(fields, dict):
+            raise ValueError('subscribe must be an object')
+        subscription = cls()
+        for stream, key in (('EEG', 'eeg'), ('PPG', 'ppg')):
+            if key in fields:
+                channels = fields[key]
+                if not isinstance(channels, list) or not all(
+                        isinstance(c, int) and 0 <= c < cls.NUM_CHANNELS[stream] for c in channels):
+                    raise ValueError(f'{key} must list channels below {cls.NUM_CHANNELS[stream]}')
+                subscription.channels[stream] = tuple(sorted(set(channels)))
+            decimation = fields.get(key + '_decimation', 1)
+            if not isinstance(decimation, int) or not 1 <= decimation <= MAX_DECIMATION:
+                raise ValueError(f'{key}_decimation must be 1-{MAX_DECIMATION}')
+            subscription.decimation[stream] = decimation
+        return subscription
+
+    def key(self):
+        """Equal for clients that can share the same messages"""
+        return (self.channels['EEG'], self.channels['PPG'], self.decimation['EEG'], self.decimation['PPG'])
+
+    def is_complete(self, stream):
+        return len(self.channels[stream]) == self.NUM_CHANNELS[stream]
+
+    def mask(self, stream):
+        return sum(1 << c for c in self.channels[stream])
+
+    def describe(self):
+        return ', '.join(f"{stream} {list(self.channels[stream])} / {self.decimation[stream]}" for stream in ('EEG', 'PPG'))
+
+def decimate(datapoints, channels_key, factor, carry):
+    """
+    Averages every `factor` datapoints into one, stamped with the mean of their
+    timestamps. Leftovers wait in `carry` (a list, kept by the caller between
+    batches) for the next call, so blocks span batch boundaries.
+    """
+    if factor == 1:
+        return datapoints
+    pending = carry + datapoints
+    blocks = len(pending) // factor
+    carry[:] = pending[blocks * factor:]
+    decimated = []
+    for b in range(blocks):
+        block = pending[b * factor:(b + 1) * factor]
+        width = len(block[0][channels_key])
+        decimated.append({
+            'timestamp': sum(d['timestamp'] for d in block) / factor,
+            channels_key: [sum(float(d[channels_key][c]) for d in block) / factor for c in range(width)],
+        })
+    return decimated
+
+# Dashboard feature frames from lib/server.py, decoded by web/websocket.js.
+# Clients that offer this subprotocol get only what changed since the last frame
+# they were sent; everyone else gets the whole JSON snapshot.
+FEATURES_SUBPROTOCOL = 'muse-features-v1'
+FEATURES_VERSION = 1
+# magic, version, section count, update sequence
+FEATURES_HEADER_FORMAT = '<2sBBI'
+# kind, flags, channels, rows, number of the first row's sample, sample rate;
+# float32 rows follow. Everything stays 4-byte aligned.
+SECTION_HEADER_FORMAT = '<BBHIIf'
+SECTION_EEG = 1
+SECTION_PPG = 2
+SECTION_JOYSTICK = 3
+SECTION_EEG_FFT = 4
+SECTION_PPG_FFT = 5
+SECTION_JOYSTICK_FFT = 6
+# Rows are delta to gamma, columns EEG channels
+SECTION_EEG_BANDS = 7
+# The rows replace what the client holds instead of appending to it
+SECTION_RESET = 0x01
+
+def encode_features(sequence, sections):
+    """
+    Packs one feature frame. Each section is (kind, flags, first sample number,
+    sample rate, rows), with rows a 2-D array of channels per row.
+    """
+    parts = [struct.pack(FEATURES_HEADER_FORMAT, b'MF', FEATURES_VERSION, len(sections), sequence & 0xFFFFFFFF)]
+    for kind, flags, first, sample_rate, rows in sections:
+        rows = np.asarray(rows, dtype='<f4')
+        if rows.ndim == 1:
+            rows = rows.reshape(-1, 1)
+        parts.append(struct.pack(SECTION_HEADER_FORMAT, kind, flags, rows.shape[1], rows.shape[0],
+                                 first & 0xFFFFFFFF, float(sample_rate)))
+        parts.append(rows.tobytes())
+    return b''.join(parts)
@@ -1,31 +1,163 @@
 import asyncio
 import websockets
 import json
-import time
 
 import lib.eeg as eeg
 import lib.joystick as joystick
 import lib.params as params
+import lib.protocol as protocol
+from lib.fft import compute_fft
+
+# How often the broadcaster looks for new samples
+POLL_INTERVAL = 0.05
+BAND_NAMES = ('delta', 'theta', 'alpha', 'beta', 'gamma')
+
+class Stream:
+    """One buffer as a snapshot saw it, with its spectrum"""
+    def __init__(self, buffer, sequence, sample_rate):
+        self.buffer = buffer
+        self.sequence = sequence
+        self.sample_rate = sample_rate
+        self.fft, self.buckets, self.bands = compute_fft(buffer, sample_rate)
+
+    @classmethod
+    def update(cls, previous, buffer, sequence, sample_rate):
+        """`previous` if nothing was added since, so its spectrum isn't computed again"""
+        if previous is not None and previous.sequence == sequence and previous.sample_rate == sample_rate:
+            return previous
+        return cls(buffer, sequence, sample_rate)
+
+    def samples_since(self, other):
+        """(flags, first sample number, rows): the rows `other` hasn't got, or the whole buffer"""
+        new = self.sequence - other.sequence if other is not None else -1
+        if (other is None or other.sample_rate != self.sample_rate
+                or other.buffer.shape != self.buffer.shape or not 0 <= new <= len(self.buffer)):
+            return protocol.SECTION_RESET, self.sequence - len(self.buffer), self.buffer
+        return 0, other.sequence, self.buffer[len(self.buffer) - new:]
+
+class Snapshot:
+    """
+    Every buffer and spectrum at one moment. Spectra are computed once per
+    snapshot whatever the number of clients, and each encoding is cached, so
+    clients that are in step share one message.
+    """
+    SECTIONS = {
+        'eeg': (protocol.SECTION_EEG, protocol.SECTION_EEG_FFT),
+        'ppg': (protocol.SECTION_PPG, protocol.SECTION_PPG_FFT),
+        'joystick': (protocol.SECTION_JOYSTICK, protocol.SECTION_JOYSTICK_FFT),
+    }
+
+    def __init__(self, sequence, streams):
+        self.sequence = sequence
+        self.streams = streams
+        self.json = None
+        self.deltas = {}
+
+    def to_json(self):
+        """The whole snapshot, for clients that don't take feature frames"""
+        if self.json is None:
+            data = {
+                'eeg_sample_rate': self.streams['eeg'].sample_rate,
+                'ppg_sample_rate': self.streams['ppg'].sample_rate,
+                'eeg_bands': self.streams['eeg'].bands,
+            }
+            for name, stream in self.streams.items():
+                data[name + '_buffer'] = stream.buffer.tolist()
+                data[name + '_fft'] = stream.fft.tolist()
+                data[name + '_frequency_buckets'] = stream.buckets.tolist()
+            self.json = json.dumps(data)
+        return self.json
+
+    def delta(self, sent):
+        """A feature frame with what changed since the snapshot `sent` (None for everything)"""
+        key = sent.sequence if sent is not None else None
+        if key not in self.deltas:
+            sections = []
+            for name, stream in self.streams.items():
+                previous = sent.streams[name] if sent is not None else None
+                if stream is previous:
+                    continue
+                samples_kind, fft_kind = self.SECTIONS[name]
+                flags, first, rows = stream.samples_since(previous)
+                sections.append((samples_kind, flags, first, stream.sample_rate, rows))
+                sections.append((fft_kind, protocol.SECTION_RESET, 0, stream.sample_rate, stream.fft))
+                if name == 'eeg':
+                    bands = [stream.bands[band] for band in BAND_NAMES]
+                    sections.append((protocol.SECTION_EEG_BANDS, protocol.SECTION_RESET, 0, stream.sample_rate, bands))
+            self.deltas[key] = protocol.encode_features(self.sequence, sections)
+        return self.deltas[key]
+
+class Broadcaster:
+    """
+    Takes a snapshot whenever samples arrive and wakes the clients. Each client
+    sends at its own pace: one that is still busy sending skips the snapshots
+    in between, and its next frame covers everything since the last one it was
+    sent, so nothing queues up behind a slow client.
+    """
+    def __init__(self):
+        self.latest = None
+        self.updated = asyncio.Condition()
+
+    def poll(self):
+        """A new snapshot if any buffer has grown, else None"""
+        eeg_buffer, eeg_sequence, ppg_buffer, ppg_sequence = eeg.get_buffers()
+        joystick_buffer, joystick_sequence = joystick.get_buffer()
+        previous = self.latest.streams if self.latest is not None else {}
+        streams = {
+            'eeg': Stream.update(previous.get('eeg'), eeg_buffer, eeg_sequence, eeg.eeg_sample_rate),
+            'ppg': Stream.update(previous.get('ppg'), ppg_buffer, ppg_sequence, eeg.ppg_sample_rate),
+            'joystick': Stream.update(previous.get('joystick'), joystick_buffer, joystick_sequence,
+                                      params.JOYSTICK_SAMPLE_RATE_HZ),
+        }
+        if self.latest is not None and all(streams[name] is previous[name] for name in streams):
+            return None
+        return Snapshot(self.latest.sequence + 1 if self.latest is not None else 1, streams)
+
+    async def run(self):
+        while True:
+            snapshot = self.poll()
+            if snapshot is not None:
+                async with self.updated:
+                    self.latest = snapshot
+                    self.updated.notify_all()
+            await asyncio.sleep(POLL_INTERVAL)
+
+    async def next_after(self, sent):
+        """The newest snapshot, once there is one newer than `sent`"""
+        async with self.updated:
+            await self.updated.wait_for(lambda: self.latest is not None and self.latest is not sent)
+            return self.latest
+
+broadcaster = None
 
 # WebSocket server handler function
-async def websocket_handler(websocket, path):
-    print("WEBSOCKET CONNECTED")
-    while True:
-        data = eeg.get_data()
-        data.update(joystick.get_data())
-        try:
-            await websocket.send(json.dumps(data))
-        except Exception as e:
-            break
-        time.sleep(params.OVERLAP_LENGTH)
+async def websocket_handler(websocket, path=None):
+    binary = websocket.subprotocol == protocol.FEATURES_SUBPROTOCOL
+    print(f"WEBSOCKET CONNECTED ({'feature frames' if binary else 'JSON'})")
+    sent = None
+    try:
+        while True:
+            snapshot = await broadcaster.next_after(sent)
+            if binary:
+                await websocket.send(snapshot.delta(sent))
+            else:
+                await websocket.send(snapshot.to_json())
+                # Whole snapshots go out at the old rate
+                await asyncio.sleep(params.OVERLAP_LENGTH)
+            sent = snapshot
+    except websockets.ConnectionClosed:
+        pass
 
 # Function to start the WebSocket server
 async def start_server():
+    global broadcaster
     print("START SERVER")
-    server = await websockets.serve(websocket_handler, 'localhost', 8080)
+    broadcaster = Broadcaster()
+    asyncio.ensure_future(broadcaster.run())
+    server = await websockets.serve(websocket_handler, 'localhost', 8080,
+                                    subprotocols=[protocol.FEATURES_SUBPROTOCOL])
     await server.wait_closed()
 
 def start_server_in_thread(loop):
     asyncio.set_event_loop(loop)
     loop.run_until_complete(start_server())
-
@@ -0,0 +1,95 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "SampleRing.hpp"
+#include "MuseProtocol.hpp"
+
+// Samples and messages shaped the way lib/livestream.py sends them, shared by
+// the benchmark and the load generator
+
+struct Row {
+    double timestamp;
+    float eeg[NUM_EEG_CHANNELS];
+    float ppg[NUM_PPG_CHANNELS];
+};
+
+inline std::vector<Row> loadRecording(const char* path) {
+    std::vector<Row> rows;
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return rows;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        Row row;
+        char* p = line;
+        row.timestamp = strtod(p, &p);
+        for (int c = 0; c < NUM_EEG_CHANNELS; c++) {
+            row.eeg[c] = strtof(p + 1, &p);
+        }
+        for (int c = 0; c < NUM_PPG_CHANNELS; c++) {
+            row.ppg[c] = strtof(p + 1, &p);
+        }
+        rows.push_back(row);
+    }
+    fclose(f);
+    return rows;
+}
+
+inline void appendF32(std::string& out, float value) {
+    uint8_t bytes[4];
+    memcpy(bytes, &value, 4);
+    out.append((const char*) bytes, 4);
+}
+
+// Same layout as lib/protocol.py encode_batch
+inline std::string encodeBatch(const std::vector<Row>& rows, size_t first, size_t count, size_t step,
+                               bool eeg, double sampleRate, uint32_t sequence) {
+    std::string out;
+    uint8_t head[BINARY_HEADER_SIZE] = {BINARY_MAGIC_0, BINARY_MAGIC_1, BINARY_VERSION, FLAG_SAMPLE_TIMES};
+    head[4] = eeg ? NUM_EEG_CHANNELS : 0;
+    head[5] = eeg ? 0 : NUM_PPG_CHANNELS;
+    head[6] = count & 0xFF;
+    head[7] = count >> 8;
+    float rate = sampleRate;
+    memcpy(head + 8, &rate, 4);
+    memcpy(head + 12, &sequence, 4);
+    double firstTimestamp = rows[first].timestamp;
+    memcpy(head + 16, &firstTimestamp, 8);
+    out.append((const char*) head, sizeof(head));
+    for (size_t i = 0; i < count; i++) {
+        const Row& row = rows[first + i * step];
+        appendF32(out, row.timestamp - firstTimestamp);
+        if (eeg) {
+            for (int c = 0; c < NUM_EEG_CHANNELS; c++) appendF32(out, row.eeg[c]);
+        } else {
+            for (int c = 0; c < NUM_PPG_CHANNELS; c++) appendF32(out, row.ppg[c]);
+        }
+    }
+    return out;
+}
+
+// Unmasked server-to-client frame
+inline void appendServerFrame(std::string& wire, int opcode, const std::string& payload) {
+    size_t len = payload.size();
+    wire.push_back((char) (0x80 | opcode));
+    if (len < 126) {
+        wire.push_back((char) len);
+    } else if (len <= 0xFFFF) {
+        wire.push_back((char) 126);
+        wire.push_back((char) (len >> 8));
+        wire.push_back((char) (len & 0xFF));
+    } else {
+        wire.push_back((char) 127);
+        for (int i = 0; i < 8; i++) {
+            wire.push_back((char) (((uint64_t) len >> (56 - 8 * i)) & 0xFF));
+        }
+    }
+    wire += payload;
+}
@@ -0,0 +1,476 @@
+// Headless benchmarks for the Rack-independent core in src/.
+//
+// Replays a recording in the fake_data.csv layout (timestamp, 5 EEG, 3 PPG
+// per row at 256 Hz) through each stage of the receive path, shaped the way
+// lib/livestream.py sends it, and reports ns/sample, heap allocations/sample
+// and throughput. The paced runs deliver the recording in 100 ms batches at
+// 1x to 1000x real time, as the server would, and report the CPU share the
+// receive path needs at that rate.
+//
+//   make bench
+//   build/bench [recording.csv] [seconds per run]
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "WebSocketFrame.hpp"
+#include "SampleRing.hpp"
+#include "MuseJson.hpp"
+#include "MuseProtocol.hpp"
+#include "ChannelStats.hpp"
+#include "BandPower.hpp"
+#include "JitterBuffer.hpp"
+#include "BeatDetector.hpp"
+#include "SignalQuality.hpp"
+#include "FilterBank.hpp"
+#include "ServerMessages.hpp"
+
+// Every heap allocation in the process, including jansson's
+static std::atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+static void* countingMalloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size);
+}
+
+static const double EEG_RATE = 256.0;
+static const double PPG_RATE = 64.0;
+static const int PPG_DECIMATION = 4;
+// lib/livestream.py flushes its buffers every 100 ms
+static const double BATCH_SECONDS = 0.1;
+static const double ENGINE_RATE = 48000.0;
+// muselsl's source ID for a headband, as lib/livestream.py tags each JSON sample
+static const char* const DEVICE_ID = "Muse00:55:DA:B0:12:34";
+
+// One message as the server sends it
+struct Message {
+    int opcode;
+    std::string payload;
+    // EEG samples it carries, the unit everything is reported in
+    size_t eegSamples;
+};
+
+// The recording as JSON messages or binary batches, EEG at 256 Hz and PPG at its native 64 Hz
+static std::vector<Message> buildMessages(const std::vector<Row>& rows, bool binary) {
+    std::vector<Message> messages;
+    size_t batch = (size_t) (EEG_RATE * BATCH_SECONDS);
+    uint32_t sequence = 0;
+    for (size_t first = 0; first < rows.size(); first += batch) {
+        size_t count = std::min(batch, rows.size() - first);
+        if (binary) {
+            messages.push_back({easywsclient::BINARY_FRAME,
+                encodeBatch(rows, first, count, 1, true, EEG_RATE, sequence++), count});
+            size_t ppgFirst = (first + PPG_DECIMATION - 1) / PPG_DECIMATION * PPG_DECIMATION;
+            if (ppgFirst < first + count) {
+                size_t ppgCount = (first + count - ppgFirst + PPG_DECIMATION - 1) / PPG_DECIMATION;
+                messages.push_back({easywsclient::BINARY_FRAME,
+                    encodeBatch(rows, ppgFirst, ppgCount, PPG_DECIMATION, false, PPG_RATE, sequence++), 0});
+            }
+            continue;
+        }
+        char text[512];
+        for (size_t i = first; i < first + count; i++) {
+            const Row& row = rows[i];
+            snprintf(text, sizeof(text), "{\"timestamp\": %.6f, \"eeg_channels\": [%.8g, %.8g, %.8g, %.8g, %.8g], \"device\": \"%s\"}",
+                row.timestamp - rows[0].timestamp, row.eeg[0], row.eeg[1], row.eeg[2], row.eeg[3], row.eeg[4], DEVICE_ID);
+            messages.push_back({easywsclient::TEXT_FRAME, text, 1});
+        }
+        for (size_t i = first; i < first + count; i++) {
+            if (i % PPG_DECIMATION != 0) continue;
+            const Row& row = rows[i];
+            snprintf(text, sizeof(text), "{\"timestamp\": %.6f, \"ppg_channels\": [%.8g, %.8g, %.8g], \"device\": \"%s\"}",
+                row.timestamp - rows[0].timestamp, row.ppg[0], row.ppg[1], row.ppg[2], DEVICE_ID);
+            messages.push_back({easywsclient::TEXT_FRAME, text, 0});
+        }
+    }
+    return messages;
+}
+
+static void appendFrame(std::string& wire, const Message& message) {
+    appendServerFrame(wire, message.opcode, message.payload);
+}
+
+// Receive-side state for one stream of messages, as MuseHeadband holds it
+struct Pipeline {
+    easywsclient::FrameDecoder decoder{128 * 1024};
+    SpscRing<MuseFrame, 1024> eegRing;
+    SpscRing<MuseFrame, 256> ppgRing;
+    std::vector<ChannelStats> eegStats;
+    std::vector<ChannelStats> ppgStats;
+    BandPowerEngine engine;
+    BandPowers bands;
+    BeatDetector beats;
+    float window = 1.f;
+    float sink = 0.f;
+    size_t eegSamples = 0;
+
+    Pipeline() {
+        eegStats.resize(NUM_EEG_CHANNELS);
+        ppgStats.resize(NUM_PPG_CHANNELS);
+        for (ChannelStats& stats : eegStats) stats.allocate(EEG_RATE * 30);
+        for (ChannelStats& stats : ppgStats) stats.allocate(EEG_RATE * 30);
+        engine.configure(BandConfig(), EEG_RATE);
+        beats.setSampleRate(PPG_RATE);
+    }
+
+    void pushFrame(const MuseFrame& frame) {
+        if (frame.hasEeg) eegRing.pushOverwrite(frame);
+        if (frame.hasPpg) ppgRing.pushOverwrite(frame);
+    }
+
+    void onMessage(const easywsclient::Message& message) {
+        if (message.opcode == easywsclient::BINARY_FRAME) {
+            BinaryHeader header;
+            decodeBinaryMessage(message.data, message.size, 0.0, header, [&](const MuseFrame& frame) {
+                pushFrame(frame);
+            });
+        } else {
+            MuseFrame frame;
+            if (!parseJsonSample((const char*) message.data, message.size, frame)) {
+                pushFrame(frame);
+            }
+        }
+    }
+
+    // Feed bytes as the socket would deliver them, then drain like process() and analysisThread
+    void receive(const uint8_t* data, size_t len) {
+        decoder.reserve(len);
+        memcpy(decoder.rx.writePtr(), data, len);
+        decoder.rx.commit(len);
+        auto handler = [this](const easywsclient::Message& message) { onMessage(message); };
+        auto control = [](int, const uint8_t*, size_t) { return true; };
+        decoder.decode(handler, control);
+        drain();
+    }
+
+    void drain() {
+        MuseFrame frame;
+        while (eegRing.pop(frame)) {
+            for (int i = 0; i < NUM_EEG_CHANNELS; i++) {
+                updateChannelStats(eegStats[i], frame.eeg[i], EEG_RATE, window);
+                sink += normalizeValue(frame.eeg[i], eegStats[i]);
+            }
+            if (engine.process(frame, bands)) {
+                sink += bands.power[0][0];
+            }
+            eegSamples++;
+        }
+        while (ppgRing.pop(frame)) {
+            for (int i = 0; i < NUM_PPG_CHANNELS; i++) {
+                updateChannelStats(ppgStats[i], frame.ppg[i], PPG_RATE, window);
+                sink += normalizeValue(frame.ppg[i], ppgStats[i]);
+            }
+            if (beats.process(frame.timestamp, frame.ppg[0])) {
+                sink += beats.bpm;
+            }
+        }
+    }
+};
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void printHeader() {
+    printf("%-28s %12s %14s %16s %12s\n", "stage", "ns/sample", "allocs/sample", "samples/s", "x realtime");
+}
+
+// Repeat `pass` (one trip over the recording, returning EEG samples processed) for `seconds`
+static void bench(const char* name, double seconds, std::function<size_t()> pass) {
+    pass();  // warm up and reach steady-state buffer sizes
+    uint64_t allocBefore = allocations.load();
+    size_t samples = 0;
+    double start = now();
+    double elapsed = 0.0;
+    do {
+        samples += pass();
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    uint64_t allocs = allocations.load() - allocBefore;
+    double rate = samples / elapsed;
+    printf("%-28s %12.1f %14.3f %16.0f %12.0f\n", name, 1e9 * elapsed / samples,
+        (double) allocs / samples, rate, rate / EEG_RATE);
+}
+
+// Deliver `wire` in 100 ms batches of source time, sped up by `speed`, and
+// measure how much of the wall time the receive path spends working
+static void paced(const char* name, double speed, double seconds, const std::vector<std::string>& batches) {
+    Pipeline pipeline;
+    uint64_t allocBefore = allocations.load();
+    double busy = 0.0;
+    double start = now();
+    double next = start;
+    double lag = 0.0;
+    size_t i = 0;
+    while (now() - start < seconds) {
+        double wait = next - now();
+        if (wait > 0) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        } else {
+            lag = std::max(lag, -wait);
+        }
+        const std::string& batch = batches[i];
+        double t0 = now();
+        pipeline.receive((const uint8_t*) batch.data(), batch.size());
+        busy += now() - t0;
+        next += BATCH_SECONDS / speed;
+        if (++i == batches.size()) i = 0;
+    }
+    size_t samples = pipeline.eegSamples;
+    double elapsed = now() - start;
+    uint64_t allocs = allocations.load() - allocBefore;
+    printf("%-10s %6.0fx %12.1f %14.3f %12.0f %9.2f%% %10.1f\n", name, speed,
+        samples ? 1e9 * busy / samples : 0.0, samples ? (double) allocs / samples : 0.0,
+        samples / elapsed, 100.0 * busy / elapsed, 1e3 * lag);
+}
+
+int main(int argc, char** argv) {
+    const char* path = argc > 1 ? argv[1] : "../../fake_data.csv";
+    double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+    json_set_alloc_funcs(countingMalloc, free);
+
+    std::vector<Row> rows = loadRecording(path);
+    if (rows.size() < 2) {
+        fprintf(stderr, "No samples in %s\n", path);
+        return 1;
+    }
+    printf("%zu samples (%.1f s at %.0f Hz) from %s\n\n", rows.size(), rows.size() / EEG_RATE, EEG_RATE, path);
+
+    std::vector<Message> jsonMessages = buildMessages(rows, false);
+    std::vector<Message> binaryMessages = buildMessages(rows, true);
+
+    // Wire bytes per 100 ms batch, and the whole recording in TCP-segment sized reads
+    std::vector<std::string> jsonBatches, binaryBatches;
+    std::string jsonWire, binaryWire;
+    for (int binary = 0; binary < 2; binary++) {
+        const std::vector<Message>& messages = binary ? binaryMessages : jsonMessages;
+        std::vector<std::string>& batches = binary ? binaryBatches : jsonBatches;
+        std::string& wire = binary ? binaryWire : jsonWire;
+        size_t batchSamples = (size_t) (EEG_RATE * BATCH_SECONDS);
+        size_t samples = 0;
+        std::string batch;
+        for (const Message& message : messages) {
+            appendFrame(batch, message);
+            samples += message.eegSamples;
+            if (samples >= batchSamples) {
+                batches.push_back(batch);
+                wire += batch;
+                batch.clear();
+                samples = 0;
+            }
+        }
+        if (!batch.empty()) {
+            batches.push_back(batch);
+            wire += batch;
+        }
+    }
+    printf("Wire bytes per sample: JSON %.1f, binary %.1f\n\n",
+        (double) jsonWire.size() / rows.size(), (double) binaryWire.size() / rows.size());
+
+    printHeader();
+    const size_t SEGMENT = 1460;
+
+    // Frame decoding alone: split into segments, reassemble, hand over each message
+    for (int binary = 0; binary < 2; binary++) {
+        const std::string& wire = binary ? binaryWire : jsonWire;
+        easywsclient::FrameDecoder decoder(128 * 1024);
+        bench(binary ? "frame decode (binary)" : "frame decode (JSON)", seconds, [&]() -> size_t {
+            size_t bytes = 0;
+            size_t messages = 0;
+            auto handler = [&](const easywsclient::Message& message) { bytes += message.size; messages++; };
+            auto control = [](int, const uint8_t*, size_t) { return true; };
+            for (size_t pos = 0; pos < wire.size(); pos += SEGMENT) {
+                size_t len = std::min(SEGMENT, wire.size() - pos);
+                decoder.reserve(len);
+                memcpy(decoder.rx.writePtr(), wire.data() + pos, len);
+                decoder.rx.commit(len);
+                decoder.decode(handler, control);
+            }
+            return rows.size();
+        });
+    }
+
+    float sink = 0.f;
+    // parseJsonSample() takes the single-pass path for these; jansson is what it falls back to
+    for (int fast = 1; fast >= 0; fast--) {
+        bench(fast ? "parse (JSON)" : "parse (JSON, jansson)", seconds, [&]() -> size_t {
+            for (const Message& message : jsonMessages) {
+                MuseFrame frame;
+                const char* problem = fast ? parseJsonSample(message.payload.data(), message.payload.size(), frame)
+                    : parseJsonSampleJansson(message.payload.data(), message.payload.size(), frame);
+                if (!problem) {
+                    sink += frame.eeg[0] + frame.ppg[0];
+                }
+            }
+            return rows.size();
+        });
+    }
+
+    bench("parse (binary)", seconds, [&]() -> size_t {
+        for (const Message& message : binaryMessages) {
+            BinaryHeader header;
+            decodeBinaryMessage((const uint8_t*) message.payload.data(), message.payload.size(), 0.0, header,
+                [&](const MuseFrame& frame) { sink += frame.eeg[0] + frame.ppg[0]; });
+        }
+        return rows.size();
+    });
+
+    SpscRing<MuseFrame, 1024> ring;
+    bench("queue push/pop", seconds, [&]() -> size_t {
+        MuseFrame frame;
+        for (const Row& row : rows) {
+            frame.timestamp = row.timestamp;
+            ring.push(frame);
+            ring.pop(frame);
+        }
+        return rows.size();
+    });
+
+    std::vector<ChannelStats> stats(NUM_EEG_CHANNELS);
+    for (ChannelStats& s : stats) s.allocate(EEG_RATE * 30);
+    const char* modeNames[NORMALIZATION_MODES_LEN] = {
+        "normalize 1 s (min/max)",
+        "normalize 1 s (z-score)",
+        "normalize 1 s (5-95%)",
+    };
+    for (int m = 0; m < NORMALIZATION_MODES_LEN; m++) {
+        NormalizationMode mode = (NormalizationMode) m;
+        bench(modeNames[m], seconds, [&]() -> size_t {
+            for (const Row& row : rows) {
+                for (int c = 0; c < NUM_EEG_CHANNELS; c++) {
+                    updateChannelStats(stats[c], row.eeg[c], EEG_RATE, 1.f);
+                    sink += normalizeValue(row.eeg[c], stats[c], mode);
+                }
+            }
+            return rows.size();
+        });
+    }
+
+    BandPowerEngine engine;
+    engine.configure(BandConfig(), EEG_RATE);
+    bench("band powers (hop 32)", seconds, [&]() -> size_t {
+        MuseFrame frame;
+        BandPowers bands;
+        for (const Row& row : rows) {
+            memcpy(frame.eeg, row.eeg, sizeof(frame.eeg));
+            if (engine.process(frame, bands)) sink += bands.power[0][0];
+        }
+        return rows.size();
+    });
+    // The cross-spectral share of each hop, already inside the band powers stage
+    bench("coherence per hop (6 pairs)", seconds, [&]() -> size_t {
+        BandPowers bands;
+        engine.updateCrossSpectra();
+        engine.computeCoherence(bands);
+        sink += bands.coherence[ALPHA_BAND][0] + bands.alphaAsymmetry;
+        return 1;
+    });
+    // What the analysis thread adds per hop while the panel display is on screen
+    SpectrumSnapshot snapshot;
+    bench("spectrum display snapshot", seconds, [&]() -> size_t {
+        snapshot.bins = engine.spectrum(0, snapshot.magnitude, SpectrumSnapshot::MAX_BINS);
+        snapshot.scopeSamples = engine.recentSamples(0, snapshot.scope, SpectrumSnapshot::SCOPE_SAMPLES);
+        sink += snapshot.magnitude[10] + snapshot.scope[0];
+        return 1;
+    });
+
+    FilterConfig iir;
+    iir.notch = NOTCH_60HZ;
+    iir.bandpass = BANDPASS_IIR;
+    FilterConfig fir = iir;
+    fir.bandpass = BANDPASS_FIR;
+    for (int f = 0; f < 2; f++) {
+        FilterBank<NUM_EEG_CHANNELS> filter;
+        filter.configure(f ? fir : iir, EEG_RATE);
+        bench(f ? "filters (notch + FIR 32)" : "filters (notch + IIR)", seconds, [&]() -> size_t {
+            float values[NUM_EEG_CHANNELS];
+            for (const Row& row : rows) {
+                memcpy(values, row.eeg, sizeof(values));
+                filter.process(values);
+                sink += values[0];
+            }
+            return rows.size();
+        });
+    }
+
+    ChannelQuality quality[NUM_EEG_CHANNELS];
+    for (ChannelQuality& q : quality) q.setSampleRate(EEG_RATE);
+    bench("signal quality", seconds, [&]() -> size_t {
+        for (const Row& row : rows) {
+            for (int c = 0; c < NUM_EEG_CHANNELS; c++) {
+                sink += quality[c].process(row.eeg[c], 200.f);
+            }
+        }
+        return rows.size();
+    });
+
+    BeatDetector beats;
+    beats.setSampleRate(EEG_RATE);
+    double beatTime = 0.0;
+    bench("beat detector", seconds, [&]() -> size_t {
+        for (const Row& row : rows) {
+            beatTime += 1.0 / EEG_RATE;
+            if (beats.process(beatTime, row.ppg[0])) sink += beats.bpm;
+        }
+        return rows.size();
+    });
+
+    JitterBuffer<NUM_EEG_CHANNELS> jitter;
+    double sourceTime = 0.0;
+    double outputDebt = 0.0;
+    bench("resample to 48 kHz", seconds, [&]() -> size_t {
+        float out[NUM_EEG_CHANNELS];
+        for (const Row& row : rows) {
+            jitter.push(sourceTime, row.eeg);
+            sourceTime += 1.0 / EEG_RATE;
+            for (outputDebt += ENGINE_RATE / EEG_RATE; outputDebt >= 1.0; outputDebt -= 1.0) {
+                if (jitter.process(1.0 / ENGINE_RATE, out)) sink += out[0];
+            }
+        }
+        return rows.size();
+    });
+
+    for (int binary = 0; binary < 2; binary++) {
+        const std::string& wire = binary ? binaryWire : jsonWire;
+        Pipeline pipeline;
+        bench(binary ? "pipeline (binary)" : "pipeline (JSON)", seconds, [&]() -> size_t {
+            for (size_t pos = 0; pos < wire.size(); pos += SEGMENT) {
+                size_t len = std::min(SEGMENT, wire.size() - pos);
+                pipeline.receive((const uint8_t*) wire.data() + pos, len);
+            }
+            return rows.size();
+        });
+        sink += pipeline.sink;
+    }
+
+    printf("\n%-10s %7s %12s %14s %12s %10s %10s\n", "paced", "speed", "ns/sample", "allocs/sample",
+        "samples/s", "cpu", "lag ms");
+    static const double speeds[] = {1, 10, 100, 1000};
+    for (double speed : speeds) {
+        paced("JSON", speed, seconds, jsonBatches);
+        paced("binary", speed, seconds, binaryBatches);
+    }
+
+    // Keep the optimizer from discarding the work
+    if (sink == 12345.f) printf("%f\n", sink);
+    return 0;
+}
@@ -0,0 +1,338 @@
+// Assertion checks for the Rack-independent core in src/, next to the benchmarks.
+//
+// Each check drives a component with hand-built input and compares what comes
+// out; the first failure in a check is printed with its line, and the exit
+// status is the number of failed checks.
+//
+//   make check
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "WebSocketFrame.hpp"
+#include "JitterBuffer.hpp"
+#include "Recording.hpp"
+#include "BeatDetector.hpp"
+
+using namespace easywsclient;
+
+static int failures = 0;
+static bool currentFailed = false;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition) && !currentFailed) { \
+            printf("  line %d: %s\n", __LINE__, #condition); \
+            currentFailed = true; \
+        } \
+    } while (0)
+
+static void run(const char* name, void (*check)()) {
+    currentFailed = false;
+    check();
+    printf("%-48s %s\n", name, currentFailed ? "FAIL" : "ok");
+    if (currentFailed) failures++;
+}
+
+// One server-to-client frame; a nonzero `mask` masks the payload with it
+static std::vector<uint8_t> frame(bool fin, int opcode, const std::string& payload, uint32_t mask = 0) {
+    std::vector<uint8_t> bytes;
+    bytes.push_back((fin ? 0x80 : 0x00) | opcode);
+    uint8_t maskBit = mask ? 0x80 : 0x00;
+    uint64_t size = payload.size();
+    if (size < 126) {
+        bytes.push_back(maskBit | (uint8_t) size);
+    } else if (size <= 0xFFFF) {
+        bytes.push_back(maskBit | 126);
+        bytes.push_back((uint8_t) (size >> 8));
+        bytes.push_back((uint8_t) size);
+    } else {
+        bytes.push_back(maskBit | 127);
+        for (int i = 7; i >= 0; i--) {
+            bytes.push_back((uint8_t) (size >> (8 * i)));
+        }
+    }
+    uint8_t key[4] = {(uint8_t) (mask >> 24), (uint8_t) (mask >> 16), (uint8_t) (mask >> 8), (uint8_t) mask};
+    if (mask) {
+        bytes.insert(bytes.end(), key, key + 4);
+    }
+    for (size_t i = 0; i < payload.size(); i++) {
+        bytes.push_back((uint8_t) payload[i] ^ (mask ? key[i % 4] : 0));
+    }
+    return bytes;
+}
+
+static std::vector<uint8_t> concat(std::initializer_list<std::vector<uint8_t>> frames) {
+    std::vector<uint8_t> bytes;
+    for (const std::vector<uint8_t>& f : frames) {
+        bytes.insert(bytes.end(), f.begin(), f.end());
+    }
+    return bytes;
+}
+
+// What a decoder delivered: data messages, and control frames as "ping:payload" and so on
+struct Received {
+    std::vector<std::string> messages;
+    std::vector<int> opcodes;
+    std::vector<std::string> controls;
+    bool stopOnClose = true;
+    int result = 0;
+    const char* error = nullptr;
+};
+
+// Feed `bytes` to a fresh decoder `chunk` bytes per read, decoding after each read as WebSocket does
+static Received receive(const std::vector<uint8_t>& bytes, size_t chunk, size_t capacity = 64) {
+    Received received;
+    FrameDecoder decoder(capacity);
+    auto handler = [&](const Message& message) {
+        received.messages.push_back(std::string((const char*) message.data, message.size));
+        received.opcodes.push_back(message.opcode);
+    };
+    auto control = [&](int opcode, const uint8_t* payload, size_t size) {
+        const char* name = opcode == PING ? "ping" : opcode == PONG ? "pong" : "close";
+        received.controls.push_back(std::string(name) + ":" + std::string((const char*) payload, size));
+        return !(opcode == CLOSE && received.stopOnClose);
+    };
+    for (size_t pos = 0; pos < bytes.size(); pos += chunk) {
+        size_t n = std::min(chunk, bytes.size() - pos);
+        decoder.reserve(n);
+        memcpy(decoder.rx.writePtr(), bytes.data() + pos, n);
+        decoder.rx.commit(n);
+        received.result = decoder.decode(handler, control);
+        if (received.result < 0) {
+            received.error = decoder.error;
+            break;
+        }
+    }
+    return received;
+}
+
+static void checkSplitReads() {
+    std::vector<uint8_t> bytes = concat({
+        frame(true, TEXT_FRAME, "{\"eeg\": [1, 2, 3]}"),
+        frame(true, BINARY_FRAME, std::string("MB\x01\x00", 4)),
+        frame(true, TEXT_FRAME, "masked", 0x12345678),
+    });
+    for (size_t chunk = 1; chunk <= bytes.size(); chunk++) {
+        Received received = receive(bytes, chunk);
+        CHECK(received.result >= 0);
+        CHECK(received.messages.size() == 3);
+        if (received.messages.size() != 3) return;
+        CHECK(received.messages[0] == "{\"eeg\": [1, 2, 3]}");
+        CHECK(received.opcodes[1] == BINARY_FRAME);
+        CHECK(received.messages[1] == std::string("MB\x01\x00", 4));
+        CHECK(received.messages[2] == "masked");
+    }
+}
+
+static void checkExtendedLengths() {
+    // 126: 16-bit length, 127: 64-bit length, each at the edges of its range
+    const size_t sizes[] = {125, 126, 127, 300, 0xFFFF, 0x10000, 70000};
+    for (size_t size : sizes) {
+        std::string payload(size, 'x');
+        for (size_t i = 0; i < size; i++) {
+            payload[i] = (char) ('a' + i % 26);
+        }
+        std::vector<uint8_t> bytes = concat({frame(true, BINARY_FRAME, payload), frame(true, TEXT_FRAME, "after")});
+        // Reads that split the extended length field itself, and reads bigger than the buffer
+        const size_t chunks[] = {1, 3, 7, 4096, bytes.size()};
+        for (size_t chunk : chunks) {
+            if (chunk == 1 && size > 300) continue;
+            Received received = receive(bytes, chunk);
+            CHECK(received.messages.size() == 2);
+            if (received.messages.size() != 2) return;
+            CHECK(received.messages[0] == payload);
+            CHECK(received.messages[1] == "after");
+        }
+    }
+}
+
+static void checkFragments() {
+    std::vector<uint8_t> bytes = concat({
+        frame(false, TEXT_FRAME, "frag"),
+        frame(true, PING, "p1"),
+        frame(false, CONTINUATION, std::string(200, 'm')),
+        frame(true, PONG, "p2", 0xA1B2C3D4),
+        frame(true, CONTINUATION, "ment"),
+        frame(true, TEXT_FRAME, "next"),
+    });
+    std::string expected = "frag" + std::string(200, 'm') + "ment";
+    for (size_t chunk = 1; chunk <= bytes.size(); chunk++) {
+        Received received = receive(bytes, chunk);
+        CHECK(received.result >= 0);
+        CHECK(received.messages.size() == 2);
+        if (received.messages.size() != 2) return;
+        CHECK(received.opcodes[0] == TEXT_FRAME);
+        CHECK(received.messages[0] == expected);
+        CHECK(received.messages[1] == "next");
+        CHECK(received.controls.size() == 2);
+        if (received.controls.size() != 2) return;
+        CHECK(received.controls[0] == "ping:p1");
+        CHECK(received.controls[1] == "pong:p2");
+    }
+}
+
+static void checkProtocolErrors() {
+    Received received = receive(frame(true, CONTINUATION, "stray"), 64);
+    CHECK(received.result == -1);
+    CHECK(received.error && std::string(received.error) == "unexpected continuation frame");
+
+    received = receive(concat({frame(false, TEXT_FRAME, "a"), frame(true, TEXT_FRAME, "b")}), 64);
+    CHECK(received.result == -1);
+    CHECK(received.error && std::string(received.error) == "new message inside a fragmented message");
+
+    received = receive(frame(false, PING, "x"), 64);
+    CHECK(received.result == -1);
+    CHECK(received.error && std::string(received.error) == "invalid control frame");
+
+    // A stop from the control handler is not an error
+    received = receive(concat({frame(true, CLOSE, "bye"), frame(true, TEXT_FRAME, "late")}), 64);
+    CHECK(received.result == -1);
+    CHECK(received.error == nullptr);
+    CHECK(received.messages.empty());
+}
+
+static void checkSizeCap() {
+    // A single frame over the cap fails on its header, before any payload arrives
+    std::vector<uint8_t> header = frame(true, BINARY_FRAME, "");
+    header[1] = 127;
+    uint64_t size = MAX_MESSAGE_SIZE + 1;
+    for (int i = 7; i >= 0; i--) {
+        header.push_back((uint8_t) (size >> (8 * i)));
+    }
+    Received received = receive(header, 64);
+    CHECK(received.result == -1);
+    CHECK(received.error && std::string(received.error) == "message too large");
+
+    // Exactly the cap is accepted
+    std::string largest((size_t) MAX_MESSAGE_SIZE, 'c');
+    received = receive(frame(true, BINARY_FRAME, largest), 1 << 20);
+    CHECK(received.messages.size() == 1);
+    CHECK(received.messages.size() == 1 && received.messages[0].size() == MAX_MESSAGE_SIZE);
+
+    // Fragments that are each under the cap but add up past it
+    std::string half((size_t) MAX_MESSAGE_SIZE / 2 + 1, 'h');
+    received = receive(concat({frame(false, BINARY_FRAME, half), frame(true, CONTINUATION, half)}), 1 << 20);
+    CHECK(received.result == -1);
+    CHECK(received.error && std::string(received.error) == "message too large");
+    CHECK(received.messages.empty());
+}
+
+static void checkJitterColdStart() {
+    // Samples trickling in one at a time, with a target fill just under TAPS: the
+    // playhead starts close to the first sample and must not reach before it
+    const double latencies[] = {0.005, 0.01, 0.02, 0.2};
+    for (double latency : latencies) {
+        JitterBuffer<1> buffer;
+        buffer.setSourceRate(256.0);
+        buffer.setTargetLatency(latency);
+        // A constant input comes out unchanged once the playhead is among written samples
+        float one = 1.f;
+        double engineRate = 48000.0;
+        int pushed = 0;
+        int produced = 0;
+        for (int i = 0; i < 48000; i++) {
+            double t = i / engineRate;
+            while (pushed < 256 && pushed / 256.0 <= t) {
+                buffer.push(pushed / 256.0, &one);
+                pushed++;
+            }
+            float out = 0.f;
+            if (buffer.process(1.0 / engineRate, &out)) {
+                CHECK(std::fabs(out - 1.f) < 1e-4f);
+                produced++;
+            }
+        }
+        CHECK(produced > 0);
+    }
+}
+
+static std::string readFile(const std::string& path) {
+    std::string contents;
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return contents;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        contents.append(buffer, n);
+    }
+    fclose(f);
+    return contents;
+}
+
+static void checkExportNames() {
+    char dirTemplate[] = "/tmp/muse-check-XXXXXX";
+    std::string dir = mkdtemp(dirTemplate);
+    std::string base = dir + "/session";
+    std::string csv = "0.000000,1,2,3,4,5,6,7\n0.003906,2,3,4,5,6,7,8\n0.007812,3,4,5,6,7,8,9\n";
+    FILE* f = fopen((base + ".csv").c_str(), "w");
+    fputs(csv.c_str(), f);
+    fclose(f);
+
+    Recording fromCsv;
+    std::string error;
+    CHECK(fromCsv.open(base + ".csv", error));
+    std::string converted = unusedPath(base, RECORDING_EXTENSION);
+    CHECK(converted == base + ".museb");
+    CHECK(writeRecording(converted, fromCsv, error));
+    CHECK(unusedPath(base, RECORDING_EXTENSION) == base + "-1.museb");
+
+    // Exporting the converted file back to CSV must not replace the CSV it came from
+    Recording binary;
+    CHECK(binary.open(converted, error));
+    std::string exported = unusedPath(base, ".csv");
+    CHECK(exported == base + "-1.csv");
+    CHECK(exportCsv(exported, binary, error));
+    CHECK(readFile(base + ".csv") == csv);
+    CHECK(readFile(exported) == csv);
+    CHECK(!pathExists(exported + ".tmp"));
+
+    // A write that fails leaves nothing behind
+    CHECK(!writeRecording(dir + "/missing/session.museb", binary, error));
+    CHECK(!pathExists(dir + "/missing/session.museb"));
+
+    const char* files[] = {".csv", ".museb", "-1.csv"};
+    for (const char* file : files) {
+        std::remove((base + file).c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+// A minute of PPG at 72 BPM replayed at `speed`: the rate the detector settles on
+static float replayedBpm(double speed) {
+    const double rate = 64.0;
+    const double interval = 60.0 / 72.0;
+    BeatDetector detector;
+    detector.setSampleRate(rate);
+    detector.setTimeScale(speed);
+    for (int i = 0; i < 60 * 64; i++) {
+        double t = i / rate;
+        // A sharp upstroke and a slow fall, on a baseline
+        double phase = std::fmod(t, interval) / interval;
+        double pulse = phase < 0.15 ? phase / 0.15 : std::exp(-(phase - 0.15) * 5.0);
+        detector.process(1000.0 + t / speed, (float) (2000.0 + 50.0 * pulse));
+    }
+    return detector.bpm;
+}
+
+static void checkBeatsAtReplaySpeeds() {
+    float normal = replayedBpm(1.0);
+    CHECK(std::fabs(normal - 72.f) < 1.f);
+    CHECK(std::fabs(replayedBpm(0.5) - normal) < 0.1f);
+    CHECK(std::fabs(replayedBpm(4.0) - normal) < 0.1f);
+}
+
+int main() {
+    run("frames split across reads", checkSplitReads);
+    run("126/127 extended lengths", checkExtendedLengths);
+    run("fragments with control frames between", checkFragments);
+    run("protocol errors", checkProtocolErrors);
+    run("16 MB message cap", checkSizeCap);
+    run("jitter buffer cold start", checkJitterColdStart);
+    run("exports never replace a recording", checkExportNames);
+    run("beat rate at replay speeds", checkBeatsAtReplaySpeeds);
+    printf("%d failed\n", failures);
+    return failures;
+}
@@ -0,0 +1,646 @@
+// Stand-in for lib/livestream.py that can push the plugin far harder than a
+// headband, for finding its throughput ceiling and watching how it fails.
+//
+// Speaks the same protocol: a device list when a client connects, then each
+// headband's samples to the clients whose URL path picks it (by index or ID;
+// an empty path is the first), as one JSON message per sample or, with
+// --binary, as batches to clients that offer muse-binary-v1. Samples come from
+// a recording in the fake_data.csv layout, looped, or from a synthetic signal,
+// and go out every --batch seconds at --speed times real time.
+//
+// Faults to inject: random delay before each batch (--jitter), stalls that
+// release everything held as one burst (--stall), adjacent samples swapped so
+// their timestamps go backwards (--reorder), and clients dropped without a
+// close frame (--disconnect). Clients that stop reading are dropped once
+// MAX_BACKLOG bytes are queued for them.
+//
+//   make loadgen
+//   build/loadgen [options]     see usage() below
+//
+// Linux only (MSG_NOSIGNAL, strcasestr): one thread, poll() and non-blocking sockets.
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "WebSocketFrame.hpp"
+#include "SampleRing.hpp"
+#include "MuseProtocol.hpp"
+#include "ServerMessages.hpp"
+
+// lib/protocol.py MAX_SAMPLES_PER_MESSAGE
+static const size_t MAX_SAMPLES_PER_MESSAGE = 0xFFFF;
+// Queued bytes after which a client that isn't reading is dropped
+static const size_t MAX_BACKLOG = 64 * 1024 * 1024;
+static const size_t MAX_REQUEST_SIZE = 16 * 1024;
+static const size_t READ_SIZE = 4096;
+static const double REPORT_SECONDS = 1.0;
+
+struct Options {
+    int port = 8765;
+    const char* data = nullptr; // synthetic signal when null
+    double eegRate = 256.0;
+    int ppgDecimation = 4;      // PPG runs at eegRate / ppgDecimation, 64 Hz by default
+    double speed = 1.0;
+    double batchSeconds = 0.1;
+    int devices = 1;
+    int maxClients = 64;
+    bool binary = false;
+    double jitterMs = 0.0;
+    double stallEvery = 0.0;
+    double stallSeconds = 0.0;
+    double reorder = 0.0;
+    double disconnectSeconds = 0.0;
+    double runSeconds = 0.0;
+    unsigned seed = 1;
+};
+
+static void usage(const char* name) {
+    printf(
+        "Usage: %s [options]\n"
+        "  --port N            listen on N (8765)\n"
+        "  --data FILE         loop a recording in the fake_data.csv layout (default: synthetic signal)\n"
+        "  --rate HZ           EEG sample rate; PPG runs at a quarter of it (256)\n"
+        "  --speed X           send X seconds of samples per second (1)\n"
+        "  --batch SECONDS     interval between sends (0.1, as lib/livestream.py)\n"
+        "  --devices N         headbands to serve (1)\n"
+        "  --max-clients N     refuse connections beyond N (64)\n"
+        "  --binary            offer the muse-binary-v1 subprotocol\n"
+        "  --jitter MS         delay each send by up to MS ms\n"
+        "  --stall EVERY:FOR   every EVERY seconds hold sends for FOR seconds, then send them as one burst\n"
+        "  --reorder P         swap two adjacent EEG samples in a send with probability P\n"
+        "  --disconnect S      drop each client without a close frame after about S seconds\n"
+        "  --seconds S         exit after S seconds (0: run until interrupted)\n"
+        "  --seed N            random seed for the injected faults (1)\n",
+        name);
+}
+
+static bool parseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (!strcmp(arg, "--binary")) {
+            options.binary = true;
+            continue;
+        }
+        if (!strcmp(arg, "--help") || i + 1 >= argc) {
+            return false;
+        }
+        const char* value = argv[++i];
+        if (!strcmp(arg, "--port")) options.port = atoi(value);
+        else if (!strcmp(arg, "--data")) options.data = value;
+        else if (!strcmp(arg, "--rate")) options.eegRate = atof(value);
+        else if (!strcmp(arg, "--speed")) options.speed = atof(value);
+        else if (!strcmp(arg, "--batch")) options.batchSeconds = atof(value);
+        else if (!strcmp(arg, "--devices")) options.devices = atoi(value);
+        else if (!strcmp(arg, "--max-clients")) options.maxClients = atoi(value);
+        else if (!strcmp(arg, "--jitter")) options.jitterMs = atof(value);
+        else if (!strcmp(arg, "--stall")) {
+            if (sscanf(value, "%lf:%lf", &options.stallEvery, &options.stallSeconds) != 2) return false;
+        }
+        else if (!strcmp(arg, "--reorder")) options.reorder = atof(value);
+        else if (!strcmp(arg, "--disconnect")) options.disconnectSeconds = atof(value);
+        else if (!strcmp(arg, "--seconds")) options.runSeconds = atof(value);
+        else if (!strcmp(arg, "--seed")) options.seed = (unsigned) atoi(value);
+        else return false;
+    }
+    return options.eegRate > 0.0 && options.speed > 0.0 && options.batchSeconds > 0.0 && options.devices > 0;
+}
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// SHA-1 and base64, for Sec-WebSocket-Accept
+static uint32_t rotateLeft(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static std::string sha1(const std::string& input) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    std::string message = input;
+    uint64_t bits = (uint64_t) input.size() * 8;
+    message += (char) 0x80;
+    while (message.size() % 64 != 56) {
+        message += (char) 0;
+    }
+    for (int i = 7; i >= 0; i--) {
+        message += (char) (bits >> (8 * i));
+    }
+    for (size_t chunk = 0; chunk < message.size(); chunk += 64) {
+        uint32_t w[80];
+        const uint8_t* p = (const uint8_t*) message.data() + chunk;
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = rotateLeft(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotateLeft(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    std::string digest;
+    for (uint32_t word : h) {
+        for (int i = 3; i >= 0; i--) {
+            digest += (char) (word >> (8 * i));
+        }
+    }
+    return digest;
+}
+
+static std::string base64(const std::string& input) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < input.size(); i += 3) {
+        uint32_t n = (uint8_t) input[i] << 16;
+        if (i + 1 < input.size()) n |= (uint8_t) input[i + 1] << 8;
+        if (i + 2 < input.size()) n |= (uint8_t) input[i + 2];
+        out += alphabet[(n >> 18) & 63];
+        out += alphabet[(n >> 12) & 63];
+        out += i + 1 < input.size() ? alphabet[(n >> 6) & 63] : '=';
+        out += i + 2 < input.size() ? alphabet[n & 63] : '=';
+    }
+    return out;
+}
+
+// Value of header `name` in an HTTP request, or empty
+static std::string headerValue(const std::string& request, const char* name) {
+    std::string key = std::string("\r\n") + name + ":";
+    const char* found = strcasestr(request.c_str(), key.c_str());
+    if (!found) return "";
+    const char* value = found + key.size();
+    while (*value == ' ') value++;
+    const char* end = strstr(value, "\r\n");
+    return std::string(value, end ? end - value : strlen(value));
+}
+
+static std::string percentDecode(const std::string& s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '%' && i + 2 < s.size()) {
+            out += (char) strtol(s.substr(i + 1, 2).c_str(), nullptr, 16);
+            i += 2;
+        } else {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+struct Client {
+    int fd = -1;
+    bool upgraded = false;
+    bool binary = false;
+    // Headband this client streams, -1 if its path matched none (it still gets the device list)
+    int device = -1;
+    std::string request;
+    std::string out;
+    size_t outPos = 0;
+    // When to drop it, for --disconnect
+    double dropAt = 0.0;
+    easywsclient::FrameDecoder decoder{READ_SIZE};
+};
+
+struct Totals {
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    uint64_t samples = 0;
+    uint64_t connections = 0;
+    uint64_t refused = 0;
+    uint64_t disconnects = 0;
+    uint64_t overflows = 0;
+    uint64_t reorders = 0;
+    uint64_t stalls = 0;
+};
+
+class LoadGenerator {
+public:
+    explicit LoadGenerator(const Options& options) : options(options), random(options.seed) {}
+
+    bool start() {
+        if (options.data) {
+            recording = loadRecording(options.data);
+            if (recording.empty()) {
+                fprintf(stderr, "No samples in %s\n", options.data);
+                return false;
+            }
+        }
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(options.port);
+        if (bind(listener, (sockaddr*) &address, sizeof(address)) < 0 || listen(listener, 64) < 0) {
+            fprintf(stderr, "Can't listen on port %d: %s\n", options.port, strerror(errno));
+            return false;
+        }
+        fcntl(listener, F_SETFL, O_NONBLOCK);
+        sequences.assign(options.devices, 0);
+        printf("Serving %d headband%s on ws://localhost:%d: %s at %.0f Hz x %g%s%s\n", options.devices,
+            options.devices == 1 ? "" : "s", options.port, options.data ? options.data : "synthetic signal",
+            options.eegRate, options.speed, options.binary ? ", offering " : "", options.binary ? BINARY_SUBPROTOCOL : "");
+        return true;
+    }
+
+    void run() {
+        startTime = now();
+        nextSend = startTime + options.batchSeconds;
+        double nextReport = startTime + REPORT_SECONDS;
+        while (options.runSeconds <= 0.0 || now() - startTime < options.runSeconds) {
+            std::vector<pollfd> fds;
+            fds.push_back(pollfd{listener, POLLIN, 0});
+            for (const std::unique_ptr<Client>& client : clients) {
+                short events = POLLIN;
+                if (client->outPos < client->out.size()) events |= POLLOUT;
+                fds.push_back(pollfd{client->fd, events, 0});
+            }
+            double wait = std::min(nextSend, nextReport) - now();
+            poll(fds.data(), fds.size(), std::max(0, (int) std::ceil(wait * 1000.0)));
+
+            if (fds[0].revents & POLLIN) {
+                accept();
+            }
+            for (size_t i = 1; i < fds.size(); i++) {
+                Client& client = *clients[i - 1];
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    receive(client);
+                }
+                if (client.fd >= 0 && (fds[i].revents & POLLOUT)) {
+                    flush(client);
+                }
+            }
+
+            double t = now();
+            if (t >= nextSend) {
+                send(t);
+                std::uniform_real_distribution<double> jitter(0.0, options.jitterMs / 1000.0);
+                nextSend = t + options.batchSeconds + (options.jitterMs > 0.0 ? jitter(random) : 0.0);
+            }
+            if (t >= nextReport) {
+                report(t);
+                nextReport += REPORT_SECONDS;
+            }
+            clients.erase(std::remove_if(clients.begin(), clients.end(), [](const std::unique_ptr<Client>& client) {
+                return client->fd < 0;
+            }), clients.end());
+        }
+        printf("Sent %llu samples in %llu messages, %.1f MB; %llu connections, %llu refused, "
+            "%llu dropped by --disconnect, %llu for not reading\n",
+            (unsigned long long) totals.samples, (unsigned long long) totals.messages, totals.bytes / 1e6,
+            (unsigned long long) totals.connections, (unsigned long long) totals.refused,
+            (unsigned long long) totals.disconnects, (unsigned long long) totals.overflows);
+    }
+
+private:
+    Options options;
+    std::mt19937 random;
+    std::vector<Row> recording;
+    int listener = -1;
+    std::vector<std::unique_ptr<Client>> clients;
+    std::vector<uint32_t> sequences; // binary sequence number per headband
+    uint64_t samplesSent = 0;        // per headband; every headband advances together
+    double startTime = 0.0;
+    double nextSend = 0.0;
+    bool stalled = false;
+    Totals totals;
+    Totals lastReport;
+
+    std::string deviceId(int device) const {
+        return "loadgen-" + std::to_string(device);
+    }
+
+    void accept() {
+        while (true) {
+            int fd = ::accept(listener, nullptr, nullptr);
+            if (fd < 0) return;
+            if ((int) clients.size() >= options.maxClients) {
+                ::close(fd);
+                totals.refused++;
+                continue;
+            }
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::unique_ptr<Client> client(new Client);
+            client->fd = fd;
+            clients.push_back(std::move(client));
+        }
+    }
+
+    void drop(Client& client) {
+        if (client.fd >= 0) {
+            ::close(client.fd);
+            client.fd = -1;
+        }
+    }
+
+    void receive(Client& client) {
+        if (!client.upgraded) {
+            char buffer[READ_SIZE];
+            ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                drop(client);
+                return;
+            }
+            client.request.append(buffer, n);
+            if (client.request.find("\r\n\r\n") != std::string::npos) {
+                handshake(client);
+            } else if (client.request.size() > MAX_REQUEST_SIZE) {
+                drop(client);
+            }
+            return;
+        }
+        client.decoder.reserve(READ_SIZE);
+        ssize_t n = recv(client.fd, client.decoder.rx.writePtr(), READ_SIZE, 0);
+        if (n <= 0) {
+            drop(client);
+            return;
+        }
+        client.decoder.rx.commit(n);
+        bool closing = false;
+        // Subscriptions are logged but not honoured: every client gets every channel, as from an older server
+        auto handler = [&](const easywsclient::Message& message) {
+            if (message.opcode == easywsclient::TEXT_FRAME) {
+                printf("Client of %s sent %.*s\n", client.device >= 0 ? deviceId(client.device).c_str() : "no headband",
+                    (int) message.size, (const char*) message.data);
+            }
+        };
+        auto control = [&](int opcode, const uint8_t* data, size_t size) {
+            if (opcode == easywsclient::PING) {
+                appendServerFrame(client.out, easywsclient::PONG, std::string((const char*) data, size));
+            } else if (opcode == easywsclient::CLOSE) {
+                appendServerFrame(client.out, easywsclient::CLOSE, std::string((const char*) data, std::min(size, (size_t) 2)));
+                closing = true;
+                return false;
+            }
+            return true;
+        };
+        int received = client.decoder.decode(handler, control);
+        flush(client);
+        if (received < 0 || closing) {
+            drop(client);
+        }
+    }
+
+    void handshake(Client& client) {
+        const std::string& request = client.request;
+        std::string key = headerValue(request, "Sec-WebSocket-Key");
+        if (request.compare(0, 4, "GET ") != 0 || key.empty()) {
+            const char* response = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+            ::send(client.fd, response, strlen(response), MSG_NOSIGNAL);
+            drop(client);
+            return;
+        }
+        size_t pathEnd = request.find(' ', 4);
+        std::string path = percentDecode(request.substr(5, pathEnd == std::string::npos ? 0 : pathEnd - 5));
+        client.device = path.empty() ? 0 : -1;
+        for (int d = 0; d < options.devices; d++) {
+            if (path == deviceId(d) || path == std::to_string(d)) {
+                client.device = d;
+            }
+        }
+        client.binary = options.binary &&
+            headerValue(request, "Sec-WebSocket-Protocol").find(BINARY_SUBPROTOCOL) != std::string::npos;
+
+        std::string accept = base64(sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+        client.out = "HTTP/1.1 101 Switching Protocols\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: " + accept + "\r\n";
+        if (client.binary) {
+            client.out += std::string("Sec-WebSocket-Protocol: ") + BINARY_SUBPROTOCOL + "\r\n";
+        }
+        client.out += "\r\n";
+        client.upgraded = true;
+        client.request.clear();
+        if (options.disconnectSeconds > 0.0) {
+            std::uniform_real_distribution<double> lifetime(0.5, 1.5);
+            client.dropAt = now() + options.disconnectSeconds * lifetime(random);
+        }
+        totals.connections++;
+
+        std::string devices = "{\"devices\": [";
+        for (int d = 0; d < options.devices; d++) {
+            char entry[128];
+            snprintf(entry, sizeof(entry), "%s{\"index\": %d, \"id\": \"%s\", \"name\": \"Load generator %d\"}",
+                d ? ", " : "", d, deviceId(d).c_str(), d);
+            devices += entry;
+        }
+        devices += "]}";
+        appendServerFrame(client.out, easywsclient::TEXT_FRAME, devices);
+        printf("Client connected for %s (%s)\n", client.device >= 0 ? deviceId(client.device).c_str() : "no headband",
+            client.binary ? "binary" : "JSON");
+        flush(client);
+    }
+
+    void flush(Client& client) {
+        while (client.fd >= 0 && client.outPos < client.out.size()) {
+            ssize_t n = ::send(client.fd, client.out.data() + client.outPos, client.out.size() - client.outPos,
+                MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    drop(client);
+                }
+                break;
+            }
+            client.outPos += n;
+        }
+        if (client.outPos == client.out.size()) {
+            client.out.clear();
+            client.outPos = 0;
+        } else if (client.outPos > MAX_BACKLOG / 4) {
+            client.out.erase(0, client.outPos);
+            client.outPos = 0;
+        }
+    }
+
+    // Sample `n` of headband `device`, `n` counting at the EEG rate from the start
+    Row sample(int device, uint64_t n) {
+        Row row;
+        row.timestamp = n / options.eegRate;
+        if (!recording.empty()) {
+            const Row& source = recording[(n + device * recording.size() / options.devices) % recording.size()];
+            memcpy(row.eeg, source.eeg, sizeof(row.eeg));
+            memcpy(row.ppg, source.ppg, sizeof(row.ppg));
+            return row;
+        }
+        // Alpha and theta with 60 Hz mains on top, and a pulse at 72 bpm
+        double t = row.timestamp;
+        std::normal_distribution<float> noise(0.f, 5.f);
+        for (int c = 0; c < NUM_EEG_CHANNELS; c++) {
+            double phase = c + device;
+            row.eeg[c] = 20.0 * std::sin(2.0 * M_PI * 10.0 * t + phase) + 10.0 * std::sin(2.0 * M_PI * 6.0 * t + phase)
+                + 5.0 * std::sin(2.0 * M_PI * 60.0 * t) + noise(random);
+        }
+        double pulse = std::pow(0.5 + 0.5 * std::sin(2.0 * M_PI * 1.2 * t + device), 4.0);
+        for (int c = 0; c < NUM_PPG_CHANNELS; c++) {
+            row.ppg[c] = (c == 2 ? 40.0 : 35000.0) + 500.0 * pulse + noise(random);
+        }
+        return row;
+    }
+
+    // Send every sample now due to each headband's clients
+    void send(double t) {
+        for (const std::unique_ptr<Client>& client : clients) {
+            if (client->dropAt > 0.0 && t >= client->dropAt) {
+                printf("Dropping client of %s\n", client->device >= 0 ? deviceId(client->device).c_str() : "no headband");
+                drop(*client);
+                totals.disconnects++;
+            }
+        }
+        if (options.stallEvery > 0.0 && std::fmod(t - startTime, options.stallEvery) < options.stallSeconds) {
+            if (!stalled) totals.stalls++;
+            stalled = true;
+            return;
+        }
+        stalled = false;
+
+        uint64_t due = (uint64_t) ((t - startTime) * options.eegRate * options.speed);
+        if (due <= samplesSent) return;
+        for (int d = 0; d < options.devices; d++) {
+            std::vector<Row> eeg, ppg;
+            for (uint64_t n = samplesSent; n < due; n++) {
+                Row row = sample(d, n);
+                eeg.push_back(row);
+                if (n % options.ppgDecimation == 0) {
+                    ppg.push_back(row);
+                }
+            }
+            std::uniform_real_distribution<double> chance(0.0, 1.0);
+            if (eeg.size() > 1 && options.reorder > 0.0 && chance(random) < options.reorder) {
+                std::uniform_int_distribution<size_t> position(0, eeg.size() - 2);
+                size_t i = position(random);
+                std::swap(eeg[i], eeg[i + 1]);
+                totals.reorders++;
+            }
+
+            // Each format is framed once and copied to every client that wants it
+            std::string json, binary;
+            size_t jsonMessages = 0, binaryMessages = 0;
+            bool anyJson = false, anyBinary = false;
+            for (const std::unique_ptr<Client>& client : clients) {
+                if (client->fd < 0 || !client->upgraded || client->device != d) continue;
+                (client->binary ? anyBinary : anyJson) = true;
+            }
+            if (anyJson) {
+                std::string id = deviceId(d);
+                char text[512];
+                for (const Row& row : eeg) {
+                    snprintf(text, sizeof(text), "{\"timestamp\": %.6f, \"eeg_channels\": [%.8g, %.8g, %.8g, %.8g, %.8g], \"device\": \"%s\"}",
+                        row.timestamp, row.eeg[0], row.eeg[1], row.eeg[2], row.eeg[3], row.eeg[4], id.c_str());
+                    appendServerFrame(json, easywsclient::TEXT_FRAME, text);
+                }
+                for (const Row& row : ppg) {
+                    snprintf(text, sizeof(text), "{\"timestamp\": %.6f, \"ppg_channels\": [%.8g, %.8g, %.8g], \"device\": \"%s\"}",
+                        row.timestamp, row.ppg[0], row.ppg[1], row.ppg[2], id.c_str());
+                    appendServerFrame(json, easywsclient::TEXT_FRAME, text);
+                }
+                jsonMessages = eeg.size() + ppg.size();
+            }
+            if (anyBinary) {
+                for (int stream = 0; stream < 2; stream++) {
+                    const std::vector<Row>& rows = stream == 0 ? eeg : ppg;
+                    double rate = stream == 0 ? options.eegRate : options.eegRate / options.ppgDecimation;
+                    for (size_t first = 0; first < rows.size(); first += MAX_SAMPLES_PER_MESSAGE) {
+                        size_t count = std::min(MAX_SAMPLES_PER_MESSAGE, rows.size() - first);
+                        appendServerFrame(binary, easywsclient::BINARY_FRAME,
+                            encodeBatch(rows, first, count, 1, stream == 0, rate, sequences[d]++));
+                        binaryMessages++;
+                    }
+                }
+            }
+
+            for (const std::unique_ptr<Client>& client : clients) {
+                Client& c = *client;
+                if (c.fd < 0 || !c.upgraded || c.device != d) continue;
+                const std::string& wire = c.binary ? binary : json;
+                if (c.out.size() - c.outPos + wire.size() > MAX_BACKLOG) {
+                    printf("Dropping client of %s: %zu bytes queued\n", deviceId(d).c_str(), c.out.size() - c.outPos);
+                    drop(c);
+                    totals.overflows++;
+                    continue;
+                }
+                c.out += wire;
+                totals.messages += c.binary ? binaryMessages : jsonMessages;
+                totals.bytes += wire.size();
+                totals.samples += eeg.size();
+                flush(c);
+            }
+        }
+        samplesSent = due;
+    }
+
+    void report(double t) {
+        double elapsed = REPORT_SECONDS;
+        size_t queued = 0;
+        for (const std::unique_ptr<Client>& client : clients) {
+            queued += client->out.size() - client->outPos;
+        }
+        printf("%7.1f s  %3d clients  %9.0f samples/s  %8.0f msg/s  %7.2f MB/s  %8.1f kB queued"
+            "  reorders %llu  stalls %llu  drops %llu\n",
+            t - startTime, (int) clients.size(), (totals.samples - lastReport.samples) / elapsed,
+            (totals.messages - lastReport.messages) / elapsed, (totals.bytes - lastReport.bytes) / elapsed / 1e6,
+            queued / 1e3, (unsigned long long) totals.reorders, (unsigned long long) totals.stalls,
+            (unsigned long long) (totals.disconnects + totals.overflows));
+        fflush(stdout);
+        lastReport = totals;
+    }
+};
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    LoadGenerator generator(options);
+    if (!generator.start()) {
+        return 1;
+    }
+    generator.run();
+    return 0;
+}
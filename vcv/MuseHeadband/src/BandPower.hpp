@@ -0,0 +1,343 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "SampleRing.hpp"
+
+static const int NUM_BANDS = 5;
+static const int ALPHA_BAND = 2;
+// TP9, AF7, AF8 and TP10 have a cross-spectrum with each other; aux is left out
+static const int NUM_CROSS_CHANNELS = 4;
+static const int NUM_CROSS_PAIRS = NUM_CROSS_CHANNELS * (NUM_CROSS_CHANNELS - 1) / 2;
+static const int CHANNEL_AF7 = 1;
+static const int CHANNEL_AF8 = 2;
+
+// Index of the channel pair (a, b), a < b < NUM_CROSS_CHANNELS, in BandPowers::coherence
+inline int crossPairIndex(int a, int b) {
+    return a * (2 * NUM_CROSS_CHANNELS - a - 1) / 2 + (b - a - 1);
+}
+
+// How the bins inside a band are combined, see get_band() in lib/fft.py
+enum BandReduction {
+    REDUCE_MAX,
+    REDUCE_MEAN,
+    REDUCE_SUM,
+    REDUCTIONS_LEN
+};
+
+struct BandConfig {
+    // Band edges in Hz, [low, high), in DELTA..GAMMA order. Same as lib/fft.py.
+    float low[NUM_BANDS] = {1.f, 4.f, 8.f, 12.f, 30.f};
+    float high[NUM_BANDS] = {4.f, 8.f, 12.f, 30.f, 80.f};
+    // Analysis window and hop, in samples
+    int windowSize = 256;
+    int hopSize = 32;
+    BandReduction reduction = REDUCE_MAX;
+    // Time constant of the averaged cross-spectra behind coherence and asymmetry
+    float crossSeconds = 5.f;
+};
+
+// One band-power estimate, published once per hop
+struct BandPowers {
+    float power[NUM_BANDS][NUM_EEG_CHANNELS] = {};
+    // Magnitude-squared coherence of each channel pair (crossPairIndex()) in each band, 0-1:
+    // the mean over the band's bins of |Sab|^2 / (Saa Sbb) from the averaged spectra
+    float coherence[NUM_BANDS][NUM_CROSS_PAIRS] = {};
+    // Frontal alpha asymmetry from the averaged spectra: ln(AF8 alpha power) - ln(AF7 alpha power)
+    float alphaAsymmetry = 0.f;
+    // Source timestamp and local arrival time of the newest sample in the window
+    double timestamp = 0.0;
+    double arrivalTime = 0.0;
+    uint64_t hop = 0;
+};
+
+// One channel's spectrum and latest samples, published once per hop for the panel display
+struct SpectrumSnapshot {
+    // Enough for a 512-sample window
+    static const int MAX_BINS = 257;
+    static const int SCOPE_SAMPLES = 256;
+
+    float magnitude[MAX_BINS] = {};
+    int bins = 0;
+    float binHz = 1.f;
+    // Oldest first
+    float scope[SCOPE_SAMPLES] = {};
+    int scopeSamples = 0;
+    int channel = 0;
+    uint64_t hop = 0;
+};
+
+// Incremental EEG band powers.
+//
+// Keeps a damped sliding DFT per channel, so each sample costs one complex
+// rotation per bin instead of a full FFT over the window. The Hamming window
+// and mean removal of compute_fft() are applied in the frequency domain when a
+// hop completes. Bin state is stored as separate re/im arrays so the per-sample
+// loop vectorizes.
+//
+// The same windowed spectra feed an exponentially averaged cross-power matrix
+// over the first NUM_CROSS_CHANNELS channels, updated once per hop in
+// O(pairs x bins) whatever the averaging time, for coherence and asymmetry.
+struct BandPowerEngine {
+    // Pole radius of the damped recursion; keeps float round-off from accumulating
+    static constexpr float DAMPING = 0.99999f;
+    static constexpr float HAMMING_A = 0.54f;
+    static constexpr float HAMMING_B = 0.46f;
+
+    BandConfig config;
+    float sampleRate = 256.f;
+    int numBins = 0;
+    float dampingN = 1.f;
+    int bandBinLow[NUM_BANDS] = {};
+    int bandBinHigh[NUM_BANDS] = {};
+
+    // Twiddles with the damping folded in
+    std::vector<float> rotCos, rotSin, twCos, twSin;
+    std::vector<float> re[NUM_EEG_CHANNELS];
+    std::vector<float> im[NUM_EEG_CHANNELS];
+    std::vector<float> history[NUM_EEG_CHANNELS];
+    std::vector<float> magnitude;
+    // Windowed spectrum of each channel as of the last hop
+    std::vector<float> windowedRe[NUM_EEG_CHANNELS];
+    std::vector<float> windowedIm[NUM_EEG_CHANNELS];
+    // Averaged auto-power per cross channel and cross-power per pair, per bin
+    std::vector<float> autoPower[NUM_CROSS_CHANNELS];
+    std::vector<float> crossRe[NUM_CROSS_PAIRS];
+    std::vector<float> crossIm[NUM_CROSS_PAIRS];
+    // Share of each hop in the averages, which only cover the bins below the top band edge
+    float crossWeight = 1.f;
+    int crossBins = 0;
+    bool crossPrimed = false;
+    size_t historyPos = 0;
+    int filled = 0;
+    int sinceHop = 0;
+    uint64_t hops = 0;
+
+    // Allocates all state. Not real-time safe.
+    void configure(const BandConfig& newConfig, float newSampleRate) {
+        config = newConfig;
+        sampleRate = newSampleRate;
+        if (config.windowSize < 8) config.windowSize = 8;
+        if (config.hopSize < 1) config.hopSize = 1;
+
+        int n = config.windowSize;
+        numBins = n / 2 + 1;
+        dampingN = std::pow(DAMPING, (float) n);
+        rotCos.resize(numBins);
+        rotSin.resize(numBins);
+        twCos.resize(numBins);
+        twSin.resize(numBins);
+        for (int k = 0; k < numBins; k++) {
+            double theta = 2.0 * M_PI * k / n;
+            twCos[k] = std::cos(theta);
+            twSin[k] = std::sin(theta);
+            rotCos[k] = DAMPING * twCos[k];
+            rotSin[k] = DAMPING * twSin[k];
+        }
+        for (int c = 0; c < NUM_EEG_CHANNELS; c++) {
+            re[c].assign(numBins, 0.f);
+            im[c].assign(numBins, 0.f);
+            history[c].assign(n, 0.f);
+            windowedRe[c].assign(numBins, 0.f);
+            windowedIm[c].assign(numBins, 0.f);
+        }
+        magnitude.assign(numBins, 0.f);
+        for (int c = 0; c < NUM_CROSS_CHANNELS; c++) {
+            autoPower[c].assign(numBins, 0.f);
+        }
+        for (int p = 0; p < NUM_CROSS_PAIRS; p++) {
+            crossRe[p].assign(numBins, 0.f);
+            crossIm[p].assign(numBins, 0.f);
+        }
+
+        crossBins = 0;
+        for (int b = 0; b < NUM_BANDS; b++) {
+            bandBinLow[b] = std::max(0, (int) std::ceil(config.low[b] * n / sampleRate));
+            bandBinHigh[b] = std::min(numBins, (int) std::ceil(config.high[b] * n / sampleRate));
+            crossBins = std::max(crossBins, bandBinHigh[b]);
+        }
+        double hopSeconds = config.hopSize / sampleRate;
+        crossWeight = (float) (1.0 - std::exp(-hopSeconds / std::max((double) config.crossSeconds, hopSeconds)));
+        crossPrimed = false;
+        historyPos = 0;
+        filled = 0;
+        sinceHop = 0;
+        hops = 0;
+    }
+
+    // Feed one EEG sample. Returns true when a hop completed and `out` was filled.
+    bool process(const MuseFrame& frame, BandPowers& out) {
+        int n = config.windowSize;
+        for (int c = 0; c < NUM_EEG_CHANNELS; c++) {
+            float x = frame.eeg[c];
+            if (!std::isfinite(x)) x = 0.f;
+            float delta = x - dampingN * history[c][historyPos];
+            history[c][historyPos] = x;
+
+            float* bre = re[c].data();
+            float* bim = im[c].data();
+            const float* rc = rotCos.data();
+            const float* rs = rotSin.data();
+            const float* tc = twCos.data();
+            const float* ts = twSin.data();
+            for (int k = 0; k < numBins; k++) {
+                float r = bre[k];
+                float i = bim[k];
+                bre[k] = rc[k] * r - rs[k] * i + tc[k] * delta;
+                bim[k] = rs[k] * r + rc[k] * i + ts[k] * delta;
+            }
+        }
+        historyPos = (historyPos + 1) % n;
+        if (filled < n) filled++;
+
+        if (++sinceHop < config.hopSize || filled < n) {
+            return false;
+        }
+        sinceHop = 0;
+        computeBands(out);
+        out.timestamp = frame.timestamp;
+        out.arrivalTime = frame.arrivalTime;
+        out.hop = ++hops;
+        return true;
+    }
+
+    void computeBands(BandPowers& out) {
+        for (int c = 0; c < NUM_EEG_CHANNELS; c++) {
+            channelMagnitudes(c);
+            for (int b = 0; b < NUM_BANDS; b++) {
+                out.power[b][c] = reduce(bandBinLow[b], bandBinHigh[b]);
+            }
+        }
+        updateCrossSpectra();
+        computeCoherence(out);
+    }
+
+    // Fold this hop's windowed spectra into the averages. The first hop seeds them.
+    void updateCrossSpectra() {
+        float w = crossPrimed ? crossWeight : 1.f;
+        crossPrimed = true;
+        for (int c = 0; c < NUM_CROSS_CHANNELS; c++) {
+            const float* xre = windowedRe[c].data();
+            const float* xim = windowedIm[c].data();
+            float* power = autoPower[c].data();
+            for (int k = 0; k < crossBins; k++) {
+                power[k] += w * (xre[k] * xre[k] + xim[k] * xim[k] - power[k]);
+            }
+        }
+        for (int a = 0; a < NUM_CROSS_CHANNELS; a++) {
+            for (int b = a + 1; b < NUM_CROSS_CHANNELS; b++) {
+                int p = crossPairIndex(a, b);
+                const float* are = windowedRe[a].data();
+                const float* aim = windowedIm[a].data();
+                const float* bre = windowedRe[b].data();
+                const float* bim = windowedIm[b].data();
+                float* sre = crossRe[p].data();
+                float* sim = crossIm[p].data();
+                // Xa conj(Xb)
+                for (int k = 0; k < crossBins; k++) {
+                    sre[k] += w * (are[k] * bre[k] + aim[k] * bim[k] - sre[k]);
+                    sim[k] += w * (aim[k] * bre[k] - are[k] * bim[k] - sim[k]);
+                }
+            }
+        }
+    }
+
+    void computeCoherence(BandPowers& out) {
+        for (int a = 0; a < NUM_CROSS_CHANNELS; a++) {
+            for (int b = a + 1; b < NUM_CROSS_CHANNELS; b++) {
+                int p = crossPairIndex(a, b);
+                for (int band = 0; band < NUM_BANDS; band++) {
+                    int lo = std::max(bandBinLow[band], 1);
+                    int hi = bandBinHigh[band];
+                    float sum = 0.f;
+                    for (int k = lo; k < hi; k++) {
+                        float denominator = autoPower[a][k] * autoPower[b][k];
+                        if (denominator > 0.f) {
+                            sum += (crossRe[p][k] * crossRe[p][k] + crossIm[p][k] * crossIm[p][k]) / denominator;
+                        }
+                    }
+                    out.coherence[band][p] = hi > lo ? std::min(sum / (hi - lo), 1.f) : 0.f;
+                }
+            }
+        }
+        out.alphaAsymmetry = std::log(bandPower(CHANNEL_AF8, ALPHA_BAND)) - std::log(bandPower(CHANNEL_AF7, ALPHA_BAND));
+    }
+
+    // Averaged power of cross channel `c` summed over `band`, floored so its log stays finite
+    float bandPower(int c, int band) const {
+        float sum = 0.f;
+        for (int k = std::max(bandBinLow[band], 1); k < bandBinHigh[band]; k++) {
+            sum += autoPower[c][k];
+        }
+        return std::max(sum, 1e-12f);
+    }
+
+    // Copy channel `c`'s spectrum as of the last sample into `out`. Returns the number of bins copied.
+    int spectrum(int c, float* out, int maxBins) {
+        channelMagnitudes(c);
+        int bins = std::min(numBins, maxBins);
+        std::copy(magnitude.begin(), magnitude.begin() + bins, out);
+        return bins;
+    }
+
+    float binHz() const {
+        return sampleRate / config.windowSize;
+    }
+
+    // Copy up to `count` of channel `c`'s latest samples into `out`, oldest first. Returns how many.
+    int recentSamples(int c, float* out, int count) const {
+        int n = config.windowSize;
+        count = std::min(count, filled);
+        for (int i = 0; i < count; i++) {
+            out[i] = history[c][(historyPos + n - count + i) % n];
+        }
+        return count;
+    }
+
+    // Windowed spectrum of channel `c`, scaled to amplitude, into windowedRe / windowedIm and its magnitude into `magnitude`
+    void channelMagnitudes(int c) {
+        float scale = 2.f / config.windowSize;
+        const float* bre = re[c].data();
+        const float* bim = im[c].data();
+        float* wre = windowedRe[c].data();
+        float* wim = windowedIm[c].data();
+        // Hamming as a 3-tap kernel over neighbouring bins. Bin 0 is taken as zero,
+        // which is the same as removing the window mean before windowing.
+        for (int k = 0; k < numBins; k++) {
+            int kl = std::abs(k - 1);
+            int kr = (k + 1 < numBins) ? k + 1 : 2 * (numBins - 1) - (k + 1);
+            // Real input: X[-k] and X[N-k] are conj(X[k]), imaginary parts flip sign
+            float lre = (kl == 0) ? 0.f : bre[kl];
+            float lim = (kl == 0) ? 0.f : ((k - 1 < 0) ? -bim[kl] : bim[kl]);
+            float rre = bre[kr];
+            float rim = (k + 1 < numBins) ? bim[kr] : -bim[kr];
+            float cre = (k == 0) ? 0.f : bre[k];
+            float cim = (k == 0) ? 0.f : bim[k];
+            float yre = scale * (HAMMING_A * cre - 0.5f * HAMMING_B * (lre + rre));
+            float yim = scale * (HAMMING_A * cim - 0.5f * HAMMING_B * (lim + rim));
+            wre[k] = yre;
+            wim[k] = yim;
+            magnitude[k] = std::sqrt(yre * yre + yim * yim);
+        }
+    }
+
+    float reduce(int lo, int hi) const {
+        if (hi <= lo) return 0.f;
+        // Magnitudes are non-negative, so 0 is a valid identity for max too
+        float acc = 0.f;
+        for (int k = lo; k < hi; k++) {
+            if (config.reduction == REDUCE_MAX) {
+                acc = std::max(acc, magnitude[k]);
+            } else {
+                acc += magnitude[k];
+            }
+        }
+        if (config.reduction == REDUCE_MEAN) {
+            acc /= (hi - lo);
+        }
+        return acc;
+    }
+};
@@ -0,0 +1,245 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// Heartbeats in one PPG channel, one sample at a time.
+//
+// A pulse's upstroke is the steepest part of its wave, so beats are found on
+// the slope sum function (Zong et al., 2003): how far the signal, low-passed
+// at LOWPASS_HZ, has risen over the last SLOPE_WINDOW seconds, counting only
+// rising steps. Depending on the sensor the upstroke is a rise or a fall in the
+// raw value, so a slope sum is kept for each direction and the one with the
+// larger envelope is used.
+//
+// A beat fires when the slope sum crosses THRESHOLD of the running beat peak
+// level, outside a refractory period, so it is reported partway up the
+// upstroke, well within a beat of its onset. Each beat's peak, capped at
+// twice the level so an artifact can't deafen the detector, pulls the level
+// towards it; when beats stop for longer than MISSED_BEAT_FACTOR intervals
+// the level decays until they are found again.
+//
+// Replay stamps samples on the playback clock, so setTimeScale() takes the
+// replay speed and the detector keeps its own recording-time clock: every time
+// constant here is in recording seconds, whatever the speed.
+//
+// Beat intervals outside 30-200 BPM, or far from the recent mean, are left
+// out of the rate and variability estimates, which cover the last
+// HISTORY_BEATS intervals.
+//
+// process() is O(1) per sample plus O(HISTORY_BEATS) per beat, and nothing allocates.
+class BeatDetector {
+public:
+    // Two one-pole sections; an upstroke takes about 100 ms
+    static constexpr double LOWPASS_HZ = 8.0;
+    static constexpr float SLOPE_WINDOW = 0.125f;
+    static const int MAX_WINDOW = 64;
+    static constexpr float THRESHOLD = 0.5f;
+    // Share of each new beat peak in the level
+    static constexpr float LEVEL_ADAPTATION = 0.125f;
+    // Seconds of signal learned from before the first beat can fire
+    static constexpr double LEARN_SECONDS = 2.0;
+    static constexpr double REFRACTORY_SECONDS = 0.3;
+    static constexpr double MIN_INTERVAL = 0.3;
+    static constexpr double MAX_INTERVAL = 2.0;
+    // An interval this far from the mean, as a fraction of it, is an ectopic or missed beat
+    static constexpr double MAX_INTERVAL_DEVIATION = 0.5;
+    static constexpr double MISSED_BEAT_FACTOR = 1.66;
+    // Half-life of the level while beats are missing, and of the slope envelopes
+    static constexpr double LEVEL_HALF_LIFE = 1.0;
+    static constexpr double ENVELOPE_HALF_LIFE = 2.0;
+    static const int HISTORY_BEATS = 16;
+
+    // Rate and variability over the recent intervals; 0 until two intervals have been seen
+    float bpm = 0.f;
+    // Root mean square of successive interval differences, in seconds
+    float rmssd = 0.f;
+    uint64_t beats = 0;
+
+    void setSampleRate(float rate) {
+        if (rate == sampleRate) return;
+        sampleRate = rate;
+        window = std::min(std::max((int) std::lround(SLOPE_WINDOW * rate), 1), (int) MAX_WINDOW);
+        levelDecay = (float) std::exp(-M_LN2 / (LEVEL_HALF_LIFE * rate));
+        envelopeDecay = (float) std::exp(-M_LN2 / (ENVELOPE_HALF_LIFE * rate));
+        lowpass = (float) (1.0 - std::exp(-2.0 * M_PI * std::min(LOWPASS_HZ, 0.4 * rate) / rate));
+        reset();
+    }
+
+    // Recording seconds per second of the timestamps process() is given
+    void setTimeScale(double scale) {
+        timeScale = scale;
+    }
+
+    void reset() {
+        haveValue = false;
+        for (int i = 0; i < MAX_WINDOW; i++) {
+            steps[i] = 0.f;
+        }
+        stepPos = 0;
+        sums[0] = sums[1] = 0.f;
+        envelopes[0] = envelopes[1] = 0.f;
+        direction = 0;
+        level = 0.f;
+        inBeat = false;
+        beatPeak = 0.f;
+        learnUntil = -1.0;
+        lastBeat = -1.0;
+        resetIntervals();
+    }
+
+    // Feed one sample stamped with its source time. Returns true if a beat starts on it.
+    bool process(double sourceTime, float value) {
+        double timestamp = recordingTime(sourceTime);
+        if (!haveValue || timestamp < lastTime || timestamp - lastTime > MAX_INTERVAL) {
+            // First sample, or the source restarted or dropped out: relearn
+            reset();
+            haveValue = true;
+            smoothed[0] = smoothed[1] = value;
+            lastValue = value;
+            lastTime = timestamp;
+            learnUntil = timestamp + LEARN_SECONDS;
+            return false;
+        }
+        lastTime = timestamp;
+
+        // Slope sums over the last `window` steps, rising in sums[0] and falling in sums[1]
+        smoothed[0] += lowpass * (value - smoothed[0]);
+        smoothed[1] += lowpass * (smoothed[0] - smoothed[1]);
+        float oldest = steps[stepPos];
+        float step = smoothed[1] - lastValue;
+        lastValue = smoothed[1];
+        steps[stepPos] = step;
+        stepPos = (stepPos + 1) % window;
+        sums[0] += std::max(step, 0.f) - std::max(oldest, 0.f);
+        sums[1] += std::max(-step, 0.f) - std::max(-oldest, 0.f);
+        for (int d = 0; d < 2; d++) {
+            sums[d] = std::max(sums[d], 0.f);
+            envelopes[d] = std::max(sums[d], envelopes[d] * envelopeDecay);
+        }
+        float y = sums[direction];
+
+        if (timestamp < learnUntil) {
+            direction = envelopes[1] > envelopes[0] ? 1 : 0;
+            level = envelopes[direction];
+            return false;
+        }
+
+        float threshold = THRESHOLD * level;
+        if (inBeat) {
+            beatPeak = std::max(beatPeak, y);
+            if (y < threshold) {
+                level += LEVEL_ADAPTATION * (std::min(beatPeak, 2.f * level) - level);
+                inBeat = false;
+            }
+            return false;
+        }
+
+        double sinceBeat = lastBeat < 0.0 ? timestamp - learnUntil : timestamp - lastBeat;
+        double expected = meanInterval > 0.0 ? meanInterval : 1.0;
+        if (sinceBeat > MISSED_BEAT_FACTOR * expected) {
+            level *= levelDecay;
+            // The other direction may have become the upstroke, e.g. after the headband moved
+            direction = envelopes[1] > envelopes[0] ? 1 : 0;
+        }
+
+        if (y < threshold || y <= 0.f || sinceBeat < REFRACTORY_SECONDS) {
+            return false;
+        }
+        inBeat = true;
+        beatPeak = y;
+        beats++;
+        if (lastBeat >= 0.0) {
+            addInterval(timestamp - lastBeat);
+        }
+        lastBeat = timestamp;
+        return true;
+    }
+
+private:
+    float sampleRate = 0.f;
+    double timeScale = 1.0;
+    // Recording time of the last sample, and its source time
+    bool clockStarted = false;
+    double clock = 0.0;
+    double clockSourceTime = 0.0;
+    int window = 1;
+    float levelDecay = 1.f;
+    float envelopeDecay = 1.f;
+    float lowpass = 1.f;
+
+    bool haveValue = false;
+    float smoothed[2] = {};
+    float lastValue = 0.f;
+    double lastTime = 0.0;
+    float steps[MAX_WINDOW] = {};
+    int stepPos = 0;
+    float sums[2] = {};
+    float envelopes[2] = {};
+    int direction = 0;
+
+    float level = 0.f;
+    bool inBeat = false;
+    float beatPeak = 0.f;
+    double learnUntil = -1.0;
+    double lastBeat = -1.0;
+
+    // Accepted intervals, oldest first from intervalPos once the ring is full
+    double intervals[HISTORY_BEATS] = {};
+    int intervalPos = 0;
+    int intervalCount = 0;
+    double meanInterval = 0.0;
+    int rejected = 0;
+
+    // Advances by timeScale times the source time since the last sample; a jump
+    // back in source time stays a jump back, so the detector still relearns
+    double recordingTime(double sourceTime) {
+        clock = clockStarted ? clock + (sourceTime - clockSourceTime) * timeScale : sourceTime;
+        clockStarted = true;
+        clockSourceTime = sourceTime;
+        return clock;
+    }
+
+    void resetIntervals() {
+        intervalPos = 0;
+        intervalCount = 0;
+        meanInterval = 0.0;
+        rejected = 0;
+        bpm = 0.f;
+        rmssd = 0.f;
+    }
+
+    void addInterval(double interval) {
+        bool outlier = interval < MIN_INTERVAL || interval > MAX_INTERVAL ||
+            (intervalCount >= 4 && std::fabs(interval - meanInterval) > MAX_INTERVAL_DEVIATION * meanInterval);
+        if (outlier) {
+            // A run of them means the rate itself has changed
+            if (++rejected >= 4) {
+                resetIntervals();
+            }
+            return;
+        }
+        rejected = 0;
+        intervals[intervalPos] = interval;
+        intervalPos = (intervalPos + 1) % HISTORY_BEATS;
+        intervalCount = std::min(intervalCount + 1, (int) HISTORY_BEATS);
+
+        int first = intervalCount < HISTORY_BEATS ? 0 : intervalPos;
+        double sum = 0.0;
+        double squaredDifferences = 0.0;
+        double previous = 0.0;
+        for (int i = 0; i < intervalCount; i++) {
+            double current = intervals[(first + i) % HISTORY_BEATS];
+            sum += current;
+            if (i > 0) {
+                squaredDifferences += (current - previous) * (current - previous);
+            }
+            previous = current;
+        }
+        meanInterval = sum / intervalCount;
+        if (intervalCount >= 2) {
+            bpm = (float) (60.0 / meanInterval);
+            rmssd = (float) std::sqrt(squaredDifferences / (intervalCount - 1));
+        }
+    }
+};
@@ -0,0 +1,367 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Monotonic deque over a preallocated circular array. Each entry remembers the
+// sequence number of the sample it came from so it can be expired once it
+// falls out of the window.
+struct MonotonicQueue {
+    struct Entry {
+        float value;
+        uint32_t seq;
+    };
+
+    std::vector<Entry> entries;
+    size_t mask = 0;
+    size_t front = 0;
+    size_t back = 0;
+
+    void allocate(size_t minCapacity) {
+        size_t capacity = 1;
+        while (capacity < minCapacity) {
+            capacity <<= 1;
+        }
+        entries.assign(capacity, Entry{0.f, 0});
+        mask = capacity - 1;
+        front = back = 0;
+    }
+
+    bool empty() const {
+        return front == back;
+    }
+
+    const Entry& first() const {
+        return entries[front & mask];
+    }
+
+    // Push `value`, first dropping every entry from the back that it dominates.
+    // `keep(a, b)` is true when an older `a` must stay in front of a newer `b`.
+    template <typename Keep>
+    void push(float value, uint32_t seq, Keep keep) {
+        while (!empty() && !keep(entries[(back - 1) & mask].value, value)) {
+            back--;
+        }
+        entries[back & mask] = Entry{value, seq};
+        back++;
+    }
+
+    // Drop entries that are `window` or more samples older than the newest sample `seq`.
+    void expire(uint32_t seq, size_t window) {
+        while (!empty() && (uint32_t) (seq - first().seq) >= window) {
+            front++;
+        }
+    }
+};
+
+// How normalizeValue() maps a channel onto +-5 V
+enum NormalizationMode {
+    NORMALIZE_MIN_MAX,    // min to max over the window
+    NORMALIZE_ZSCORE,     // +-3 standard deviations of an EWMA with the window as its time constant
+    NORMALIZE_PERCENTILE, // 5th to 95th percentile, clipped
+    NORMALIZATION_MODES_LEN
+};
+
+// Mean and variance that weigh every sample equally (Welford) until `horizon`
+// samples have been seen, then become an exponentially weighted average with
+// that time constant. From then on a sample further than OUTLIER_DEVIATIONS
+// from the mean counts as if it were only that far, so an artifact can't blow
+// up the variance, while a lasting level change still pulls both along.
+struct RunningMoments {
+    static constexpr double OUTLIER_DEVIATIONS = 5.0;
+
+    double mean = 0.0;
+    double variance = 0.0;
+    uint64_t count = 0;
+
+    void update(float x, double horizon) {
+        count++;
+        double weight = std::max(1.0 / count, 1.0 / horizon);
+        double delta = x - mean;
+        if (count > horizon) {
+            double limit = OUTLIER_DEVIATIONS * std::sqrt(variance);
+            delta = std::min(std::max(delta, -limit), limit);
+        }
+        mean += weight * delta;
+        variance = (1.0 - weight) * (variance + weight * delta * delta);
+    }
+};
+
+// Streaming estimate of one quantile with the P-square algorithm (Jain and
+// Chlamtac, 1985): five markers whose heights track the min, p/2, p, (1+p)/2
+// and max quantiles of every sample so far, nudged by piecewise-parabolic
+// interpolation as samples arrive.
+struct P2Quantile {
+    float p = 0.5f;
+    double height[5] = {};
+    double position[5] = {};
+    double desired[5] = {};
+    uint64_t count = 0;
+
+    void reset(float quantile) {
+        p = quantile;
+        count = 0;
+    }
+
+    void update(float x) {
+        if (count < 5) {
+            // Insertion sort the first five samples
+            int i = (int) count++;
+            for (; i > 0 && height[i - 1] > x; i--) {
+                height[i] = height[i - 1];
+            }
+            height[i] = x;
+            if (count == 5) {
+                setPositions(4.0);
+            }
+            return;
+        }
+        count++;
+
+        int k;
+        if (x < height[0]) {
+            height[0] = x;
+            k = 0;
+        } else if (x >= height[4]) {
+            height[4] = x;
+            k = 3;
+        } else {
+            k = 0;
+            while (x >= height[k + 1]) k++;
+        }
+        for (int i = k + 1; i < 5; i++) {
+            position[i] += 1.0;
+        }
+        const double increment[5] = {0.0, p / 2.0, p, (1.0 + p) / 2.0, 1.0};
+        for (int i = 0; i < 5; i++) {
+            desired[i] += increment[i];
+        }
+
+        for (int i = 1; i < 4; i++) {
+            double d = desired[i] - position[i];
+            if ((d >= 1.0 && position[i + 1] - position[i] > 1.0) || (d <= -1.0 && position[i - 1] - position[i] < -1.0)) {
+                int step = d > 0.0 ? 1 : -1;
+                double q = parabolic(i, step);
+                if (height[i - 1] < q && q < height[i + 1]) {
+                    height[i] = q;
+                } else {
+                    height[i] += step * (height[i + step] - height[i]) / (position[i + step] - position[i]);
+                }
+                position[i] += step;
+            }
+        }
+    }
+
+    float value() const {
+        if (count >= 5) return height[2];
+        if (count == 0) return 0.f;
+        return height[std::min((int) (p * count), (int) count - 1)];
+    }
+
+    // Resume from saved marker heights as if `samples` had been seen
+    void restore(const double* heights, uint64_t samples) {
+        for (int i = 0; i < 5; i++) {
+            height[i] = heights[i];
+        }
+        count = std::max(samples, (uint64_t) 5);
+        setPositions(count - 1.0);
+    }
+
+private:
+    // Markers at their desired positions for `last` + 1 samples
+    void setPositions(double last) {
+        const double fraction[5] = {0.0, p / 2.0, p, (1.0 + p) / 2.0, 1.0};
+        for (int i = 0; i < 5; i++) {
+            desired[i] = last * fraction[i];
+            position[i] = std::round(desired[i]);
+        }
+        for (int i = 1; i < 5; i++) {
+            position[i] = std::max(position[i], position[i - 1] + 1.0);
+        }
+    }
+
+    double parabolic(int i, int step) const {
+        double d = step;
+        return height[i] + d / (position[i + 1] - position[i - 1]) *
+            ((position[i] - position[i - 1] + d) * (height[i + 1] - height[i]) / (position[i + 1] - position[i]) +
+             (position[i + 1] - position[i] - d) * (height[i] - height[i - 1]) / (position[i] - position[i - 1]));
+    }
+};
+
+// A P2Quantile over roughly the last `horizon` samples. P-square never forgets
+// (its outer markers are the all-time extremes), so two estimators run
+// `horizon` samples apart and each starts over after 2 * `horizon`; the older
+// one answers, from between `horizon` and 2 * `horizon` samples.
+struct WindowedQuantile {
+    P2Quantile estimators[2];
+    int oldest = 0;
+
+    void reset(float quantile) {
+        estimators[0].reset(quantile);
+        estimators[1].reset(quantile);
+        oldest = 0;
+    }
+
+    void update(float x, double horizon) {
+        P2Quantile& older = estimators[oldest];
+        older.update(x);
+        if (older.count > horizon) {
+            estimators[1 - oldest].update(x);
+        }
+        if (older.count >= 2.0 * horizon) {
+            older.reset(older.p);
+            oldest = 1 - oldest;
+        }
+    }
+
+    float value() const {
+        return estimators[oldest].value();
+    }
+
+    const P2Quantile& current() const {
+        return estimators[oldest];
+    }
+
+    void restore(const double* heights, uint64_t samples) {
+        estimators[0].restore(heights, samples);
+        estimators[1].reset(estimators[1].p);
+        oldest = 0;
+    }
+};
+
+// Normalization statistics of one channel: running min/max over the last
+// `window` samples, and the moments and percentiles behind the other
+// NormalizationModes, which use the window as their time constant. All are
+// kept up to date so switching modes needs no warm-up.
+// Buffers are sized once by allocate(); update() is amortized O(1) and never allocates.
+struct ChannelStats {
+    static constexpr float LOW_PERCENTILE = 0.05f;
+    static constexpr float HIGH_PERCENTILE = 0.95f;
+    // Standard deviations that map to +-5 V in NORMALIZE_ZSCORE
+    static constexpr float ZSCORE_RANGE = 3.f;
+    // Fewest samples the percentiles are estimated from, however short the window
+    static const size_t MIN_QUANTILE_SAMPLES = 64;
+
+    MonotonicQueue maxQueue;
+    MonotonicQueue minQueue;
+    size_t capacity = 0;
+    size_t count = 0;
+    uint32_t seq = 0;
+    float max = -std::numeric_limits<float>::infinity();
+    float min = std::numeric_limits<float>::infinity();
+    RunningMoments moments;
+    WindowedQuantile low;
+    WindowedQuantile high;
+
+    // What a patch saves to start warm, see save() and restore()
+    struct State {
+        float min = 0.f;
+        float max = 0.f;
+        double mean = 0.0;
+        double variance = 0.0;
+        double low[5] = {};
+        double high[5] = {};
+    };
+
+    void allocate(size_t maxWindow) {
+        capacity = maxWindow;
+        // One extra slot: update() pushes before it expires
+        maxQueue.allocate(maxWindow + 1);
+        minQueue.allocate(maxWindow + 1);
+        reset();
+    }
+
+    void reset() {
+        maxQueue.front = maxQueue.back = 0;
+        minQueue.front = minQueue.back = 0;
+        count = 0;
+        seq = 0;
+        max = -std::numeric_limits<float>::infinity();
+        min = std::numeric_limits<float>::infinity();
+        moments = RunningMoments();
+        low.reset(LOW_PERCENTILE);
+        high.reset(HIGH_PERCENTILE);
+    }
+
+    // False until enough samples have been seen to restore from
+    bool save(State& state) const {
+        if (count == 0 || low.current().count < 5) return false;
+        state.min = min;
+        state.max = max;
+        state.mean = moments.mean;
+        state.variance = moments.variance;
+        for (int i = 0; i < 5; i++) {
+            state.low[i] = low.current().height[i];
+            state.high[i] = high.current().height[i];
+        }
+        return true;
+    }
+
+    // Continue from `state` as if a full `window` of samples had been seen. The min
+    // and max stand in as the only samples in the window until real ones push them out.
+    void restore(const State& state, size_t window) {
+        reset();
+        update(state.min, window);
+        update(state.max, window);
+        moments.mean = state.mean;
+        moments.variance = state.variance;
+        moments.count = window;
+        size_t quantileHorizon = std::max(window, (size_t) MIN_QUANTILE_SAMPLES);
+        low.restore(state.low, quantileHorizon);
+        high.restore(state.high, quantileHorizon);
+    }
+
+    void update(float sample, size_t window) {
+        if (window > capacity) window = capacity;
+        if (window < 1) window = 1;
+
+        maxQueue.push(sample, seq, [](float older, float newer) { return older > newer; });
+        minQueue.push(sample, seq, [](float older, float newer) { return older < newer; });
+        maxQueue.expire(seq, window);
+        minQueue.expire(seq, window);
+        seq++;
+
+        count = std::min(count + 1, window);
+        max = maxQueue.first().value;
+        min = minQueue.first().value;
+
+        moments.update(sample, window);
+        double quantileHorizon = std::max((double) window, (double) MIN_QUANTILE_SAMPLES);
+        low.update(sample, quantileHorizon);
+        high.update(sample, quantileHorizon);
+    }
+};
+
+// Function to update channel statistics over the last `secondsToKeep` seconds
+inline void updateChannelStats(ChannelStats& stats, float sample, float sampleRate, float secondsToKeep) {
+    stats.update(sample, (size_t) (sampleRate * secondsToKeep));
+}
+
+// Function to normalize a value
+inline float normalizeValue(float value, const ChannelStats& stats) {
+    if (stats.count == 0) return 0.f;
+    float range = stats.max - stats.min;
+    if (range == 0) return 0.f;
+    float normalized = (value - stats.min) / range;
+    return (normalized - 0.5f) * 10.f;
+}
+
+inline float normalizeValue(float value, const ChannelStats& stats, NormalizationMode mode) {
+    if (mode == NORMALIZE_ZSCORE) {
+        float deviation = std::sqrt((float) stats.moments.variance);
+        if (deviation == 0.f) return 0.f;
+        float z = (value - (float) stats.moments.mean) / deviation;
+        return std::min(std::max(z * 5.f / ChannelStats::ZSCORE_RANGE, -10.f), 10.f);
+    }
+    if (mode == NORMALIZE_PERCENTILE) {
+        float low = stats.low.value();
+        float range = stats.high.value() - low;
+        if (range <= 0.f) return 0.f;
+        float normalized = (value - low) / range;
+        return (std::min(std::max(normalized, 0.f), 1.f) - 0.5f) * 10.f;
+    }
+    return normalizeValue(value, stats);
+}
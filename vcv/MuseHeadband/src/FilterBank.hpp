@@ -0,0 +1,268 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include <simd/Vector.hpp>
+
+// Mains interference to remove
+enum NotchMode {
+    NOTCH_OFF,
+    NOTCH_50HZ,
+    NOTCH_60HZ,
+    NOTCH_MODES_LEN
+};
+
+enum BandpassMode {
+    BANDPASS_OFF,
+    // 4th-order Butterworth high-pass and low-pass: little delay, phase varies with frequency
+    BANDPASS_IIR,
+    // Hamming-windowed sinc, like firwin() in lib/livestream.py: linear phase, (taps - 1) / 2 samples of delay
+    BANDPASS_FIR,
+    BANDPASS_MODES_LEN
+};
+
+struct FilterConfig {
+    NotchMode notch = NOTCH_OFF;
+    BandpassMode bandpass = BANDPASS_OFF;
+    // Passband edges in Hz. The server's EEG filter is 1-40 Hz.
+    float low = 1.f;
+    float high = 40.f;
+    int firTaps = 32;
+};
+
+// One second-order section in transposed direct form II, normalized so a0 == 1
+struct Biquad {
+    float b0 = 1.f, b1 = 0.f, b2 = 0.f;
+    float a1 = 0.f, a2 = 0.f;
+
+    // Designs from the RBJ Audio EQ Cookbook
+    static Biquad notch(double freq, double q, double sampleRate) {
+        double w = 2.0 * M_PI * freq / sampleRate;
+        double alpha = std::sin(w) / (2.0 * q);
+        return normalized(1.0, -2.0 * std::cos(w), 1.0, 1.0 + alpha, -2.0 * std::cos(w), 1.0 - alpha);
+    }
+
+    static Biquad lowpass(double freq, double q, double sampleRate) {
+        double w = 2.0 * M_PI * freq / sampleRate;
+        double alpha = std::sin(w) / (2.0 * q);
+        double c = std::cos(w);
+        return normalized((1.0 - c) / 2.0, 1.0 - c, (1.0 - c) / 2.0, 1.0 + alpha, -2.0 * c, 1.0 - alpha);
+    }
+
+    static Biquad highpass(double freq, double q, double sampleRate) {
+        double w = 2.0 * M_PI * freq / sampleRate;
+        double alpha = std::sin(w) / (2.0 * q);
+        double c = std::cos(w);
+        return normalized((1.0 + c) / 2.0, -(1.0 + c), (1.0 + c) / 2.0, 1.0 + alpha, -2.0 * c, 1.0 - alpha);
+    }
+
+    static Biquad normalized(double b0, double b1, double b2, double a0, double a1, double a2) {
+        Biquad biquad;
+        biquad.b0 = b0 / a0;
+        biquad.b1 = b1 / a0;
+        biquad.b2 = b2 / a0;
+        biquad.a1 = a1 / a0;
+        biquad.a2 = a2 / a0;
+        return biquad;
+    }
+
+    // Gain for a constant input
+    float dcGain() const {
+        return (b0 + b1 + b2) / (1.f + a1 + a2);
+    }
+};
+
+// Notch and bandpass for every channel of one stream, one sample at a time.
+//
+// Channels are packed four to a float_4 (structure of arrays: lane i of
+// vector v is channel 4 * v + i), so each biquad section and FIR tap costs one
+// vector multiply-add per four channels. The notch is a biquad at the mains
+// frequency and its first harmonic; the IIR bandpass is two more cascaded
+// sections each side, and the FIR bandpass runs after the notch over a
+// doubled delay line so the convolution never wraps.
+//
+// State carries from one sample to the next; the first sample after
+// configure() or reset() primes every stage as if that value had always been
+// the input (lfilter_zi() in scipy), so DC offsets don't ring at startup.
+//
+// configure() allocates; process() and reset() don't.
+template <int CHANNELS>
+class FilterBank {
+public:
+    typedef rack::simd::float_4 float_4;
+    static const int VECTORS = (CHANNELS + 3) / 4;
+    // Notch at the fundamental and first harmonic, plus two sections each for the high- and low-pass
+    static const int MAX_SECTIONS = 6;
+    static const int MIN_TAPS = 4;
+    static const int MAX_TAPS = 256;
+    // Width of each notch; Q = frequency / NOTCH_BANDWIDTH
+    static constexpr double NOTCH_BANDWIDTH = 4.0;
+    // Nothing is designed closer to Nyquist than this fraction of it
+    static constexpr double MAX_NYQUIST_FRACTION = 0.95;
+
+    // Designs the filters for `newConfig` at `newSampleRate` and clears their state
+    void configure(const FilterConfig& newConfig, float newSampleRate) {
+        config = newConfig;
+        sampleRate = newSampleRate;
+        numSections = 0;
+        numTaps = 0;
+        double nyquist = 0.5 * sampleRate * MAX_NYQUIST_FRACTION;
+
+        if (config.notch != NOTCH_OFF) {
+            double mains = config.notch == NOTCH_50HZ ? 50.0 : 60.0;
+            for (double freq = mains; freq < nyquist && numSections < 2; freq += mains) {
+                sections[numSections++] = Biquad::notch(freq, freq / NOTCH_BANDWIDTH, sampleRate);
+            }
+        }
+
+        // Both edges stay below Nyquist, where the designs would turn unstable
+        double low = std::min(std::max((double) config.low, 0.0), nyquist);
+        double high = std::min((double) config.high, nyquist);
+        if (config.bandpass == BANDPASS_IIR) {
+            // Butterworth pole pairs of a 4th-order section, Q = 1 / (2 cos(k pi / 8)), k = 1, 3
+            static const double BUTTERWORTH_Q[2] = {0.54119610, 1.30656296};
+            for (int k = 0; k < 2; k++) {
+                if (low > 0.0 && low < high) {
+                    sections[numSections++] = Biquad::highpass(low, BUTTERWORTH_Q[k], sampleRate);
+                }
+                if (high > low) {
+                    sections[numSections++] = Biquad::lowpass(high, BUTTERWORTH_Q[k], sampleRate);
+                }
+            }
+        } else if (config.bandpass == BANDPASS_FIR && high > low) {
+            designFir(low, high);
+        }
+
+        history.assign((size_t) (2 * numTaps * VECTORS), float_4(0.f));
+        reset();
+    }
+
+    // Forget the signal so far; the next sample primes the filters again
+    void reset() {
+        primed = false;
+        historyPos = 0;
+    }
+
+    bool enabled() const {
+        return numSections > 0 || numTaps > 0;
+    }
+
+    // Delay of the FIR stage in seconds. The IIR stages delay each frequency differently.
+    float firDelay() const {
+        return numTaps > 0 ? 0.5f * (numTaps - 1) / sampleRate : 0.f;
+    }
+
+    // Filter one sample of each channel, in place
+    void process(float* values) {
+        float padded[VECTORS * 4] = {};
+        memcpy(padded, values, CHANNELS * sizeof(float));
+        float_4 x[VECTORS];
+        for (int v = 0; v < VECTORS; v++) {
+            x[v] = float_4::load(padded + 4 * v);
+        }
+        if (!primed) {
+            prime(x);
+        }
+
+        for (int s = 0; s < numSections; s++) {
+            const Biquad& q = sections[s];
+            for (int v = 0; v < VECTORS; v++) {
+                float_4 y = q.b0 * x[v] + z1[s][v];
+                z1[s][v] = q.b1 * x[v] - q.a1 * y + z2[s][v];
+                z2[s][v] = q.b2 * x[v] - q.a2 * y;
+                x[v] = y;
+            }
+        }
+
+        if (numTaps > 0) {
+            // Newest sample at historyPos; history[historyPos + k] is k samples old
+            historyPos = (historyPos == 0 ? numTaps : historyPos) - 1;
+            for (int v = 0; v < VECTORS; v++) {
+                history[historyPos * VECTORS + v] = x[v];
+                history[(historyPos + numTaps) * VECTORS + v] = x[v];
+            }
+            const float_4* h = &history[historyPos * VECTORS];
+            for (int v = 0; v < VECTORS; v++) {
+                float_4 y = 0.f;
+                for (int k = 0; k < numTaps; k++) {
+                    y += taps[k] * h[k * VECTORS + v];
+                }
+                x[v] = y;
+            }
+        }
+
+        for (int v = 0; v < VECTORS; v++) {
+            x[v].store(padded + 4 * v);
+        }
+        memcpy(values, padded, CHANNELS * sizeof(float));
+    }
+
+private:
+    FilterConfig config;
+    float sampleRate = 256.f;
+
+    Biquad sections[MAX_SECTIONS];
+    int numSections = 0;
+    float_4 z1[MAX_SECTIONS][VECTORS];
+    float_4 z2[MAX_SECTIONS][VECTORS];
+
+    // Taps broadcast across the lanes, and the delay line, indexed [sample][vector] and stored twice over
+    std::vector<float_4> taps;
+    std::vector<float_4> history;
+    int numTaps = 0;
+    int historyPos = 0;
+    bool primed = false;
+
+    // Hamming-windowed sinc bandpass (lowpass when `low` is 0), unity gain at the band's centre
+    void designFir(double low, double high) {
+        numTaps = std::min(std::max(config.firTaps, (int) MIN_TAPS), (int) MAX_TAPS);
+        double fl = low / sampleRate;
+        double fh = high / sampleRate;
+        double centre = low > 0.0 ? 0.5 * (fl + fh) : 0.0;
+        double gain = 0.0;
+        for (int n = 0; n < numTaps; n++) {
+            gain += firTap(n, fl, fh) * std::cos(2.0 * M_PI * centre * (n - 0.5 * (numTaps - 1)));
+        }
+        taps.resize((size_t) numTaps);
+        for (int n = 0; n < numTaps; n++) {
+            taps[n] = float_4((float) (firTap(n, fl, fh) / gain));
+        }
+    }
+
+    // Tap `n` before normalization, with the edges as fractions of the sample rate
+    double firTap(int n, double fl, double fh) const {
+        double m = n - 0.5 * (numTaps - 1);
+        double window = 0.54 - 0.46 * std::cos(2.0 * M_PI * n / (numTaps - 1));
+        return window * (2.0 * fh * sinc(2.0 * fh * m) - 2.0 * fl * sinc(2.0 * fl * m));
+    }
+
+    static double sinc(double x) {
+        return x == 0.0 ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+    }
+
+    // Steady state for an input that has always been `x`
+    void prime(const float_4* x) {
+        float_4 in[VECTORS];
+        for (int v = 0; v < VECTORS; v++) {
+            in[v] = x[v];
+        }
+        for (int s = 0; s < numSections; s++) {
+            const Biquad& q = sections[s];
+            float gain = q.dcGain();
+            for (int v = 0; v < VECTORS; v++) {
+                float_4 out = gain * in[v];
+                z1[s][v] = out - q.b0 * in[v];
+                z2[s][v] = q.b2 * in[v] - q.a2 * out;
+                in[v] = out;
+            }
+        }
+        for (int n = 0; n < 2 * numTaps; n++) {
+            for (int v = 0; v < VECTORS; v++) {
+                history[n * VECTORS + v] = in[v];
+            }
+        }
+        primed = true;
+    }
+};
@@ -0,0 +1,218 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Timestamp-scheduled jitter buffer with clock recovery and band-limited
+// resampling from the source rate to the engine rate.
+//
+// push() places each sample on a uniform grid by its source timestamp: short
+// gaps are filled by interpolating across them, duplicates and out-of-order
+// samples are dropped, and long gaps, or a clock that jumps back by more than
+// a gap (a restarted server or replay), restart playback. process() advances a
+// fractional playhead at sourceRate / engineRate, trimmed by a PI loop that
+// keeps `targetLatency` seconds buffered, so drift between the headband's clock
+// and the audio clock is absorbed without clicks. Output is an 8-tap
+// Blackman-windowed sinc evaluated from a polyphase table.
+//
+// Both calls run on the audio thread; nothing allocates after construction.
+template <int CHANNELS>
+struct JitterBuffer {
+    static const int TAPS = 8;
+    static const int HALF_TAPS = TAPS / 2;
+    static const int PHASES = 256;
+    static const size_t CAPACITY = 4096;
+    static const size_t MASK = CAPACITY - 1;
+
+    // Clock recovery loop
+    static constexpr double SMOOTHING_SECONDS = 2.0;
+    static constexpr double KP = 0.05;
+    static constexpr double KI = 0.005;
+    static constexpr double MAX_RATE_ADJUST = 0.02;
+    // Gaps up to this long are bridged; anything longer restarts playback
+    static constexpr double MAX_GAP_SECONDS = 0.25;
+
+    std::vector<float> history;
+    std::vector<float> table;
+
+    double sourceRate = 256.0;
+    double targetLatency = 0.2;
+
+    uint64_t writeCount = 0;
+    double readPos = 0.0;
+    double lastTimestamp = 0.0;
+    bool haveTimestamp = false;
+    bool started = false;
+    double smoothedError = 0.0;
+    double integral = 0.0;
+    double rateRatio = 1.0;
+
+    // Counters, read by the UI
+    uint64_t underruns = 0;
+    uint64_t resyncs = 0;
+    uint64_t dropped = 0;
+    uint64_t bridged = 0;
+
+    JitterBuffer() {
+        history.assign(CAPACITY * CHANNELS, 0.f);
+        // table[p * TAPS + j] weights sample (base - HALF_TAPS + 1 + j) at fractional offset p / PHASES
+        table.resize((PHASES + 1) * TAPS);
+        for (int p = 0; p <= PHASES; p++) {
+            double frac = (double) p / PHASES;
+            double sum = 0.0;
+            for (int j = 0; j < TAPS; j++) {
+                double t = frac + (HALF_TAPS - 1) - j;
+                double sinc = (t == 0.0) ? 1.0 : std::sin(M_PI * t) / (M_PI * t);
+                double x = t / HALF_TAPS;
+                double window = (std::fabs(x) >= 1.0) ? 0.0 : 0.42 + 0.5 * std::cos(M_PI * x) + 0.08 * std::cos(2 * M_PI * x);
+                table[p * TAPS + j] = sinc * window;
+                sum += sinc * window;
+            }
+            // Unity gain at DC for every phase
+            for (int j = 0; j < TAPS; j++) {
+                table[p * TAPS + j] /= sum;
+            }
+        }
+    }
+
+    void setSourceRate(double rate) {
+        sourceRate = rate;
+    }
+
+    void setTargetLatency(double seconds) {
+        double maxLatency = (CAPACITY / 2 - TAPS) / sourceRate;
+        targetLatency = std::min(std::max(seconds, 0.0), maxLatency);
+    }
+
+    void reset() {
+        writeCount = 0;
+        readPos = 0.0;
+        haveTimestamp = false;
+        started = false;
+        smoothedError = 0.0;
+        integral = 0.0;
+        rateRatio = 1.0;
+    }
+
+    // Seconds of audio currently buffered ahead of the playhead, including the interpolator's delay
+    double latency() const {
+        if (!started) return 0.0;
+        return (writeCount - readPos) / sourceRate;
+    }
+
+    // Source time at the playhead, for stamping what is being output
+    double playheadTime() const {
+        return lastTimestamp - (writeCount - 1 - readPos) / sourceRate;
+    }
+
+    void push(double timestamp, const float* values) {
+        if (haveTimestamp) {
+            double dt = timestamp - lastTimestamp;
+            if (dt <= 0.0 && dt >= -MAX_GAP_SECONDS) {
+                dropped++;
+                return;
+            }
+            long missing = std::lround(dt * sourceRate) - 1;
+            if (dt > MAX_GAP_SECONDS || dt < 0.0) {
+                // A long gap, or the source's clock restarted
+                started = false;
+                resyncs++;
+            } else if (missing > 0) {
+                // Bridge the gap with a straight line from the last sample
+                const float* last = frame(writeCount - 1);
+                for (long m = 1; m <= missing; m++) {
+                    float t = (float) m / (missing + 1);
+                    float* dst = frame(writeCount);
+                    for (int c = 0; c < CHANNELS; c++) {
+                        dst[c] = last[c] + t * (values[c] - last[c]);
+                    }
+                    writeCount++;
+                    bridged++;
+                }
+            }
+        }
+        lastTimestamp = timestamp;
+        haveTimestamp = true;
+
+        float* dst = frame(writeCount);
+        for (int c = 0; c < CHANNELS; c++) {
+            dst[c] = values[c];
+        }
+        writeCount++;
+    }
+
+    // `targetFill` behind the newest sample, but never so close to the first that
+    // the interpolator would reach before it into slots that were never written
+    double startingPlayhead(double targetFill) const {
+        return std::max((double) writeCount - targetFill, (double) (HALF_TAPS - 1));
+    }
+
+    // Produce one output sample. Returns false while priming or after an underrun,
+    // in which case `out` is untouched and the caller should hold its last value.
+    bool process(double sampleTime, float* out) {
+        double targetFill = targetLatency * sourceRate + HALF_TAPS;
+        double fill = (double) writeCount - readPos;
+
+        if (!started) {
+            if (writeCount < (uint64_t) TAPS || fill < targetFill) {
+                return false;
+            }
+            readPos = startingPlayhead(targetFill);
+            smoothedError = 0.0;
+            started = true;
+            fill = (double) writeCount - readPos;
+        }
+
+        double errorSeconds = (fill - targetFill) / sourceRate;
+        if (std::fabs(errorSeconds) > std::max(0.5, 2.0 * targetLatency) || fill > CAPACITY - TAPS) {
+            readPos = startingPlayhead(targetFill);
+            smoothedError = 0.0;
+            resyncs++;
+            errorSeconds = 0.0;
+        }
+
+        // Interpolate around the playhead
+        double base = std::floor(readPos);
+        uint64_t first = (uint64_t) std::max(base - (HALF_TAPS - 1), 0.0);
+        if (base < HALF_TAPS - 1 || first + TAPS > writeCount) {
+            underruns++;
+            started = false;
+            return false;
+        }
+        double phase = (readPos - base) * PHASES;
+        int p = (int) phase;
+        float mix = (float) (phase - p);
+        float coeffs[TAPS];
+        for (int j = 0; j < TAPS; j++) {
+            float a = table[p * TAPS + j];
+            float b = table[(p + 1) * TAPS + j];
+            coeffs[j] = a + mix * (b - a);
+        }
+        for (int c = 0; c < CHANNELS; c++) {
+            out[c] = 0.f;
+        }
+        for (int j = 0; j < TAPS; j++) {
+            const float* src = frame(first + j);
+            for (int c = 0; c < CHANNELS; c++) {
+                out[c] += coeffs[j] * src[c];
+            }
+        }
+
+        // Clock recovery: trim the playback rate to hold the target fill
+        double alpha = std::min(1.0, sampleTime / SMOOTHING_SECONDS);
+        smoothedError += (errorSeconds - smoothedError) * alpha;
+        double maxAdjust = MAX_RATE_ADJUST;
+        integral = std::min(std::max(integral + KI * smoothedError * sampleTime, -maxAdjust), maxAdjust);
+        double adjust = std::min(std::max(KP * smoothedError + integral, -maxAdjust), maxAdjust);
+        rateRatio = 1.0 + adjust;
+        readPos += sourceRate * sampleTime * rateRatio;
+        return true;
+    }
+
+private:
+    float* frame(uint64_t index) {
+        return &history[(index & MASK) * CHANNELS];
+    }
+};
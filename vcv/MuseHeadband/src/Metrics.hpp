@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Fixed-bucket histogram for hot-path instrumentation.
+//
+// record() is a handful of relaxed atomic adds, so it is safe on the audio
+// thread and from any number of writers; readers take a snapshot() and may
+// see a sample counted in `count` but not yet in its bucket, which is fine
+// for monitoring. Values are unsigned integers in whatever unit the caller
+// picks (microseconds, frames). Bucket 0 holds 0, bucket i holds
+// [2^(i-1), 2^i), and the last bucket holds everything larger.
+struct Histogram {
+    static const int BUCKETS = 32;
+
+    struct Snapshot {
+        uint64_t buckets[BUCKETS];
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t last;
+
+        double mean() const {
+            return count > 0 ? (double) sum / count : 0.0;
+        }
+
+        // Upper edge of the bucket holding quantile q, clamped to the largest value seen
+        uint64_t percentile(double q) const {
+            if (count == 0) return 0;
+            uint64_t rank = (uint64_t) (q * (count - 1)) + 1;
+            uint64_t seen = 0;
+            for (int i = 0; i < BUCKETS; i++) {
+                seen += buckets[i];
+                if (seen >= rank) {
+                    uint64_t edge = (i == 0) ? 0 : ((uint64_t) 1 << i) - 1;
+                    return edge < max ? edge : max;
+                }
+            }
+            return max;
+        }
+    };
+
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+    // Most recent value, for the stats output
+    std::atomic<uint64_t> last;
+
+    Histogram() {
+        reset();
+    }
+
+    static int bucketOf(uint64_t value) {
+        int bucket = 0;
+        while (value > 0 && bucket < BUCKETS - 1) {
+            value >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+    void record(uint64_t value) {
+        buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        last.store(value, std::memory_order_relaxed);
+        uint64_t prev = max.load(std::memory_order_relaxed);
+        while (value > prev && !max.compare_exchange_weak(prev, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Record a duration in seconds as whole microseconds; negative durations count as 0
+    void recordMicros(double seconds) {
+        record(seconds > 0.0 ? (uint64_t) (seconds * 1e6) : 0);
+    }
+
+    Snapshot snapshot() const {
+        Snapshot s;
+        for (int i = 0; i < BUCKETS; i++) {
+            s.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+        }
+        s.count = count.load(std::memory_order_relaxed);
+        s.sum = sum.load(std::memory_order_relaxed);
+        s.max = max.load(std::memory_order_relaxed);
+        s.last = last.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    void reset() {
+        for (int i = 0; i < BUCKETS; i++) {
+            buckets[i].store(0, std::memory_order_relaxed);
+        }
+        count.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        max.store(0, std::memory_order_relaxed);
+        last.store(0, std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,198 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include <rack.hpp>
+
+#include "SampleRing.hpp"
+#include "BandPower.hpp"
+
+// The headband module's expander bus. The module on its right is handed every
+// sample as it arrives, with its source timestamp, and the spectra behind the
+// band outputs, so a chain of analysis modules needn't re-buffer voltages.
+//
+// Nothing is copied per consumer: the headband writes into the rings of a
+// MuseBusPool, and each expander message only carries a reference to the pool
+// and the newest sequence number in each ring. A message stays readable for
+// the frame it arrives in; anything kept longer than that is copied out. The
+// pool is shared, so messages still in flight when the headband is deleted
+// keep it alive.
+//
+// A module takes the bus by deriving from MuseBusConsumer, allocating both of
+// its leftExpander messages as MuseBusMessage, reading
+// leftExpander.consumerMessage in process(), and calling relayMuseBus() so the
+// rest of the chain sees it too.
+
+// Samples of one stream that arrived together, oldest first
+struct MuseBusBlock {
+    static const int MAX_SAMPLES = 64;
+    static const int MAX_CHANNELS = NUM_EEG_CHANNELS;
+
+    uint64_t sequence = 0;
+    int channels = 0;
+    int count = 0;
+    // The stream's nominal rate; timestamps are what the server stamped
+    float sampleRate = 0.f;
+    double timestamps[MAX_SAMPLES] = {};
+    // Microvolts (EEG) or raw PPG, after the module's filters and artifact handling
+    float values[MAX_SAMPLES][MAX_CHANNELS] = {};
+    // Bit c set if channel c failed its quality checks (EEG only)
+    uint8_t flagged[MAX_SAMPLES] = {};
+    // Bit c set if the server left channel c out; it reads 0
+    uint8_t missing[MAX_SAMPLES] = {};
+};
+
+// Every EEG channel's spectrum and the band analysis from one hop
+struct MuseBusSpectrum {
+    uint64_t sequence = 0;
+    int bins = 0;
+    float binHz = 1.f;
+    float magnitude[NUM_EEG_CHANNELS][SpectrumSnapshot::MAX_BINS] = {};
+    // Band powers, coherence and asymmetry, with the hop's source timestamp
+    BandPowers bands;
+};
+
+struct MuseBusPool {
+    // process() adds at most one EEG ring's worth of samples (1024, so 17 blocks)
+    // per frame, so the newest BLOCK_WINDOW blocks are never overwritten while a
+    // consumer reads them in the following frame
+    static const int BLOCKS = 64;
+    static const int BLOCK_WINDOW = 32;
+    // The analysis thread only writes a slot once process() has retired it
+    static const int SPECTRA = 8;
+    static const int SPECTRUM_WINDOW = SPECTRA / 2;
+
+    MuseBusBlock eeg[BLOCKS];
+    MuseBusBlock ppg[BLOCKS];
+    MuseBusSpectrum spectra[SPECTRA];
+
+    // The newest spectrum written by the analysis thread, and the newest that
+    // may be overwritten because no message can still reach it
+    std::atomic<uint64_t> spectraWritten{0};
+    std::atomic<uint64_t> spectraRetired{0};
+
+    // analysisThread: the slot for the next spectrum, or null while every slot
+    // may still be read; that hop is then left off the bus
+    MuseBusSpectrum* beginSpectrum() {
+        uint64_t next = spectraWritten.load(std::memory_order_relaxed) + 1;
+        if (next > spectraRetired.load(std::memory_order_acquire) + SPECTRA) {
+            return nullptr;
+        }
+        MuseBusSpectrum* spectrum = &spectra[next % SPECTRA];
+        spectrum->sequence = next;
+        return spectrum;
+    }
+
+    void publishSpectrum() {
+        spectraWritten.store(spectraWritten.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+// process(): one stream's ring. Samples collect in the block after the newest
+// and flush() publishes it, at the latest at the end of each process().
+struct MuseBusBlockWriter {
+    uint64_t published = 0;
+    MuseBusBlock* open = nullptr;
+
+    void append(MuseBusBlock* blocks, float sampleRate, double timestamp, const float* values, int channels,
+            uint8_t flagged, uint8_t missing) {
+        if (!open) {
+            open = &blocks[(published + 1) % MuseBusPool::BLOCKS];
+            open->sequence = published + 1;
+            open->channels = channels;
+            open->count = 0;
+        }
+        int i = open->count++;
+        open->sampleRate = sampleRate;
+        open->timestamps[i] = timestamp;
+        for (int c = 0; c < channels; c++) {
+            open->values[i][c] = values[c];
+        }
+        open->flagged[i] = flagged;
+        open->missing[i] = missing;
+        if (open->count == MuseBusBlock::MAX_SAMPLES) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (open) {
+            published = open->sequence;
+            open = nullptr;
+        }
+    }
+};
+
+// What travels through the expander. Sequence numbers start at 1; 0 means none yet.
+struct MuseBusMessage {
+    std::shared_ptr<const MuseBusPool> pool;
+    uint64_t eegSequence = 0;
+    uint64_t ppgSequence = 0;
+    uint64_t spectrumSequence = 0;
+    // Source time each stream's outputs on the headband are playing, to line blocks up with its jacks
+    double eegPlayhead = 0.0;
+    double ppgPlayhead = 0.0;
+
+    // A block or spectrum by sequence number, or null if it isn't on the bus (yet, or any more)
+    const MuseBusBlock* eegBlock(uint64_t sequence) const {
+        return pool ? findBlock(pool->eeg, sequence, eegSequence) : nullptr;
+    }
+
+    const MuseBusBlock* ppgBlock(uint64_t sequence) const {
+        return pool ? findBlock(pool->ppg, sequence, ppgSequence) : nullptr;
+    }
+
+    const MuseBusSpectrum* spectrum(uint64_t sequence) const {
+        if (!pool || sequence == 0 || sequence > spectrumSequence ||
+                spectrumSequence - sequence >= (uint64_t) MuseBusPool::SPECTRUM_WINDOW) {
+            return nullptr;
+        }
+        return &pool->spectra[sequence % MuseBusPool::SPECTRA];
+    }
+
+    // Refers to the same data as `other`; the pool is only re-referenced when it changes
+    void assign(const MuseBusMessage& other) {
+        if (pool != other.pool) {
+            pool = other.pool;
+        }
+        eegSequence = other.eegSequence;
+        ppgSequence = other.ppgSequence;
+        spectrumSequence = other.spectrumSequence;
+        eegPlayhead = other.eegPlayhead;
+        ppgPlayhead = other.ppgPlayhead;
+    }
+
+private:
+    static const MuseBusBlock* findBlock(const MuseBusBlock* blocks, uint64_t sequence, uint64_t newest) {
+        if (sequence == 0 || sequence > newest || newest - sequence >= (uint64_t) MuseBusPool::BLOCK_WINDOW) {
+            return nullptr;
+        }
+        return &blocks[sequence % MuseBusPool::BLOCKS];
+    }
+};
+
+// Marks a module that takes the bus from its left neighbour
+struct MuseBusConsumer {
+    virtual ~MuseBusConsumer() {}
+};
+
+inline bool takesMuseBus(rack::engine::Module* module) {
+    return module && dynamic_cast<MuseBusConsumer*>(module);
+}
+
+// The message `right` will receive next frame, or null if it doesn't take the bus
+inline MuseBusMessage* museBusMessageFor(rack::engine::Module* right) {
+    if (!takesMuseBus(right)) return nullptr;
+    return (MuseBusMessage*) right->leftExpander.producerMessage;
+}
+
+// For a module on the bus, from its process(): pass what it received on to its right neighbour
+inline void relayMuseBus(rack::engine::Module* module) {
+    const MuseBusMessage* received = (const MuseBusMessage*) module->leftExpander.consumerMessage;
+    rack::engine::Module* right = module->rightExpander.module;
+    MuseBusMessage* message = museBusMessageFor(right);
+    if (!received || !message) return;
+    message->assign(*received);
+    right->leftExpander.requestMessageFlip();
+}
@@ -1,6 +1,8 @@
 #include "plugin.hpp"
 #include <thread>
+#include <atomic>
 #include <mutex>
+#include <chrono>
 #include <string>
 #include <cstring>
 #include <cstdio>
@@ -13,50 +15,40 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include <jansson.h>
+#include <osdialog.h>
 #include <vector>
 
-#include "WebSocket.hpp"
-
-// Data structures for tracking statistics
-struct ChannelStats {
-    std::vector<float> samples;
-    float max = -std::numeric_limits<float>::infinity();
-    float min = std::numeric_limits<float>::infinity();
-};
-
-// Function to normalize a value
-float normalizeValue(float value, const ChannelStats& stats) {
-    float range = stats.max - stats.min;
-    if (range == 0) return stats.min;
-    float normalized = (value - stats.min) / range;
-    return (normalized - 0.5f) * 10.f;
-}
-
+#include "MuseHub.hpp"
+#include "SampleRing.hpp"
+#include "ChannelStats.hpp"
+#include "BandPower.hpp"
+#include "TripleBuffer.hpp"
+#include "MuseProtocol.hpp"
+#include "MuseJson.hpp"
+#include "JitterBuffer.hpp"
+#include "Metrics.hpp"
+#include "Replay.hpp"
+#include "SessionRecorder.hpp"
+#include "FilterBank.hpp"
+#include "BeatDetector.hpp"
+#include "SignalQuality.hpp"
+#include "MuseBus.hpp"
 
 void printChannelStats(const ChannelStats& stats, float sample) {
     float norm = normalizeValue(sample, stats);
     INFO("Samples: %d, Max: %f, Min: %f, Current: %f, Normalized: %f", 
-        stats.samples.size(), stats.max, stats.min, sample, norm);
-}
-
-// Function to update channel statistics
-void updateChannelStats(ChannelStats& stats, float sample, float sampleRate) {
-    stats.samples.push_back(sample);
-    float secondsToKeep = 1.f;
-    while (stats.samples.size() > sampleRate * secondsToKeep) {
-        stats.samples.erase(stats.samples.begin());
-    }
-    stats.max = -std::numeric_limits<float>::infinity();
-    stats.min = std::numeric_limits<float>::infinity();
-    for (float s : stats.samples) {
-        stats.max = std::max(stats.max, s);
-        stats.min = std::min(stats.min, s);
-    }
+        (int) stats.count, stats.max, stats.min, sample, norm);
 }
 
 struct MuseHeadband : Module {
     enum ParamId {
+        WINDOW_PARAM,
+        LATENCY_PARAM,
         PARAMS_LEN
     };
     enum InputId {
@@ -76,35 +68,293 @@ struct MuseHeadband : Module {
         PPG1_OUTPUT,
         PPG2_OUTPUT,
         PPG3_OUTPUT,
+        STATS_OUTPUT,
+        BEAT_OUTPUT,
+        BPM_OUTPUT,
+        HRV_OUTPUT,
+        QUALITY_OUTPUT,
+        ASYMMETRY_OUTPUT,
+        COHERENCE_OUTPUT,
+        EEG_POLY_OUTPUT,
+        PPG_POLY_OUTPUT,
+        BANDS_POLY_OUTPUT,
         OUTPUTS_LEN
     };
     enum LightId {
+        // Green and red
         CONNECTION_LIGHT,
+        CONNECTION_RED_LIGHT,
+        BEAT_LIGHT,
         LIGHTS_LEN
     };
+    // What to do when samples arrive faster than process() consumes them
+    enum OverflowPolicy {
+        OVERFLOW_DROP_OLDEST,
+        OVERFLOW_CATCH_UP,
+        OVERFLOW_POLICIES_LEN
+    };
+    // Streams with their own filter settings
+    enum FilterStream {
+        FILTER_EEG,
+        FILTER_PPG,
+        FILTER_STREAMS_LEN
+    };
+    // Where samples come from
+    enum Source {
+        SOURCE_SERVER,
+        SOURCE_REPLAY,
+        SOURCES_LEN
+    };
+
+    // Feeds the rings below: drains this module's subscription to the shared
+    // connection for `endpoint` (MuseHub.hpp), or runs replay
+    std::thread sourceThread;
+    std::atomic<bool> connected{false};
+    std::atomic<bool> running{true};
+    // Interrupts sourceThread's waits: the hub signals it after delivering frames,
+    // the UI after changing the source or endpoint
+    easywsclient::Wakeup wakeup;
+    static constexpr const char* DEFAULT_ENDPOINT = "ws://localhost:8765";
+    std::mutex endpointMutex;
+    std::string endpoint = DEFAULT_ENDPOINT; // guarded by endpointMutex
+    // Headband ID from the server's device list, empty for its first one
+    std::string device;                      // guarded by endpointMutex
+    // Set by sourceThread only, read anywhere through getHub()
+    std::shared_ptr<MuseHub> hub;
+    HubSubscription subscription;
+    // What the patch needs from the server, a packed StreamSubscription: worked out
+    // by process() from the connected outputs, passed on to the hub by sourceThread
+    std::atomic<uint32_t> neededStreams{StreamSubscription().pack()};
+    static constexpr float STREAM_CHECK_SECONDS = 0.1f;
+    // Audio thread: time since the outputs were last checked
+    float streamCheckPhase = 0.f;
+    // The hub's newest jitter and parse time, mirrored by sourceThread for STATS_OUTPUT
+    std::atomic<uint64_t> lastArrivalJitter{0};
+    std::atomic<uint64_t> lastParseTime{0};
+
+    // Replay (Replay.hpp) runs on sourceThread in place of the connection, so it feeds
+    // the same rings. The UI posts requests here; sourceThread owns the player.
+    std::atomic<int> source{SOURCE_SERVER};
+    std::mutex replayMutex;
+    std::string replayPath;           // guarded by replayMutex
+    std::string replayStatus;         // guarded by replayMutex: load error, export result, or empty
+    bool replayLoadRequested = false; // guarded by replayMutex
+    std::atomic<bool> replayConvertRequested{false};
+    std::atomic<bool> replayLoop{true};
+    std::atomic<float> replaySpeed{1.f};
+    // Requested scrub position as a fraction of the recording, negative when there is none
+    std::atomic<float> replaySeek{-1.f};
+    // Published by sourceThread
+    std::atomic<bool> replayLoaded{false};
+    std::atomic<float> replayPosition{0.f};
+    std::atomic<float> replayDuration{0.f};
+    static constexpr float MIN_REPLAY_SPEED = 0.1f;
+    static constexpr float MAX_REPLAY_SPEED = 100.f;
+    // Replay at speed x delivers samples x times faster; process() scales the source rates by this
+    std::atomic<float> rateScale{1.f};
+    // Requested export of the loaded recording to CSV, handled by sourceThread like replayConvertRequested
+    std::atomic<bool> replayExportRequested{false};
+
+    // Session recording (SessionRecorder.hpp): sourceThread records frames as they are
+    // received and process() records outputs, both through the recorder's own pages.
+    // Started and stopped from the UI.
+    SessionRecorder recorder;
+    std::atomic<bool> recordOutputs{false};
+    std::string recordStatus; // UI only: last start error, or empty
+    // EEG1 to PPG3; STATS_OUTPUT is not recorded
+    static const int RECORDED_OUTPUTS = PPG3_OUTPUT + 1;
+    // Audio thread: samples of the EEG rate since outputs were last recorded
+    float outputRecordPhase = 0.f;
+
+    // Per-stream arrival log, used only by sourceThread
+    struct StreamCounter {
+        const char* name;
+        double lastTimestamp = 0.0;
+        int currentSecond = 0;
+        int samplesThisSecond = 0;
+
+        explicit StreamCounter(const char* name) : name(name) {}
+
+        void count(double ts) {
+            if (ts <= lastTimestamp) {
+                WARN("Received out-of-order %s timestamp: %f -> %f", name, lastTimestamp, ts);
+            }
+            lastTimestamp = ts;
+            int thisSecond = (int)ts;
+            if (currentSecond != thisSecond) {
+                INFO("Received %d %s samples in the last second", samplesThisSecond, name);
+                currentSecond = thisSecond;
+                samplesThisSecond = 0;
+            }
+            samplesThisSecond++;
+        }
+    };
+    StreamCounter eegCounter{"EEG"};
+    StreamCounter ppgCounter{"PPG"};
+
+    // Samples handed from sourceThread (producer) to process() (consumer). EEG and
+    // PPG each keep their own queue, at their own rate, until the output stage.
+    SpscRing<MuseFrame, 1024> eegRing;
+    SpscRing<MuseFrame, 256> ppgRing;
+    std::atomic<int> overflowPolicy{OVERFLOW_DROP_OLDEST};
+    std::atomic<uint64_t> droppedFrames{0};
+    // With OVERFLOW_CATCH_UP, a backlog above CATCH_UP_THRESHOLD frames is skipped down to
+    // CATCH_UP_TARGET. Both are counted at the EEG rate and scaled for PPG.
+    static const size_t CATCH_UP_THRESHOLD = 64;
+    static const size_t CATCH_UP_TARGET = 8;
+    // Longest normalization window; ChannelStats buffers are sized for this up front
+    static constexpr float MAX_WINDOW_SECONDS = 30.f;
 
-    std::unique_ptr<easywsclient::WebSocket> ws;
-    std::thread wsThread;
-    std::mutex dataMutex;
-    bool connected = false;
-    bool running = true;
+    // Notch and bandpass (FilterBank.hpp), run by sourceThread on each frame once it has
+    // been recorded, so everything downstream, band powers included, sees filtered samples
+    std::mutex filterConfigMutex;
+    FilterConfig filterConfig[FILTER_STREAMS_LEN]; // guarded by filterConfigMutex
+    std::atomic<bool> filterConfigChanged{true};
+    // sourceThread only
+    FilterBank<NUM_EEG_CHANNELS> eegFilter;
+    FilterBank<NUM_PPG_CHANNELS> ppgFilter;
+    float ppgFilterRate = 0.f;
+    double lastEegFilterTime = 0.0;
+    double lastPpgFilterTime = 0.0;
+    // Published for the context menu
+    std::atomic<float> firDelay{0.f};
+
+    // EEG quality checks, run by sourceThread on each frame before it is filtered. Flagged
+    // samples are marked in MuseFrame::eegFlagged and handled per artifactHandling.
+    std::atomic<int> artifactHandling{ARTIFACTS_FLAG};
+    std::atomic<float> artifactLevel{200.f};
+    // Share of clean samples per channel, for QUALITY_OUTPUT and the context menu
+    std::atomic<float> eegQualityLevel[NUM_EEG_CHANNELS];
+    // sourceThread only
+    ChannelQuality eegQuality[NUM_EEG_CHANNELS];
+    // Last clean filtered sample per channel, held for band powers with ARTIFACTS_HOLD_OUT
+    float heldEeg[NUM_EEG_CHANNELS] = {};
+
+    // Band powers: sourceThread -> analysisThread -> process()
+    SpscRing<MuseFrame, 1024> analysisRing;
+    std::thread analysisThread;
+    // Signalled by pushFrame() for every frame in analysisRing, and on config changes
+    easywsclient::Wakeup analysisWakeup;
+    // Bounds a missed wakeup, and paces the stats dump while no frames arrive
+    static const int ANALYSIS_WAIT_MS = 100;
+    std::mutex bandConfigMutex;
+    BandConfig bandConfig; // guarded by bandConfigMutex
+    std::atomic<bool> bandConfigChanged{true};
+    TripleBuffer<BandPowers> bandBuffer;
+    // Seconds from arrival of the newest sample in a window to its band output
+    std::atomic<float> bandLatency{0.f};
+    // Band outputs average TP9, AF7, AF8 and TP10; the aux channel is usually unconnected
+    static const int NUM_BAND_CHANNELS = 4;
+    // Which channel pair COHERENCE_OUTPUT follows, as a crossPairIndex()
+    std::atomic<int> coherencePair{crossPairIndex(0, 3)};
+    // ASYMMETRY_OUTPUT volts per unit of ln(AF8 alpha) - ln(AF7 alpha)
+    static constexpr float ASYMMETRY_VOLTS = 5.f;
+    // The panel display's feed: analysisThread -> UI thread. It is only filled while the
+    // display has drawn within the last DISPLAY_WANTED_SECONDS (steadyTime() in displayWantedUntil).
+    TripleBuffer<SpectrumSnapshot> spectrumBuffer;
+    std::atomic<double> displayWantedUntil{0.0};
+    std::atomic<int> displayChannel{0};
+    static constexpr double DISPLAY_WANTED_SECONDS = 0.5;
+
+    // The expander bus (MuseBus.hpp) to the module on the right, when it takes it.
+    // busConsumer is set by onExpanderChange() and only used by process(), which
+    // writes the sample blocks; analysisThread writes spectra while busAttached.
+    std::shared_ptr<MuseBusPool> busPool = std::make_shared<MuseBusPool>();
+    Module* busConsumer = nullptr;
+    std::atomic<bool> busAttached{false};
+    MuseBusBlockWriter busEeg;
+    MuseBusBlockWriter busPpg;
+    uint64_t busSpectrumNewest = 0; // process() only
 
     // EEG data
-    std::vector<std::vector<float>> eeg_samples;
-    std::vector<std::vector<float>> ppg_samples;
     std::vector<ChannelStats> eegStats;
     std::vector<ChannelStats> ppgStats;
+    std::atomic<int> normalizationMode{NORMALIZE_MIN_MAX};
+    // Normalization state saved with the patch, EEG channels then PPG, so outputs
+    // start warm. process() copies its stats here every STATS_SAVE_SECONDS and
+    // restores them after dataFromJson() sets statsStateLoaded; it only ever
+    // try_locks, and retries on the next call if the lock is busy.
+    static const int NUM_STATS_CHANNELS = NUM_EEG_CHANNELS + NUM_PPG_CHANNELS;
+    static constexpr float STATS_SAVE_SECONDS = 1.f;
+    std::mutex statsStateMutex;
+    ChannelStats::State statsState[NUM_STATS_CHANNELS]; // guarded by statsStateMutex
+    bool statsStateValid[NUM_STATS_CHANNELS] = {};      // guarded by statsStateMutex
+    std::atomic<bool> statsStateLoaded{false};
+    float statsSavePhase = 0.f; // process() only
     int sample_rate = 256;
-    float sample_time = 0.f; // Accumulator for sample timing
+    // PPG's native rate. Set by sourceThread from the hub or the recording: servers
+    // that collate PPG onto every EEG sample deliver it at sample_rate instead.
+    static const int PPG_SAMPLE_RATE = MuseHub::PPG_SAMPLE_RATE;
+    std::atomic<float> ppgSampleRate{(float) PPG_SAMPLE_RATE};
 
-    float last_sample_time = 0.f;
+    // Heartbeats in one PPG channel (BeatDetector.hpp), detected in process() as frames
+    // arrive and held until the PPG playhead reaches them, so the trigger lines up with
+    // the PPG outputs. process() only, apart from beatChannel.
+    struct PendingBeat {
+        double time;
+        float bpm;
+        float rmssd;
+    };
+    static const int MAX_PENDING_BEATS = 8;
+    // Beats further behind the playhead than this, e.g. across a restart, are dropped
+    static constexpr double MAX_BEAT_LAG = 0.25;
+    static constexpr float BPM_PER_VOLT = 20.f;
+    static constexpr float HRV_MS_PER_VOLT = 10.f;
+    std::atomic<int> beatChannel{0};
+    int beatDetectorChannel = 0;
+    BeatDetector beatDetector;
+    PendingBeat pendingBeats[MAX_PENDING_BEATS];
+    int pendingBeatCount = 0;
+    dsp::PulseGenerator beatTrigger;
+    dsp::PulseGenerator beatLightPulse;
+    float heartBpm = 0.f;
+    float heartRmssd = 0.f;
+    // Published for the context menu
+    std::atomic<float> displayBpm{0.f};
+
+    // Schedule samples by source timestamp and resample them to the engine rate
+    JitterBuffer<NUM_EEG_CHANNELS> eegJitter;
+    JitterBuffer<NUM_PPG_CHANNELS> ppgJitter;
+    // Published for the context menu
+    std::atomic<float> outputLatency{0.f};
+    std::atomic<float> ppgLatency{0.f};
+    std::atomic<uint64_t> outputUnderruns{0};
+    std::atomic<uint64_t> outputResyncs{0};
+
+    // Hot-path instrumentation, read by the stats menu, STATS_OUTPUT and the stats dump.
+    // Each histogram is written by the thread noted; arrival jitter, parse time and
+    // message counts belong to the hub, and are shared with every module on it.
+    Histogram queueDepth;      // process(): EEG frames waiting when the ring is drained
+    Histogram endToEndLatency; // process(): arrival to output through the jitter buffer, us
+    // Periodically write the above to statsPath(), from analysisThread
+    std::atomic<bool> statsDump{false};
+    static constexpr double STATS_DUMP_SECONDS = 1.0;
 
     MuseHeadband() {
         config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
 
+        configParam(WINDOW_PARAM, 0.25f, MAX_WINDOW_SECONDS, 1.f, "Normalization window", " s");
+        configParam(LATENCY_PARAM, 0.02f, 1.f, 0.2f, "Target latency", " ms", 0.f, 1000.f);
+        eegJitter.setSourceRate(sample_rate);
+        ppgJitter.setSourceRate(PPG_SAMPLE_RATE);
+
+        // The server's own filters, for when it ships raw samples; PPG has no mains to notch
+        filterConfig[FILTER_PPG].high = 10.f;
+
+        for (int i = 0; i < NUM_EEG_CHANNELS; i++) {
+            eegQuality[i].setSampleRate(sample_rate);
+            eegQualityLevel[i] = 1.f;
+        }
+
         // Initialize eegStats and ppgStats
-        eegStats.resize(5); // 5 EEG channels
-        ppgStats.resize(3); // 3 PPG channels
+        eegStats.resize(NUM_EEG_CHANNELS);
+        ppgStats.resize(NUM_PPG_CHANNELS);
+        for (ChannelStats& stats : eegStats) {
+            stats.allocate(sample_rate * MAX_WINDOW_SECONDS);
+        }
+        for (ChannelStats& stats : ppgStats) {
+            stats.allocate(sample_rate * MAX_WINDOW_SECONDS);
+        }
 
         // Configure outputs
         configOutput(EEG1_OUTPUT, "EEG Channel 1");
@@ -120,166 +370,1323 @@ struct MuseHeadband : Module {
         configOutput(PPG1_OUTPUT, "PPG Channel 1");
         configOutput(PPG2_OUTPUT, "PPG Channel 2");
         configOutput(PPG3_OUTPUT, "PPG Channel 3");
+        configOutput(STATS_OUTPUT, "Stats (poly: latency 10 ms/V, jitter 1 ms/V, parse 100 us/V, queue 10 frames/V)");
+        configOutput(BEAT_OUTPUT, "Heartbeat trigger");
+        configOutput(BPM_OUTPUT, "Heart rate (20 BPM/V)");
+        configOutput(HRV_OUTPUT, "Heart rate variability (RMSSD, 10 ms/V)");
+        configOutput(QUALITY_OUTPUT, "EEG signal quality (poly: share of clean samples, 10 V = all)");
+        configOutput(ASYMMETRY_OUTPUT, "Frontal alpha asymmetry (ln AF8 - ln AF7, 5 V per unit)");
+        configOutput(COHERENCE_OUTPUT, "Band coherence (poly: delta to gamma, 10 V = 1)");
+        configOutput(EEG_POLY_OUTPUT, "EEG (poly: channels 1-5)");
+        configOutput(PPG_POLY_OUTPUT, "PPG (poly: channels 1-3)");
+        configOutput(BANDS_POLY_OUTPUT, "Brainwaves (poly: delta to gamma)");
         INFO("MuseHeadband loaded");
 
-        // Start WebSocket connection thread
-        wsThread = std::thread([this]() {
-            int currentSecond = 0;
-            int samplesThisSecond = 0;
-            float lastTimestamp = 0.0f;
+        // Start the source thread
+        subscription.wakeup = &wakeup;
+        sourceThread = std::thread([this]() {
+            ReplayPlayer player;
+            double lastReplayStep = 0.0;
             while (running) {
-                if (!ws || ws->getReadyState() != easywsclient::OPEN) {
-                    ws.reset(easywsclient::WebSocket::create_connection("ws://localhost:8765"));
-                    connected = (ws != nullptr);
-                    if (connected) {
-                        INFO("Connected to Muse Headband server");
-                    } else {
-                        WARN("Failed to connect to Muse Headband server");
+                // The UI signals after changing the source or posting a replay request
+                wakeup.clear();
+                if (!running) break;
+
+                if (source == SOURCE_REPLAY) {
+                    setHub(nullptr);
+                    int waitMs = serviceReplay(player, lastReplayStep);
+                    wakeup.wait(waitMs);
+                    continue;
+                }
+                lastReplayStep = 0.0;
+                rateScale = 1.f;
+
+                std::string url = getHubUrl();
+                if (!hub || hub->url != url) {
+                    setHub(MuseHub::acquire(url));
+                }
+                uint32_t streams = neededStreams;
+                if (subscription.streams.exchange(streams) != streams) {
+                    hub->updateSubscription();
+                }
+                MuseFrame frame;
+                while (subscription.frames.pop(frame)) {
+                    pushFrame(frame);
+                }
+                connected = hub->connected.load();
+                ppgSampleRate = hub->ppgSampleRate.load();
+                lastArrivalJitter = hub->arrivalJitter.last.load(std::memory_order_relaxed);
+                lastParseTime = hub->parseTime.last.load(std::memory_order_relaxed);
+
+                // The hub signals after every batch; the timeout only bounds a missed wakeup
+                wakeup.wait(1000);
+            }
+            setHub(nullptr);
+        });
+
+        // Band powers are computed here, off the audio thread
+        analysisThread = std::thread([this]() {
+            BandPowerEngine engine;
+            MuseFrame frame;
+            double nextDump = 0.0;
+            while (running) {
+                analysisWakeup.clear();
+                if (statsDump) {
+                    double now = steadyTime();
+                    if (now >= nextDump) {
+                        writeStats();
+                        nextDump = now + STATS_DUMP_SECONDS;
                     }
                 }
-                
-                if (connected) {
-                    char buffer[2048];
-                    size_t bytesRead;
-                    if (ws->receive(buffer, sizeof(buffer), &bytesRead)) {
-                        buffer[bytesRead] = '\0';
-                        std::string message(buffer, bytesRead);
-                        
-                        // Check if we have a complete JSON message
-                        if (!message.empty() && 
-                            message[0] == '{' && 
-                            message[message.length()-1] == '}') {
-                            float ts = parseMuseData(message.c_str());
-                            if (ts <= lastTimestamp) {
-                                WARN("Received out-of-order timestamp: %f -> %f", lastTimestamp, ts);
-                            }
-                            lastTimestamp = ts;
-                            int thisSecond = (int)ts;
-                            if (currentSecond != thisSecond) {
-                                INFO("Received %d samples in the last second", samplesThisSecond);
-                                currentSecond = thisSecond;
-                                samplesThisSecond = 0;
-                            }
-                            samplesThisSecond++;
-                        } else {
-                            WARN("Invalid JSON message: %s", message.c_str());
+                if (bandConfigChanged.exchange(false)) {
+                    std::lock_guard<std::mutex> lock(bandConfigMutex);
+                    engine.configure(bandConfig, sample_rate);
+                }
+                bool gotFrames = false;
+                while (analysisRing.pop(frame)) {
+                    gotFrames = true;
+                    if (engine.process(frame, bandBuffer.writeBuffer())) {
+                        if (steadyTime() < displayWantedUntil) {
+                            publishSpectrum(engine, bandBuffer.writeBuffer().hop);
                         }
-                    } else {
-                        WARN("Failed to receive message from Muse Headband server");
+                        if (busAttached) {
+                            publishBusSpectrum(engine, bandBuffer.writeBuffer());
+                        }
+                        bandBuffer.publish();
                     }
+                }
+                if (!gotFrames) {
+                    analysisWakeup.wait(ANALYSIS_WAIT_MS);
+                }
+            }
+        });
+    }
+
+    // analysisThread: the display channel's spectrum and scope, for the panel display
+    void publishSpectrum(BandPowerEngine& engine, uint64_t hop) {
+        SpectrumSnapshot& snapshot = spectrumBuffer.writeBuffer();
+        int channel = displayChannel;
+        snapshot.channel = channel;
+        snapshot.bins = engine.spectrum(channel, snapshot.magnitude, SpectrumSnapshot::MAX_BINS);
+        snapshot.binHz = engine.binHz();
+        snapshot.scopeSamples = engine.recentSamples(channel, snapshot.scope, SpectrumSnapshot::SCOPE_SAMPLES);
+        snapshot.hop = hop;
+        spectrumBuffer.publish();
+    }
+
+    // analysisThread: every channel's spectrum for the expander bus, unless no slot is free
+    void publishBusSpectrum(BandPowerEngine& engine, const BandPowers& bands) {
+        MuseBusSpectrum* spectrum = busPool->beginSpectrum();
+        if (!spectrum) return;
+        for (int c = 0; c < NUM_EEG_CHANNELS; c++) {
+            spectrum->bins = engine.spectrum(c, spectrum->magnitude[c], SpectrumSnapshot::MAX_BINS);
+        }
+        spectrum->binHz = engine.binHz();
+        spectrum->bands = bands;
+        busPool->publishSpectrum();
+    }
+
+    void onExpanderChange(const ExpanderChangeEvent& e) override {
+        busConsumer = takesMuseBus(rightExpander.module) ? rightExpander.module : nullptr;
+        busAttached = busConsumer != nullptr;
+    }
+
+    // process(): hand the module on the right everything published up to now
+    void sendBus() {
+        busEeg.flush();
+        busPpg.flush();
+        MuseBusMessage* message = museBusMessageFor(busConsumer);
+        if (!message) return;
+        // A spectrum slot is free for analysisThread once no message can reach it
+        // any more, and the message sent last frame is being read now
+        if (busSpectrumNewest > (uint64_t) MuseBusPool::SPECTRUM_WINDOW) {
+            busPool->spectraRetired.store(busSpectrumNewest - MuseBusPool::SPECTRUM_WINDOW, std::memory_order_release);
+        }
+        busSpectrumNewest = busPool->spectraWritten.load(std::memory_order_acquire);
+        if (message->pool != busPool) {
+            message->pool = busPool;
+        }
+        message->eegSequence = busEeg.published;
+        message->ppgSequence = busPpg.published;
+        message->spectrumSequence = busSpectrumNewest;
+        message->eegPlayhead = eegJitter.playheadTime();
+        message->ppgPlayhead = ppgJitter.playheadTime();
+        busConsumer->leftExpander.requestMessageFlip();
+    }
+
+    // One step of replay on sourceThread: apply UI requests, push every sample now
+    // due, and return how long to sleep before the next one.
+    int serviceReplay(ReplayPlayer& player, double& lastStep) {
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(replayMutex);
+            if (replayLoadRequested) {
+                path = replayPath;
+                replayLoadRequested = false;
+            }
+        }
+        if (!path.empty()) {
+            std::unique_ptr<Recording> recording(new Recording);
+            std::string error;
+            if (recording->open(path, error)) {
+                INFO("Replaying %s: %.1f s, %zu EEG and %zu PPG samples", path.c_str(),
+                    recording->duration(), recording->eeg.count, recording->ppg.count);
+                double ppgRate = recording->ppg.sampleRate();
+                if (ppgRate > 0.0) {
+                    ppgSampleRate = ppgRate;
+                }
+                player.load(std::move(recording));
+            } else {
+                WARN("%s", error.c_str());
+            }
+            std::lock_guard<std::mutex> lock(replayMutex);
+            replayStatus = error;
+        }
+
+        if (player.loaded()) {
+            const Recording& recording = player.getRecording();
+            float seek = replaySeek.exchange(-1.f);
+            if (seek >= 0.f) {
+                player.seek(recording.start() + seek * recording.duration());
+            }
+            // CSV converts to binary, anything else exports to CSV, next to the original
+            bool convert = replayConvertRequested.exchange(false) && recording.fromCsv();
+            bool exportCsvRequested = replayExportRequested.exchange(false) && !recording.fromCsv();
+            if (convert || exportCsvRequested) {
+                std::string sourcePath, error;
+                {
+                    std::lock_guard<std::mutex> lock(replayMutex);
+                    sourcePath = replayPath;
+                }
+                // Numbered rather than written over an existing file, such as the CSV a recording came from
+                std::string targetPath = unusedPath(system::join(system::getDirectory(sourcePath),
+                    system::getStem(sourcePath)), convert ? RECORDING_EXTENSION : ".csv");
+                bool ok = false;
+                if (targetPath.empty()) {
+                    error = "No free name to export " + sourcePath + " to";
+                } else {
+                    ok = convert ? writeRecording(targetPath, recording, error) : exportCsv(targetPath, recording, error);
+                }
+                if (ok) {
+                    INFO("Wrote %s", targetPath.c_str());
                 } else {
-                    WARN("Not connected to Muse Headband server");
+                    WARN("%s", error.c_str());
                 }
-                
+                std::lock_guard<std::mutex> lock(replayMutex);
+                replayStatus = ok ? "Wrote " + system::getFilename(targetPath) : error;
             }
+        }
+        player.loop = replayLoop;
+        float speed = clamp(replaySpeed.load(), MIN_REPLAY_SPEED, MAX_REPLAY_SPEED);
+        player.setSpeed(speed);
+        rateScale = speed;
+
+        // Long stalls are skipped rather than replayed in one burst
+        double now = steadyTime();
+        double elapsed = lastStep > 0.0 ? std::min(now - lastStep, 0.1) : 0.0;
+        lastStep = now;
+        player.advance(elapsed, [&](const MuseFrame& frame) {
+            MuseFrame replayed = frame;
+            replayed.arrivalTime = now;
+            pushFrame(replayed);
         });
+        replayLoaded = player.loaded();
+        replayPosition = player.elapsed();
+        replayDuration = player.loaded() ? player.getRecording().duration() : 0.0;
+
+        double untilNext = player.untilNext();
+        if (untilNext < 0.0) {
+            return 100;
+        }
+        // Batch at least a couple of milliseconds of samples per wakeup
+        return clamp((int) std::ceil(untilNext * 1000.0), 2, 20);
     }
 
-    float parseMuseData(const char* jsonStr) {
-        json_error_t error;
-        json_t* root = json_loads(jsonStr, 0, &error);
-        
-        if (!root) {
-            WARN("Failed to parse JSON: %s", error.text);
-            return 0.0f;
+    void requestReplay(const std::string& path) {
+        std::lock_guard<std::mutex> lock(replayMutex);
+        replayPath = path;
+        replayLoadRequested = true;
+        replayStatus.clear();
+        wakeup.signal();
+    }
+
+    void setSource(int newSource) {
+        source = newSource;
+        wakeup.signal();
+    }
+
+    std::string getEndpoint() {
+        std::lock_guard<std::mutex> lock(endpointMutex);
+        return endpoint;
+    }
+
+    void setEndpoint(const std::string& url) {
+        {
+            std::lock_guard<std::mutex> lock(endpointMutex);
+            endpoint = url;
         }
+        wakeup.signal();
+    }
 
-        json_t* timestamp = json_object_get(root, "timestamp");
-        if (!json_is_number(timestamp)) {
-            WARN("Invalid timestamp in JSON");
-            return 0.0f;
+    std::string getDevice() {
+        std::lock_guard<std::mutex> lock(endpointMutex);
+        return device;
+    }
+
+    void setDevice(const std::string& id) {
+        {
+            std::lock_guard<std::mutex> lock(endpointMutex);
+            device = id;
         }
-        float timestamp_value = json_number_value(timestamp);
-        // INFO("timestamp: %f", timestamp_value);
+        wakeup.signal();
+    }
+
+    std::string getHubUrl() {
+        std::lock_guard<std::mutex> lock(endpointMutex);
+        return MuseHub::deviceUrl(endpoint, device);
+    }
+
+    // The connection this module is subscribed to, if any. Not for the audio thread.
+    std::shared_ptr<MuseHub> getHub() {
+        return std::atomic_load(&hub);
+    }
 
-        json_t* eeg_channels = json_object_get(root, "eeg_channels");
-        if (!json_is_array(eeg_channels)) {
-            WARN("No EEG channels found in JSON");
-            return timestamp_value;
+    // Move this module's subscription to `newHub`, on sourceThread only. Releasing
+    // the last reference to a hub closes its connection.
+    void setHub(std::shared_ptr<MuseHub> newHub) {
+        if (hub == newHub) return;
+        if (hub) {
+            hub->unsubscribe(&subscription);
+        }
+        subscription.frames.discard(subscription.frames.size());
+        if (newHub) {
+            newHub->subscribe(&subscription);
+        }
+        std::atomic_store(&hub, newHub);
+        connected = newHub && newHub->connected;
+    }
+
+    static std::string recordingDirectory() {
+        return asset::user("MuseHeadband");
+    }
+
+    // Start a new session log named after the current time
+    void startRecording() {
+        std::string dir = recordingDirectory();
+        system::createDirectories(dir);
+        char name[64];
+        time_t now = time(nullptr);
+        strftime(name, sizeof(name), "session-%Y%m%d-%H%M%S", localtime(&now));
+        std::string path = system::join(dir, name + std::string(SESSION_EXTENSION));
+        recordStatus.clear();
+        if (recorder.start(path, NUM_EEG_CHANNELS, NUM_PPG_CHANNELS, RECORDED_OUTPUTS, recordStatus)) {
+            INFO("Recording to %s", path.c_str());
+        } else {
+            WARN("%s", recordStatus.c_str());
+        }
+    }
+
+    void stopRecording() {
+        recorder.stop();
+        INFO("Recorded %llu samples to %s, %llu dropped", (unsigned long long) recorder.recordsWritten.load(),
+            recorder.path().c_str(), (unsigned long long) recorder.droppedRecords.load());
+        if (recorder.writeFailed) {
+            recordStatus = "Failed writing " + recorder.path();
+            WARN("%s", recordStatus.c_str());
+        }
+    }
+
+    BandConfig getBandConfig() {
+        std::lock_guard<std::mutex> lock(bandConfigMutex);
+        return bandConfig;
+    }
+
+    void setBandConfig(const BandConfig& config) {
+        std::lock_guard<std::mutex> lock(bandConfigMutex);
+        bandConfig = config;
+        bandConfigChanged = true;
+        analysisWakeup.signal();
+    }
+
+    FilterConfig getFilterConfig(int stream) {
+        std::lock_guard<std::mutex> lock(filterConfigMutex);
+        return filterConfig[stream];
+    }
+
+    void setFilterConfig(int stream, const FilterConfig& config) {
+        std::lock_guard<std::mutex> lock(filterConfigMutex);
+        filterConfig[stream] = config;
+        filterConfigChanged = true;
+    }
+
+    // sourceThread: filter a frame in place, redesigning the filters after a settings or PPG rate change
+    void filterFrame(MuseFrame& frame) {
+        float ppgRate = ppgSampleRate;
+        if (filterConfigChanged.exchange(false) || ppgRate != ppgFilterRate) {
+            std::lock_guard<std::mutex> lock(filterConfigMutex);
+            eegFilter.configure(filterConfig[FILTER_EEG], sample_rate);
+            ppgFilter.configure(filterConfig[FILTER_PPG], ppgRate);
+            ppgFilterRate = ppgRate;
+            firDelay = eegFilter.firDelay();
+        }
+        // A clock that jumps back is a new stream (a looped replay, a restarted server): start the filters afresh
+        if (frame.hasEeg && eegFilter.enabled()) {
+            if (frame.timestamp < lastEegFilterTime) {
+                eegFilter.reset();
+            }
+            lastEegFilterTime = frame.timestamp;
+            eegFilter.process(frame.eeg);
         }
-        size_t num_eeg_channels = json_array_size(eeg_channels);
-        std::vector<float> eeg_channel_values;
-        for (size_t i = 0; i < num_eeg_channels; i++) {
-            json_t* value = json_array_get(eeg_channels, i);
-            if (!json_is_number(value)) {
-                WARN("Invalid EEG sample value");
-                return timestamp_value;
+        if (frame.hasPpg && ppgFilter.enabled()) {
+            if (frame.timestamp < lastPpgFilterTime) {
+                ppgFilter.reset();
             }
-            eeg_channel_values.push_back(json_number_value(value));
+            lastPpgFilterTime = frame.timestamp;
+            ppgFilter.process(frame.ppg);
         }
-        // INFO("Received EEG sample: %f, %f, %f, %f, %f", 
-        //    eeg_channel_values[0], eeg_channel_values[1], eeg_channel_values[2], eeg_channel_values[3], eeg_channel_values[4]);
-        eeg_samples.push_back(std::move(eeg_channel_values));
+    }
+
+    // Flag the EEG samples that fail ChannelQuality's checks; with ARTIFACTS_GATE, replace them
+    void checkQuality(MuseFrame& frame, int handling) {
+        float level = artifactLevel;
+        frame.eegFlagged = 0;
+        for (int i = 0; i < NUM_EEG_CHANNELS; i++) {
+            if (frame.eegMissing & (1 << i)) continue;
+            ChannelQuality& quality = eegQuality[i];
+            if (quality.process(frame.eeg[i], level)) {
+                frame.eegFlagged |= 1 << i;
+                if (handling == ARTIFACTS_GATE) {
+                    frame.eeg[i] = quality.lastClean;
+                }
+            }
+            eegQualityLevel[i].store(quality.quality, std::memory_order_relaxed);
+        }
+    }
 
-        json_t* ppg_channels = json_object_get(root, "ppg_channels");
-        if (!json_is_array(ppg_channels)) {
-            WARN("No PPG channels found in JSON");
-            return timestamp_value;
+    // Producer side: hand a decoded frame to process() according to overflowPolicy
+    void pushFrame(const MuseFrame& received) {
+        if (recorder.recording()) {
+            if (received.hasEeg) {
+                recorder.record(SessionRecorder::LANE_INPUT, RECORD_EEG, received.timestamp, received.eeg, NUM_EEG_CHANNELS);
+            }
+            if (received.hasPpg) {
+                recorder.record(SessionRecorder::LANE_INPUT, RECORD_PPG, received.timestamp, received.ppg, NUM_PPG_CHANNELS);
+            }
+        }
+        MuseFrame frame = received;
+        int handling = artifactHandling;
+        if (frame.hasEeg) {
+            checkQuality(frame, handling);
+        }
+        filterFrame(frame);
+        if (frame.hasEeg) {
+            eegCounter.count(frame.timestamp);
+            // The band engine always wants the newest data
+            if (handling == ARTIFACTS_HOLD_OUT) {
+                MuseFrame held = frame;
+                for (int i = 0; i < NUM_EEG_CHANNELS; i++) {
+                    if (frame.eegFlagged & (1 << i)) {
+                        held.eeg[i] = heldEeg[i];
+                    } else {
+                        heldEeg[i] = frame.eeg[i];
+                    }
+                }
+                analysisRing.pushOverwrite(held);
+            } else {
+                analysisRing.pushOverwrite(frame);
+            }
+            analysisWakeup.signal();
+            pushWithPolicy(eegRing, frame);
+        }
+        if (frame.hasPpg) {
+            ppgCounter.count(frame.timestamp);
+            pushWithPolicy(ppgRing, frame);
         }
-        size_t num_ppg_channels = json_array_size(ppg_channels);
-        std::vector<float> ppg_channel_values;
-        for (size_t i = 0; i < num_ppg_channels; i++) {
-            json_t* value = json_array_get(ppg_channels, i);
-            if (!json_is_number(value)) {
-                WARN("Invalid PPG sample value");
-                return timestamp_value;
+    }
+
+    template <size_t CAPACITY>
+    void pushWithPolicy(SpscRing<MuseFrame, CAPACITY>& ring, const MuseFrame& frame) {
+        if (overflowPolicy == OVERFLOW_DROP_OLDEST) {
+            if (ring.pushOverwrite(frame)) {
+                droppedFrames++;
             }
-            ppg_channel_values.push_back(json_number_value(value));
+        } else if (!ring.push(frame)) {
+            droppedFrames++;
         }
-        //INFO("Received PPG sample: %f, %f, %f", 
-        //    ppg_channel_values[0], ppg_channel_values[1], ppg_channel_values[2]);
-        ppg_samples.push_back(std::move(ppg_channel_values));
-        return timestamp_value;
     }
 
+    // Consumer side of OVERFLOW_CATCH_UP, for a ring filled at `rate`
+    template <size_t CAPACITY>
+    void catchUp(SpscRing<MuseFrame, CAPACITY>& ring, float rate) {
+        float scale = rate / sample_rate;
+        size_t threshold = CATCH_UP_THRESHOLD * scale;
+        size_t target = CATCH_UP_TARGET * scale;
+        size_t backlog = ring.size();
+        if (backlog > threshold) {
+            droppedFrames += ring.discard(backlog - target);
+        }
+    }
 
     ~MuseHeadband() {
         running = false;
-        if (wsThread.joinable()) {
-            wsThread.join();
+        wakeup.signal();
+        analysisWakeup.signal();
+        if (sourceThread.joinable()) {
+            sourceThread.join();
         }
-        if (ws) {
-            ws->close();
+        if (analysisThread.joinable()) {
+            analysisThread.join();
         }
     }
-    void process(const ProcessArgs& args) override {
-        // Update connected status based on WebSocket state
-        connected = (ws && ws->getReadyState() == easywsclient::OPEN);
+    json_t* dataToJson() override {
+        json_t* rootJ = json_object();
+        json_object_set_new(rootJ, "overflowPolicy", json_integer(overflowPolicy));
+        json_object_set_new(rootJ, "statsDump", json_boolean(statsDump));
+        json_object_set_new(rootJ, "recordOutputs", json_boolean(recordOutputs));
 
-        lights[CONNECTION_LIGHT].setBrightness(connected ? 1.f : 0.f);
+        json_object_set_new(rootJ, "endpoint", json_string(getEndpoint().c_str()));
+        json_object_set_new(rootJ, "device", json_string(getDevice().c_str()));
+        json_object_set_new(rootJ, "source", json_integer(source));
+        {
+            std::lock_guard<std::mutex> lock(replayMutex);
+            json_object_set_new(rootJ, "replayPath", json_string(replayPath.c_str()));
+        }
+        json_object_set_new(rootJ, "replayLoop", json_boolean(replayLoop));
+        json_object_set_new(rootJ, "replaySpeed", json_real(replaySpeed));
+
+        json_t* filtersJ = json_array();
+        for (int stream = 0; stream < FILTER_STREAMS_LEN; stream++) {
+            FilterConfig filter = getFilterConfig(stream);
+            json_t* filterJ = json_object();
+            json_object_set_new(filterJ, "notch", json_integer(filter.notch));
+            json_object_set_new(filterJ, "bandpass", json_integer(filter.bandpass));
+            json_object_set_new(filterJ, "low", json_real(filter.low));
+            json_object_set_new(filterJ, "high", json_real(filter.high));
+            json_object_set_new(filterJ, "firTaps", json_integer(filter.firTaps));
+            json_array_append_new(filtersJ, filterJ);
+        }
+        json_object_set_new(rootJ, "filters", filtersJ);
+
+        BandConfig config = getBandConfig();
+        json_object_set_new(rootJ, "bandReduction", json_integer(config.reduction));
+        json_object_set_new(rootJ, "bandHop", json_integer(config.hopSize));
+        json_object_set_new(rootJ, "crossSeconds", json_real(config.crossSeconds));
+        json_t* bandsJ = json_array();
+        for (int b = 0; b < NUM_BANDS; b++) {
+            json_t* bandJ = json_array();
+            json_array_append_new(bandJ, json_real(config.low[b]));
+            json_array_append_new(bandJ, json_real(config.high[b]));
+            json_array_append_new(bandsJ, bandJ);
+        }
+        json_object_set_new(rootJ, "bands", bandsJ);
+
+        json_object_set_new(rootJ, "beatChannel", json_integer(beatChannel));
+        json_object_set_new(rootJ, "displayChannel", json_integer(displayChannel));
+        json_object_set_new(rootJ, "coherencePair", json_integer(coherencePair));
+        json_object_set_new(rootJ, "artifactHandling", json_integer(artifactHandling));
+        json_object_set_new(rootJ, "artifactLevel", json_real(artifactLevel));
+        json_object_set_new(rootJ, "normalization", json_integer(normalizationMode));
+        json_t* statsJ = json_array();
+        {
+            std::lock_guard<std::mutex> lock(statsStateMutex);
+            for (int c = 0; c < NUM_STATS_CHANNELS; c++) {
+                if (!statsStateValid[c]) {
+                    json_array_append_new(statsJ, json_null());
+                    continue;
+                }
+                const ChannelStats::State& state = statsState[c];
+                json_t* stateJ = json_object();
+                json_object_set_new(stateJ, "min", json_real(state.min));
+                json_object_set_new(stateJ, "max", json_real(state.max));
+                json_object_set_new(stateJ, "mean", json_real(state.mean));
+                json_object_set_new(stateJ, "variance", json_real(state.variance));
+                json_t* lowJ = json_array();
+                json_t* highJ = json_array();
+                for (int i = 0; i < 5; i++) {
+                    json_array_append_new(lowJ, json_real(state.low[i]));
+                    json_array_append_new(highJ, json_real(state.high[i]));
+                }
+                json_object_set_new(stateJ, "low", lowJ);
+                json_object_set_new(stateJ, "high", highJ);
+                json_array_append_new(statsJ, stateJ);
+            }
+        }
+        json_object_set_new(rootJ, "channelStats", statsJ);
+        return rootJ;
+    }
+
+    void dataFromJson(json_t* rootJ) override {
+        json_t* overflowPolicyJ = json_object_get(rootJ, "overflowPolicy");
+        if (overflowPolicyJ) {
+            int policy = json_integer_value(overflowPolicyJ);
+            if (policy >= 0 && policy < OVERFLOW_POLICIES_LEN) {
+                overflowPolicy = policy;
+            }
+        }
+        json_t* statsDumpJ = json_object_get(rootJ, "statsDump");
+        if (statsDumpJ) {
+            statsDump = json_is_true(statsDumpJ);
+        }
+
+        json_t* recordOutputsJ = json_object_get(rootJ, "recordOutputs");
+        if (recordOutputsJ) {
+            recordOutputs = json_is_true(recordOutputsJ);
+        }
+
+        json_t* endpointJ = json_object_get(rootJ, "endpoint");
+        if (json_is_string(endpointJ) && json_string_value(endpointJ)[0]) {
+            setEndpoint(json_string_value(endpointJ));
+        }
+        json_t* deviceJ = json_object_get(rootJ, "device");
+        if (json_is_string(deviceJ)) {
+            setDevice(json_string_value(deviceJ));
+        }
+
+        json_t* replayLoopJ = json_object_get(rootJ, "replayLoop");
+        if (replayLoopJ) {
+            replayLoop = json_is_true(replayLoopJ);
+        }
+        json_t* replaySpeedJ = json_object_get(rootJ, "replaySpeed");
+        if (replaySpeedJ) {
+            replaySpeed = clamp((float) json_number_value(replaySpeedJ), MIN_REPLAY_SPEED, MAX_REPLAY_SPEED);
+        }
+        json_t* replayPathJ = json_object_get(rootJ, "replayPath");
+        if (json_is_string(replayPathJ) && json_string_value(replayPathJ)[0]) {
+            requestReplay(json_string_value(replayPathJ));
+        }
+        json_t* sourceJ = json_object_get(rootJ, "source");
+        if (sourceJ) {
+            int newSource = json_integer_value(sourceJ);
+            if (newSource >= 0 && newSource < SOURCES_LEN) {
+                setSource(newSource);
+            }
+        }
+
+        json_t* filtersJ = json_object_get(rootJ, "filters");
+        if (json_is_array(filtersJ) && json_array_size(filtersJ) == FILTER_STREAMS_LEN) {
+            for (int stream = 0; stream < FILTER_STREAMS_LEN; stream++) {
+                json_t* filterJ = json_array_get(filtersJ, stream);
+                FilterConfig filter = getFilterConfig(stream);
+                json_t* notchJ = json_object_get(filterJ, "notch");
+                if (notchJ) {
+                    int notch = json_integer_value(notchJ);
+                    if (notch >= 0 && notch < NOTCH_MODES_LEN) {
+                        filter.notch = (NotchMode) notch;
+                    }
+                }
+                json_t* bandpassJ = json_object_get(filterJ, "bandpass");
+                if (bandpassJ) {
+                    int bandpass = json_integer_value(bandpassJ);
+                    if (bandpass >= 0 && bandpass < BANDPASS_MODES_LEN) {
+                        filter.bandpass = (BandpassMode) bandpass;
+                    }
+                }
+                json_t* lowJ = json_object_get(filterJ, "low");
+                json_t* highJ = json_object_get(filterJ, "high");
+                if (lowJ && highJ) {
+                    double low = json_number_value(lowJ);
+                    double high = json_number_value(highJ);
+                    if (std::isfinite(low) && std::isfinite(high) && low >= 0.0 && low < high) {
+                        filter.low = low;
+                        filter.high = high;
+                    }
+                }
+                json_t* firTapsJ = json_object_get(filterJ, "firTaps");
+                if (firTapsJ) {
+                    filter.firTaps = json_integer_value(firTapsJ);
+                }
+                setFilterConfig(stream, filter);
+            }
+        }
+
+        BandConfig config = getBandConfig();
+        json_t* bandReductionJ = json_object_get(rootJ, "bandReduction");
+        if (bandReductionJ) {
+            int reduction = json_integer_value(bandReductionJ);
+            if (reduction >= 0 && reduction < REDUCTIONS_LEN) {
+                config.reduction = (BandReduction) reduction;
+            }
+        }
+        json_t* bandHopJ = json_object_get(rootJ, "bandHop");
+        if (bandHopJ) {
+            config.hopSize = std::max((int) json_integer_value(bandHopJ), 1);
+        }
+        json_t* crossSecondsJ = json_object_get(rootJ, "crossSeconds");
+        if (crossSecondsJ && json_number_value(crossSecondsJ) > 0.0) {
+            config.crossSeconds = json_number_value(crossSecondsJ);
+        }
+        json_t* bandsJ = json_object_get(rootJ, "bands");
+        if (json_is_array(bandsJ) && json_array_size(bandsJ) == NUM_BANDS) {
+            for (int b = 0; b < NUM_BANDS; b++) {
+                json_t* bandJ = json_array_get(bandsJ, b);
+                if (json_array_size(bandJ) == 2) {
+                    config.low[b] = json_number_value(json_array_get(bandJ, 0));
+                    config.high[b] = json_number_value(json_array_get(bandJ, 1));
+                }
+            }
+        }
+        setBandConfig(config);
 
-        std::lock_guard<std::mutex> lock(dataMutex);
+        json_t* beatChannelJ = json_object_get(rootJ, "beatChannel");
+        if (beatChannelJ) {
+            int channel = json_integer_value(beatChannelJ);
+            if (channel >= 0 && channel < NUM_PPG_CHANNELS) {
+                beatChannel = channel;
+            }
+        }
+        json_t* displayChannelJ = json_object_get(rootJ, "displayChannel");
+        if (displayChannelJ) {
+            int channel = json_integer_value(displayChannelJ);
+            if (channel >= 0 && channel < NUM_EEG_CHANNELS) {
+                displayChannel = channel;
+            }
+        }
+        json_t* coherencePairJ = json_object_get(rootJ, "coherencePair");
+        if (coherencePairJ) {
+            int pair = json_integer_value(coherencePairJ);
+            if (pair >= 0 && pair < NUM_CROSS_PAIRS) {
+                coherencePair = pair;
+            }
+        }
+        json_t* artifactHandlingJ = json_object_get(rootJ, "artifactHandling");
+        if (artifactHandlingJ) {
+            int handling = json_integer_value(artifactHandlingJ);
+            if (handling >= 0 && handling < ARTIFACT_HANDLINGS_LEN) {
+                artifactHandling = handling;
+            }
+        }
+        json_t* artifactLevelJ = json_object_get(rootJ, "artifactLevel");
+        if (artifactLevelJ) {
+            artifactLevel = std::max((float) json_number_value(artifactLevelJ), 1.f);
+        }
+        json_t* normalizationJ = json_object_get(rootJ, "normalization");
+        if (normalizationJ) {
+            int mode = json_integer_value(normalizationJ);
+            if (mode >= 0 && mode < NORMALIZATION_MODES_LEN) {
+                normalizationMode = mode;
+            }
+        }
+        json_t* statsJ = json_object_get(rootJ, "channelStats");
+        if (json_is_array(statsJ) && json_array_size(statsJ) == NUM_STATS_CHANNELS) {
+            std::lock_guard<std::mutex> lock(statsStateMutex);
+            for (int c = 0; c < NUM_STATS_CHANNELS; c++) {
+                json_t* stateJ = json_array_get(statsJ, c);
+                json_t* lowJ = json_object_get(stateJ, "low");
+                json_t* highJ = json_object_get(stateJ, "high");
+                statsStateValid[c] = json_array_size(lowJ) == 5 && json_array_size(highJ) == 5;
+                if (!statsStateValid[c]) continue;
+                ChannelStats::State& state = statsState[c];
+                state.min = json_number_value(json_object_get(stateJ, "min"));
+                state.max = json_number_value(json_object_get(stateJ, "max"));
+                state.mean = json_number_value(json_object_get(stateJ, "mean"));
+                state.variance = std::max(json_number_value(json_object_get(stateJ, "variance")), 0.0);
+                for (int i = 0; i < 5; i++) {
+                    state.low[i] = json_number_value(json_array_get(lowJ, i));
+                    state.high[i] = json_number_value(json_array_get(highJ, i));
+                }
+            }
+            statsStateLoaded = true;
+        }
+    }
 
-        sample_time += args.sampleTime;
+    // Audio thread: restore the stats loaded with the patch, or save the current ones for the next
+    void exchangeStatsState(float sampleTime, float window) {
+        bool load = statsStateLoaded;
+        if (!load) {
+            statsSavePhase += sampleTime;
+            if (statsSavePhase < STATS_SAVE_SECONDS) return;
+        }
+        std::unique_lock<std::mutex> lock(statsStateMutex, std::try_to_lock);
+        if (!lock.owns_lock()) return;
+        for (int c = 0; c < NUM_STATS_CHANNELS; c++) {
+            bool isEeg = c < NUM_EEG_CHANNELS;
+            ChannelStats& stats = isEeg ? eegStats[c] : ppgStats[c - NUM_EEG_CHANNELS];
+            if (load) {
+                if (statsStateValid[c]) {
+                    float rate = isEeg ? (float) sample_rate : ppgSampleRate.load();
+                    stats.restore(statsState[c], std::max((size_t) (rate * window), (size_t) 1));
+                }
+            } else if (stats.save(statsState[c])) {
+                statsStateValid[c] = true;
+            }
+        }
+        statsStateLoaded = false;
+        statsSavePhase = 0.f;
+    }
 
-        float sample_period = 1.f / sample_rate;
+    // Hold a detected beat for playBeats(), dropping the oldest if they back up
+    void queueBeat(double time) {
+        if (pendingBeatCount == MAX_PENDING_BEATS) {
+            std::copy(pendingBeats + 1, pendingBeats + MAX_PENDING_BEATS, pendingBeats);
+            pendingBeatCount--;
+        }
+        PendingBeat& beat = pendingBeats[pendingBeatCount++];
+        beat.time = time;
+        beat.bpm = beatDetector.bpm;
+        beat.rmssd = beatDetector.rmssd;
+    }
 
-        if (sample_time - last_sample_time >= sample_period) {
-            last_sample_time = sample_time;
-            if (!eeg_samples.empty()) {
-                std::vector<float> current_sample = std::move(eeg_samples.front());
-                eeg_samples.erase(eeg_samples.begin());
+    // Fire the beats the PPG playhead has reached
+    void playBeats(double playhead) {
+        int played = 0;
+        while (played < pendingBeatCount && pendingBeats[played].time <= playhead) {
+            const PendingBeat& beat = pendingBeats[played++];
+            if (playhead - beat.time > MAX_BEAT_LAG) continue;
+            beatTrigger.trigger(1e-3f);
+            beatLightPulse.trigger(0.1f);
+            heartBpm = beat.bpm;
+            heartRmssd = beat.rmssd;
+            displayBpm.store(beat.bpm, std::memory_order_relaxed);
+        }
+        if (played > 0) {
+            std::copy(pendingBeats + played, pendingBeats + pendingBeatCount, pendingBeats);
+            pendingBeatCount -= played;
+        }
+    }
+
+    // What the connected outputs need from the server. Recording, the latency
+    // stats and the expander bus cover every channel, and the beat channel always feeds the PULSE light.
+    StreamSubscription outputStreams() {
+        if (recorder.recording() || statsDump || outputs[STATS_OUTPUT].isConnected() || busConsumer) {
+            return StreamSubscription();
+        }
+        StreamSubscription needed = StreamSubscription::none();
+        for (int i = 0; i < NUM_EEG_CHANNELS; i++) {
+            if (outputs[EEG1_OUTPUT + i].isConnected()) {
+                needed.eegChannels |= 1 << i;
+            }
+        }
+        for (int b = 0; b < NUM_BANDS; b++) {
+            if (outputs[DELTA_OUTPUT + b].isConnected()) {
+                needed.eegChannels |= (1 << NUM_BAND_CHANNELS) - 1;
+            }
+        }
+        if (outputs[ASYMMETRY_OUTPUT].isConnected()) {
+            needed.eegChannels |= (1 << CHANNEL_AF7) | (1 << CHANNEL_AF8);
+        }
+        if (outputs[COHERENCE_OUTPUT].isConnected()) {
+            needed.eegChannels |= (1 << NUM_CROSS_CHANNELS) - 1;
+        }
+        if (outputs[BANDS_POLY_OUTPUT].isConnected()) {
+            needed.eegChannels |= (1 << NUM_BAND_CHANNELS) - 1;
+        }
+        if (outputs[QUALITY_OUTPUT].isConnected() || outputs[EEG_POLY_OUTPUT].isConnected()) {
+            needed.eegChannels |= (1 << NUM_EEG_CHANNELS) - 1;
+        }
+        if (outputs[PPG_POLY_OUTPUT].isConnected()) {
+            needed.ppgChannels |= (1 << NUM_PPG_CHANNELS) - 1;
+        }
+        for (int i = 0; i < NUM_PPG_CHANNELS; i++) {
+            if (outputs[PPG1_OUTPUT + i].isConnected()) {
+                needed.ppgChannels |= 1 << i;
+            }
+        }
+        needed.ppgChannels |= 1 << beatChannel;
+        return needed;
+    }
 
-                for (int i = 0; i < 5 && i < current_sample.size(); i++) {
-                    updateChannelStats(eegStats[i], current_sample[i], sample_rate);
-                    outputs[EEG1_OUTPUT + i].setVoltage(normalizeValue(current_sample[i], eegStats[i]));
+    void process(const ProcessArgs& args) override {
+        // `connected` is maintained by sourceThread; never touch the hub from the audio thread
+        lights[CONNECTION_LIGHT].setBrightness(connected ? 1.f : 0.f);
+
+        // sourceThread passes a change on to the server; wake it rather than wait for the next batch
+        streamCheckPhase += args.sampleTime;
+        if (streamCheckPhase >= STREAM_CHECK_SECONDS) {
+            streamCheckPhase = 0.f;
+            uint32_t streams = outputStreams().pack();
+            if (neededStreams.exchange(streams) != streams) {
+                wakeup.signal();
+            }
+        }
+
+        // Band outputs are each band's share of the summed band power, 0-10V
+        if (bandBuffer.update()) {
+            const BandPowers& bands = bandBuffer.read();
+            float power[NUM_BANDS];
+            float total = 0.f;
+            for (int b = 0; b < NUM_BANDS; b++) {
+                power[b] = 0.f;
+                for (int c = 0; c < NUM_BAND_CHANNELS; c++) {
+                    power[b] += bands.power[b][c];
                 }
+                total += power[b];
+            }
+            outputs[BANDS_POLY_OUTPUT].setChannels(NUM_BANDS);
+            for (int b = 0; b < NUM_BANDS; b++) {
+                float voltage = total > 0.f ? 10.f * power[b] / total : 0.f;
+                outputs[DELTA_OUTPUT + b].setVoltage(voltage);
+                outputs[BANDS_POLY_OUTPUT].setVoltage(voltage, b);
+            }
+            outputs[ASYMMETRY_OUTPUT].setVoltage(clamp(ASYMMETRY_VOLTS * bands.alphaAsymmetry, -10.f, 10.f));
+            int pair = coherencePair.load(std::memory_order_relaxed);
+            outputs[COHERENCE_OUTPUT].setChannels(NUM_BANDS);
+            for (int b = 0; b < NUM_BANDS; b++) {
+                outputs[COHERENCE_OUTPUT].setVoltage(10.f * bands.coherence[b][pair], b);
+            }
+            bandLatency = steadyTime() - bands.arrivalTime;
+        }
+
+        if (overflowPolicy == OVERFLOW_CATCH_UP) {
+            catchUp(eegRing, sample_rate);
+            catchUp(ppgRing, ppgSampleRate);
+        }
+
+        // Move everything that has arrived into the jitter buffers, updating stats at the source rate
+        float window = params[WINDOW_PARAM].getValue();
+        exchangeStatsState(args.sampleTime, window);
+        MuseFrame frame;
+        size_t depth = eegRing.size();
+        if (depth > 0) {
+            queueDepth.record(depth);
+        }
+        // Taken once a frame is in hand, as one can be pushed after the size() above
+        double now = 0.0;
+        int holdOut = artifactHandling != ARTIFACTS_FLAG;
+        while (eegRing.pop(frame)) {
+            if (now == 0.0) {
+                now = steadyTime();
             }
-            if (!ppg_samples.empty()) {
-                std::vector<float> current_sample = std::move(ppg_samples.front());
-                ppg_samples.erase(ppg_samples.begin());
+            endToEndLatency.recordMicros(now - frame.arrivalTime + eegJitter.latency());
+            for (int i = 0; i < NUM_EEG_CHANNELS; i++) {
+                if (frame.eegMissing & (1 << i)) continue;
+                if (holdOut && (frame.eegFlagged & (1 << i))) continue;
+                updateChannelStats(eegStats[i], frame.eeg[i], sample_rate, window);
+            }
+            eegJitter.push(frame.timestamp, frame.eeg);
+            if (busConsumer) {
+                busEeg.append(busPool->eeg, sample_rate, frame.timestamp, frame.eeg, NUM_EEG_CHANNELS,
+                    frame.eegFlagged, frame.eegMissing);
+            }
+        }
+
+        // PPG runs on its own clock at its native rate and is only upsampled by its jitter buffer
+        float ppgRate = ppgSampleRate;
+        float scale = rateScale;
+        if (sample_rate * scale != eegJitter.sourceRate) {
+            eegJitter.setSourceRate(sample_rate * scale);
+        }
+        if (ppgRate * scale != ppgJitter.sourceRate) {
+            ppgJitter.setSourceRate(ppgRate * scale);
+        }
+        int channel = beatChannel;
+        if (channel != beatDetectorChannel) {
+            beatDetector.reset();
+            beatDetectorChannel = channel;
+        }
+        beatDetector.setSampleRate(ppgRate);
+        beatDetector.setTimeScale(scale);
+        while (ppgRing.pop(frame)) {
+            for (int i = 0; i < NUM_PPG_CHANNELS; i++) {
+                if (frame.ppgMissing & (1 << i)) continue;
+                updateChannelStats(ppgStats[i], frame.ppg[i], ppgRate, window);
+            }
+            // The beat channel is missing only until the server catches up with a change
+            bool beatMissing = frame.ppgMissing & (1 << channel);
+            if (!beatMissing && beatDetector.process(frame.timestamp, frame.ppg[channel])) {
+                queueBeat(frame.timestamp);
+            }
+            ppgJitter.push(frame.timestamp, frame.ppg);
+            if (busConsumer) {
+                busPpg.append(busPool->ppg, ppgRate, frame.timestamp, frame.ppg, NUM_PPG_CHANNELS, 0, frame.ppgMissing);
+            }
+        }
+
+        float latency = params[LATENCY_PARAM].getValue();
+        eegJitter.setTargetLatency(latency);
+        ppgJitter.setTargetLatency(latency);
+        NormalizationMode mode = (NormalizationMode) normalizationMode.load();
+        float eeg[NUM_EEG_CHANNELS];
+        if (eegJitter.process(args.sampleTime, eeg)) {
+            outputs[EEG_POLY_OUTPUT].setChannels(NUM_EEG_CHANNELS);
+            for (int i = 0; i < NUM_EEG_CHANNELS; i++) {
+                float voltage = normalizeValue(eeg[i], eegStats[i], mode);
+                outputs[EEG1_OUTPUT + i].setVoltage(voltage);
+                outputs[EEG_POLY_OUTPUT].setVoltage(voltage, i);
+            }
+        }
+        float ppg[NUM_PPG_CHANNELS];
+        if (ppgJitter.process(args.sampleTime, ppg)) {
+            outputs[PPG_POLY_OUTPUT].setChannels(NUM_PPG_CHANNELS);
+            for (int i = 0; i < NUM_PPG_CHANNELS; i++) {
+                float voltage = normalizeValue(ppg[i], ppgStats[i], mode);
+                outputs[PPG1_OUTPUT + i].setVoltage(voltage);
+                outputs[PPG_POLY_OUTPUT].setVoltage(voltage, i);
+            }
+            playBeats(ppgJitter.playheadTime());
+        }
+        outputs[BEAT_OUTPUT].setVoltage(beatTrigger.process(args.sampleTime) ? 10.f : 0.f);
+        outputs[BPM_OUTPUT].setVoltage(heartBpm / BPM_PER_VOLT);
+        outputs[HRV_OUTPUT].setVoltage(std::min(heartRmssd * 1000.f / HRV_MS_PER_VOLT, 10.f));
+        outputs[QUALITY_OUTPUT].setChannels(NUM_EEG_CHANNELS);
+        for (int i = 0; i < NUM_EEG_CHANNELS; i++) {
+            outputs[QUALITY_OUTPUT].setVoltage(10.f * eegQualityLevel[i].load(std::memory_order_relaxed), i);
+        }
+        lights[BEAT_LIGHT].setBrightnessSmooth(beatLightPulse.process(args.sampleTime) ? 1.f : 0.f, args.sampleTime);
+        outputLatency.store(eegJitter.latency(), std::memory_order_relaxed);
+        ppgLatency.store(ppgJitter.latency(), std::memory_order_relaxed);
+        outputUnderruns.store(eegJitter.underruns + ppgJitter.underruns, std::memory_order_relaxed);
+        outputResyncs.store(eegJitter.resyncs + ppgJitter.resyncs, std::memory_order_relaxed);
+        if (busConsumer) {
+            sendBus();
+        }
 
-                for (int i = 0; i < 3 && i < current_sample.size(); i++) {
-                    updateChannelStats(ppgStats[i], current_sample[i], sample_rate);
-                    outputs[PPG1_OUTPUT + i].setVoltage(normalizeValue(current_sample[i], ppgStats[i]));
+        // Outputs are recorded at the EEG rate, stamped with the source time being played
+        if (recordOutputs && recorder.recording() && eegJitter.started) {
+            outputRecordPhase += args.sampleTime * sample_rate;
+            if (outputRecordPhase >= 1.f) {
+                outputRecordPhase -= std::floor(outputRecordPhase);
+                float voltages[RECORDED_OUTPUTS];
+                for (int i = 0; i < RECORDED_OUTPUTS; i++) {
+                    voltages[i] = outputs[i].getVoltage();
                 }
+                recorder.record(SessionRecorder::LANE_OUTPUT, RECORD_OUTPUT, eegJitter.playheadTime(), voltages, RECORDED_OUTPUTS);
             }
         }
+
+        if (outputs[STATS_OUTPUT].isConnected()) {
+            outputs[STATS_OUTPUT].setChannels(4);
+            outputs[STATS_OUTPUT].setVoltage(endToEndLatency.last.load(std::memory_order_relaxed) * 1e-4f, 0);
+            outputs[STATS_OUTPUT].setVoltage(lastArrivalJitter.load(std::memory_order_relaxed) * 1e-3f, 1);
+            outputs[STATS_OUTPUT].setVoltage(lastParseTime.load(std::memory_order_relaxed) * 1e-2f, 2);
+            outputs[STATS_OUTPUT].setVoltage(queueDepth.last.load(std::memory_order_relaxed) * 1e-1f, 3);
+        }
+    }
+
+    static std::string statsPath() {
+        return asset::user("MuseHeadband-stats.json");
+    }
+
+    static json_t* histogramToJson(const Histogram& histogram) {
+        Histogram::Snapshot snapshot = histogram.snapshot();
+        json_t* histogramJ = json_object();
+        json_object_set_new(histogramJ, "count", json_integer(snapshot.count));
+        json_object_set_new(histogramJ, "mean", json_real(snapshot.mean()));
+        json_object_set_new(histogramJ, "p50", json_integer(snapshot.percentile(0.5)));
+        json_object_set_new(histogramJ, "p90", json_integer(snapshot.percentile(0.9)));
+        json_object_set_new(histogramJ, "p99", json_integer(snapshot.percentile(0.99)));
+        json_object_set_new(histogramJ, "max", json_integer(snapshot.max));
+        // Bucket i counts values in [2^(i-1), 2^i); trailing empty buckets are left out
+        int used = Histogram::BUCKETS;
+        while (used > 0 && snapshot.buckets[used - 1] == 0) used--;
+        json_t* bucketsJ = json_array();
+        for (int i = 0; i < used; i++) {
+            json_array_append_new(bucketsJ, json_integer(snapshot.buckets[i]));
+        }
+        json_object_set_new(histogramJ, "buckets", bucketsJ);
+        return histogramJ;
+    }
+
+    json_t* statsToJson() {
+        json_t* rootJ = json_object();
+        json_object_set_new(rootJ, "time", json_real(steadyTime()));
+        std::shared_ptr<MuseHub> hub = getHub();
+        if (hub) {
+            json_object_set_new(rootJ, "endpoint", json_string(hub->url.c_str()));
+            json_object_set_new(rootJ, "messages", json_integer(hub->messagesReceived.load()));
+            json_object_set_new(rootJ, "sequenceGaps", json_integer(hub->sequenceGaps.load()));
+            json_object_set_new(rootJ, "arrivalJitterUs", histogramToJson(hub->arrivalJitter));
+            json_object_set_new(rootJ, "parseTimeUs", histogramToJson(hub->parseTime));
+        }
+        json_object_set_new(rootJ, "droppedFrames", json_integer(droppedFrames.load() + subscription.dropped.load()));
+        json_object_set_new(rootJ, "underruns", json_integer(outputUnderruns.load()));
+        json_object_set_new(rootJ, "resyncs", json_integer(outputResyncs.load()));
+        json_object_set_new(rootJ, "queueDepthFrames", histogramToJson(queueDepth));
+        json_object_set_new(rootJ, "endToEndLatencyUs", histogramToJson(endToEndLatency));
+        return rootJ;
+    }
+
+    // Write through a temporary file so readers never see a partial dump
+    void writeStats() {
+        std::string path = statsPath();
+        std::string tmpPath = path + ".tmp";
+        json_t* rootJ = statsToJson();
+        if (json_dump_file(rootJ, tmpPath.c_str(), JSON_INDENT(2)) == 0) {
+            std::rename(tmpPath.c_str(), path.c_str());
+        } else {
+            WARN("Failed to write stats to %s", tmpPath.c_str());
+        }
+        json_decref(rootJ);
+    }
+
+    // Also resets the hub's connection stats, for every module sharing it
+    void resetStats() {
+        queueDepth.reset();
+        endToEndLatency.reset();
+        std::shared_ptr<MuseHub> hub = getHub();
+        if (hub) {
+            hub->arrivalJitter.reset();
+            hub->parseTime.reset();
+            hub->messagesReceived = 0;
+            hub->sequenceGaps = 0;
+        }
+    }
+
+
+
+
+};
+
+// Replay speed on a log scale, 0.1x to 100x
+struct ReplaySpeedQuantity : Quantity {
+    MuseHeadband* module;
+
+    explicit ReplaySpeedQuantity(MuseHeadband* module) : module(module) {}
+
+    void setValue(float value) override {
+        module->replaySpeed = std::pow(10.f, clamp(value, getMinValue(), getMaxValue()));
+    }
+    float getValue() override { return std::log10(module->replaySpeed.load()); }
+    float getMinValue() override { return std::log10(MuseHeadband::MIN_REPLAY_SPEED); }
+    float getMaxValue() override { return std::log10(MuseHeadband::MAX_REPLAY_SPEED); }
+    float getDefaultValue() override { return 0.f; }
+    float getDisplayValue() override { return module->replaySpeed; }
+    void setDisplayValue(float displayValue) override { setValue(std::log10(std::max(displayValue, 1e-3f))); }
+    int getDisplayPrecision() override { return 2; }
+    std::string getLabel() override { return "Speed"; }
+    std::string getUnit() override { return "x"; }
+};
+
+// Scrubbing: the value is the fraction of the recording played, shown in seconds
+struct ReplayPositionQuantity : Quantity {
+    MuseHeadband* module;
+
+    explicit ReplayPositionQuantity(MuseHeadband* module) : module(module) {}
+
+    void setValue(float value) override {
+        value = clamp(value, 0.f, 1.f);
+        module->replaySeek = value;
+        module->replayPosition = value * module->replayDuration;
+        module->wakeup.signal();
+    }
+    float getValue() override {
+        float duration = module->replayDuration;
+        return duration > 0.f ? module->replayPosition / duration : 0.f;
+    }
+    float getDisplayValue() override { return module->replayPosition; }
+    void setDisplayValue(float displayValue) override {
+        float duration = module->replayDuration;
+        setValue(duration > 0.f ? displayValue / duration : 0.f);
+    }
+    int getDisplayPrecision() override { return 3; }
+    std::string getLabel() override { return "Position"; }
+    std::string getUnit() override { return " s"; }
+};
+
+// Edits the server URL; Enter applies it and closes the menu
+struct EndpointField : ui::TextField {
+    MuseHeadband* module;
+
+    explicit EndpointField(MuseHeadband* module) : module(module) {
+        box.size.x = 200.f;
+        placeholder = MuseHeadband::DEFAULT_ENDPOINT;
+        text = module->getEndpoint();
+        selectAll();
+    }
+
+    void onSelectKey(const SelectKeyEvent& e) override {
+        if (e.action == GLFW_PRESS && (e.key == GLFW_KEY_ENTER || e.key == GLFW_KEY_KP_ENTER)) {
+            module->setEndpoint(text);
+            ui::MenuOverlay* overlay = getAncestorOfType<ui::MenuOverlay>();
+            if (overlay) {
+                overlay->requestDelete();
+            }
+            e.consume(this);
+        }
+        if (!e.getTarget()) {
+            ui::TextField::onSelectKey(e);
+        }
+    }
+};
+
+template <class TQuantity>
+struct ReplaySlider : ui::Slider {
+    explicit ReplaySlider(MuseHeadband* module) {
+        quantity = new TQuantity(module);
+        box.size.x = 200.f;
+    }
+    ~ReplaySlider() {
+        delete quantity;
+    }
+};
+
+// Scrolling spectrogram of one EEG channel above a scope of its latest samples.
+//
+// Reads the analysis thread's snapshots through spectrumBuffer, so drawing never
+// waits on the band engine or process(). Each new hop paints one column of a
+// ring of pixels and uploads only that column; the image is drawn with a
+// repeating pattern offset so the newest column lands at the right edge. Rack
+// only draws widgets on screen, and the analysis thread only publishes while
+// this has drawn recently, so a panel out of view costs nothing.
+struct SpectrumDisplay : Widget {
+    static const int COLUMNS = 128;
+    static constexpr float MAX_DISPLAY_HZ = 60.f;
+    // Colours span this far below the ceiling, which follows the loudest bin
+    static constexpr float DYNAMIC_RANGE_DB = 50.f;
+    static constexpr float CEILING_DECAY_DB = 0.05f;
+    static constexpr float SCOPE_FRACTION = 0.25f;
+    // The scope never zooms in closer than +-MIN_SCOPE_RANGE uV
+    static constexpr float MIN_SCOPE_RANGE = 10.f;
+
+    MuseHeadband* module = nullptr;
+    int image = -1;
+    int imageRows = 0;
+    // COLUMNS x imageRows RGBA, highest frequency in the top row
+    std::vector<uint8_t> pixels;
+    // The column painted last
+    int column = COLUMNS - 1;
+    uint64_t lastHop = 0;
+    float ceilingDb = -100.f;
+
+    ~SpectrumDisplay() {
+        if (image >= 0) {
+            nvgDeleteImage(APP->window->vg, image);
+        }
+    }
+
+    void onContextDestroy(const ContextDestroyEvent& e) override {
+        if (image >= 0) {
+            nvgDeleteImage(e.vg, image);
+            image = -1;
+        }
+        Widget::onContextDestroy(e);
+    }
+
+    void draw(const DrawArgs& args) override {
+        nvgBeginPath(args.vg);
+        nvgRect(args.vg, 0, 0, box.size.x, box.size.y);
+        nvgFillColor(args.vg, nvgRGB(0x10, 0x10, 0x14));
+        nvgFill(args.vg);
     }
 
+    void drawLayer(const DrawArgs& args, int layer) override {
+        if (layer != 1 || !module) {
+            Widget::drawLayer(args, layer);
+            return;
+        }
+        module->displayWantedUntil = steadyTime() + MuseHeadband::DISPLAY_WANTED_SECONDS;
+        bool fresh = module->spectrumBuffer.update();
+        const SpectrumSnapshot& snapshot = module->spectrumBuffer.read();
+        int rows = std::min(snapshot.bins, (int) (MAX_DISPLAY_HZ / snapshot.binHz) + 1);
+        if (rows < 2) return;
+        if (image < 0 || rows != imageRows) {
+            createImage(args.vg, rows);
+            fresh = true;
+        }
+        if (fresh) {
+            addColumns(args.vg, snapshot);
+        }
+
+        float height = box.size.y * (1.f - SCOPE_FRACTION);
+        float columnWidth = box.size.x / COLUMNS;
+        NVGpaint paint = nvgImagePattern(args.vg, box.size.x - (column + 1) * columnWidth, 0,
+            box.size.x, height, 0.f, image, 1.f);
+        nvgBeginPath(args.vg);
+        nvgRect(args.vg, 0, 0, box.size.x, height);
+        nvgFillPaint(args.vg, paint);
+        nvgFill(args.vg);
 
+        drawScope(args.vg, snapshot, height);
 
+        nvgFontSize(args.vg, 9.0);
+        nvgFontFaceId(args.vg, APP->window->uiFont->handle);
+        nvgFillColor(args.vg, nvgRGB(0xe0, 0xe0, 0xe0));
+        nvgTextAlign(args.vg, NVG_ALIGN_LEFT | NVG_ALIGN_TOP);
+        nvgText(args.vg, 2, 2, string::f("CH %d", snapshot.channel + 1).c_str(), NULL);
+        nvgTextAlign(args.vg, NVG_ALIGN_RIGHT | NVG_ALIGN_TOP);
+        nvgText(args.vg, box.size.x - 2, 2, string::f("%.0f Hz", (rows - 1) * snapshot.binHz).c_str(), NULL);
+    }
 
+    void createImage(NVGcontext* vg, int rows) {
+        if (image >= 0) {
+            nvgDeleteImage(vg, image);
+        }
+        imageRows = rows;
+        pixels.assign((size_t) (COLUMNS * rows * 4), 0);
+        for (size_t i = 3; i < pixels.size(); i += 4) {
+            pixels[i] = 0xff;
+        }
+        image = nvgCreateImageRGBA(vg, COLUMNS, rows, NVG_IMAGE_REPEATX | NVG_IMAGE_NEAREST, pixels.data());
+        column = COLUMNS - 1;
+    }
+
+    // Paint the new snapshot into as many columns as hops went by, and upload them
+    void addColumns(NVGcontext* vg, const SpectrumSnapshot& snapshot) {
+        int steps = 1;
+        if (snapshot.hop > lastHop && lastHop > 0) {
+            steps = (int) std::min(snapshot.hop - lastHop, (uint64_t) COLUMNS);
+        }
+        lastHop = snapshot.hop;
+
+        float peakDb = -200.f;
+        for (int k = 1; k < imageRows; k++) {
+            peakDb = std::max(peakDb, toDb(snapshot.magnitude[k]));
+        }
+        ceilingDb = std::max(peakDb, ceilingDb - CEILING_DECAY_DB * steps);
+
+        for (int step = 0; step < steps; step++) {
+            column = (column + 1) % COLUMNS;
+            for (int k = 0; k < imageRows; k++) {
+                float level = 1.f + (toDb(snapshot.magnitude[k]) - ceilingDb) / DYNAMIC_RANGE_DB;
+                uint8_t* pixel = &pixels[((size_t) (imageRows - 1 - k) * COLUMNS + column) * 4];
+                colormap(clamp(level, 0.f, 1.f), pixel);
+            }
+        }
+        if (steps == 1) {
+            // Only the new column: the GL backend reads it out of the whole image with a row stride
+            NVGparams* params = nvgInternalParams(vg);
+            params->renderUpdateTexture(params->userPtr, image, column, 0, 1, imageRows, pixels.data());
+        } else {
+            nvgUpdateImage(vg, image, pixels.data());
+        }
+    }
+
+    void drawScope(NVGcontext* vg, const SpectrumSnapshot& snapshot, float top) {
+        int count = snapshot.scopeSamples;
+        if (count < 2) return;
+        float range = MIN_SCOPE_RANGE;
+        float mean = 0.f;
+        for (int i = 0; i < count; i++) {
+            mean += snapshot.scope[i];
+        }
+        mean /= count;
+        for (int i = 0; i < count; i++) {
+            range = std::max(range, std::fabs(snapshot.scope[i] - mean));
+        }
+        float height = box.size.y - top;
+        float middle = top + 0.5f * height;
+        float yScale = -0.45f * height / range;
+        nvgBeginPath(vg);
+        for (int i = 0; i < count; i++) {
+            float x = box.size.x * i / (count - 1);
+            float y = middle + yScale * (snapshot.scope[i] - mean);
+            if (i == 0) {
+                nvgMoveTo(vg, x, y);
+            } else {
+                nvgLineTo(vg, x, y);
+            }
+        }
+        nvgStrokeColor(vg, nvgRGB(0x5f, 0xd0, 0xff));
+        nvgStrokeWidth(vg, 1.f);
+        nvgStroke(vg);
+    }
+
+    static float toDb(float magnitude) {
+        return 20.f * std::log10(std::max(magnitude, 1e-6f));
+    }
+
+    // Dark blue through red to pale yellow, for `level` in [0, 1]
+    static void colormap(float level, uint8_t* rgba) {
+        static const uint8_t STOPS[5][3] = {
+            {0x00, 0x00, 0x04}, {0x42, 0x0a, 0x68}, {0xbb, 0x37, 0x54}, {0xf9, 0x8c, 0x0a}, {0xfc, 0xff, 0xa4},
+        };
+        float position = level * 4.f;
+        int i = std::min((int) position, 3);
+        float t = position - i;
+        for (int channel = 0; channel < 3; channel++) {
+            rgba[channel] = (uint8_t) (STOPS[i][channel] + t * (STOPS[i + 1][channel] - STOPS[i][channel]));
+        }
+        rgba[3] = 0xff;
+    }
 };
 
 struct MuseHeadbandWidget : ModuleWidget {
@@ -310,6 +1717,9 @@ struct MuseHeadbandWidget : ModuleWidget {
         float col_a_center = 10;
         float col_b_center = 40;
         float col_c_center = 70;
+        float col_d_center = 100;
+        float col_e_left = 116;
+        float col_e_center = 142;
 
         float row_start = 40;
 
@@ -324,6 +1734,30 @@ struct MuseHeadbandWidget : ModuleWidget {
             MuseHeadband::CONNECTION_LIGHT
         ));
 
+        // Jitter buffer latency
+        addChild(new ThemedLabel(mm2px(Vec(col_b_center, 20)), "LATENCY"));
+        addParam(createParamCentered<Trimpot>(
+            mm2px(Vec(col_b_center, 27)),
+            module,
+            MuseHeadband::LATENCY_PARAM
+        ));
+
+        // Normalization window
+        addChild(new ThemedLabel(mm2px(Vec(col_c_center, 20)), "WINDOW"));
+        addParam(createParamCentered<Trimpot>(
+            mm2px(Vec(col_c_center, 27)),
+            module,
+            MuseHeadband::WINDOW_PARAM
+        ));
+
+        // Heartbeat LED
+        addChild(new ThemedLabel(mm2px(Vec(col_d_center, 20)), "PULSE"));
+        addChild(createLightCentered<MediumLight<RedLight>>(
+            mm2px(Vec(col_d_center, 27)),
+            module,
+            MuseHeadband::BEAT_LIGHT
+        ));
+
         // EEG Section
         addChild(new ThemedLabel(mm2px(Vec(col_a_center, row_start)), "EEG", true));
         
@@ -379,6 +1813,541 @@ struct MuseHeadbandWidget : ModuleWidget {
                 MuseHeadband::PPG1_OUTPUT + i
             ));
         }
+
+        // Instrumentation, polyphonic
+        addChild(new ThemedLabel(mm2px(Vec(col_c_center, ppgStart + 4 * ppgSpacing - 5)), "STATS"));
+        addOutput(createOutputCentered<PJ301MPort>(
+            mm2px(Vec(col_c_center, ppgStart + 4 * ppgSpacing)),
+            module,
+            MuseHeadband::STATS_OUTPUT
+        ));
+
+        // Heart Section
+        addChild(new ThemedLabel(mm2px(Vec(col_d_center, row_start)), "HEART", true));
+        const float heartStart = row_start + 15;
+        const float heartSpacing = 15;
+        const char* heartLabels[] = {
+            "BEAT", "BPM", "HRV"
+        };
+        for (int i = 0; i < 3; i++) {
+            addChild(new ThemedLabel(
+                mm2px(Vec(col_d_center, heartStart + i * heartSpacing - 5)),
+                heartLabels[i]
+            ));
+            addOutput(createOutputCentered<PJ301MPort>(
+                mm2px(Vec(col_d_center, heartStart + i * heartSpacing)),
+                module,
+                MuseHeadband::BEAT_OUTPUT + i
+            ));
+        }
+
+        // EEG signal quality, polyphonic
+        addChild(new ThemedLabel(mm2px(Vec(col_d_center, heartStart + 4 * heartSpacing - 5)), "QUALITY"));
+        addOutput(createOutputCentered<PJ301MPort>(
+            mm2px(Vec(col_d_center, heartStart + 4 * heartSpacing)),
+            module,
+            MuseHeadband::QUALITY_OUTPUT
+        ));
+
+        // Polyphonic copies of the EEG, PPG and brainwave outputs
+        addChild(new ThemedLabel(mm2px(Vec(col_e_center, 10)), "POLY", true));
+        const char* polyLabels[] = {"EEG", "PPG", "WAVES"};
+        const int polyOutputs[] = {
+            MuseHeadband::EEG_POLY_OUTPUT, MuseHeadband::PPG_POLY_OUTPUT, MuseHeadband::BANDS_POLY_OUTPUT
+        };
+        for (int i = 0; i < 3; i++) {
+            float x = col_e_left + (1 + 2 * i) * (col_e_center - col_e_left) / 3;
+            addChild(new ThemedLabel(mm2px(Vec(x, 20)), polyLabels[i]));
+            addOutput(createOutputCentered<PJ301MPort>(
+                mm2px(Vec(x, 27)),
+                module,
+                polyOutputs[i]
+            ));
+        }
+
+        // Spectrogram and scope of one EEG channel
+        addChild(new ThemedLabel(mm2px(Vec(col_e_center, row_start)), "SPECTRUM", true));
+        SpectrumDisplay* display = new SpectrumDisplay;
+        display->module = module;
+        display->box.pos = mm2px(Vec(col_e_left, row_start + 5));
+        display->box.size = mm2px(Vec(2 * (col_e_center - col_e_left), 58));
+        addChild(display);
+
+        // Frontal alpha asymmetry, and band coherence of the chosen pair, polyphonic
+        const char* crossLabels[] = {"ASYM", "COHERENCE"};
+        for (int i = 0; i < 2; i++) {
+            float x = col_e_left + (1 + 2 * i) * 0.5f * (col_e_center - col_e_left);
+            addChild(new ThemedLabel(mm2px(Vec(x, heartStart + 4 * heartSpacing - 5)), crossLabels[i]));
+            addOutput(createOutputCentered<PJ301MPort>(
+                mm2px(Vec(x, heartStart + 4 * heartSpacing)),
+                module,
+                MuseHeadband::ASYMMETRY_OUTPUT + i
+            ));
+        }
+    }
+
+    // "name: p50 x, p99 y, max z unit", with values divided by `scale`
+    static std::string histogramLabel(const char* name, const Histogram& histogram, double scale, const char* unit) {
+        Histogram::Snapshot snapshot = histogram.snapshot();
+        return string::f("%s: p50 %.1f, p99 %.1f, max %.1f %s", name,
+            snapshot.percentile(0.5) / scale, snapshot.percentile(0.99) / scale, snapshot.max / scale, unit);
+    }
+
+    static void appendServerMenu(Menu* menu, MuseHeadband* module) {
+        menu->addChild(createSubmenuItem("Server", module->getEndpoint(), [=](Menu* menu) {
+            menu->addChild(createMenuLabel("WebSocket URL, Enter to connect"));
+            EndpointField* field = new EndpointField(module);
+            menu->addChild(field);
+            menu->addChild(createMenuItem("Reset to default", MuseHeadband::DEFAULT_ENDPOINT, [=]() {
+                module->setEndpoint(MuseHeadband::DEFAULT_ENDPOINT);
+            }));
+        }));
+        std::shared_ptr<MuseHub> hub = module->getHub();
+        std::string device = module->getDevice();
+        std::vector<MuseDevice> devices;
+        if (hub) {
+            devices = hub->getDevices();
+        }
+        std::string deviceLabel = "First";
+        for (const MuseDevice& d : devices) {
+            if (d.id == device) {
+                deviceLabel = d.name;
+            }
+        }
+        if (!device.empty() && deviceLabel == "First") {
+            deviceLabel = device;
+        }
+        menu->addChild(createSubmenuItem("Headband", deviceLabel, [=](Menu* menu) {
+            menu->addChild(createCheckMenuItem("First on server", "",
+                [=]() {
+                    return module->getDevice().empty();
+                },
+                [=]() {
+                    module->setDevice("");
+                }
+            ));
+            for (const MuseDevice& d : devices) {
+                std::string id = d.id;
+                menu->addChild(createCheckMenuItem(string::f("%d: %s", d.index, d.name.c_str()), id,
+                    [=]() {
+                        return module->getDevice() == id;
+                    },
+                    [=]() {
+                        module->setDevice(id);
+                    }
+                ));
+            }
+            if (devices.empty()) {
+                menu->addChild(createMenuLabel("No device list from the server yet"));
+            }
+        }));
+        if (hub) {
+            size_t modules = hub->subscriberCount();
+            menu->addChild(createMenuLabel(string::f("%s, shared by %d module%s",
+                hub->connected ? "Connected" : "Connecting", (int) modules, modules == 1 ? "" : "s")));
+        }
+    }
+
+    static void appendReplayMenu(Menu* menu, MuseHeadband* module) {
+        std::string path, status;
+        {
+            std::lock_guard<std::mutex> lock(module->replayMutex);
+            path = module->replayPath;
+            status = module->replayStatus;
+        }
+        menu->addChild(createMenuItem("Load recording...", "", [=]() {
+            osdialog_filters* filters = osdialog_filters_parse("Recordings (.csv .museb .muselog):csv,museb,muselog");
+            std::string dir = path.empty() ? asset::user("") : system::getDirectory(path);
+            char* chosen = osdialog_file(OSDIALOG_OPEN, dir.c_str(), NULL, filters);
+            osdialog_filters_free(filters);
+            if (chosen) {
+                module->requestReplay(chosen);
+                std::free(chosen);
+            }
+        }));
+        if (!status.empty()) {
+            menu->addChild(createMenuLabel(status));
+        } else if (module->replayLoaded) {
+            menu->addChild(createMenuLabel(string::f("%s: %.1f / %.1f s", system::getFilename(path).c_str(),
+                module->replayPosition.load(), module->replayDuration.load())));
+        } else if (!path.empty()) {
+            menu->addChild(createMenuLabel("Loading " + system::getFilename(path)));
+        }
+        menu->addChild(createBoolMenuItem("Loop", "",
+            [=]() {
+                return module->replayLoop.load();
+            },
+            [=](bool loop) {
+                module->replayLoop = loop;
+            }
+        ));
+        menu->addChild(new ReplaySlider<ReplaySpeedQuantity>(module));
+        menu->addChild(new ReplaySlider<ReplayPositionQuantity>(module));
+        if (system::getExtension(path) == ".csv") {
+            menu->addChild(createMenuItem("Save as binary recording", "", [=]() {
+                module->replayConvertRequested = true;
+                module->wakeup.signal();
+            }));
+        } else if (!path.empty()) {
+            menu->addChild(createMenuItem("Export as CSV", "", [=]() {
+                module->replayExportRequested = true;
+                module->wakeup.signal();
+            }));
+        }
+    }
+
+    static void appendRecordMenu(Menu* menu, MuseHeadband* module) {
+        SessionRecorder& recorder = module->recorder;
+        if (recorder.recording()) {
+            menu->addChild(createMenuItem("Stop recording", "", [=]() {
+                module->stopRecording();
+            }));
+            menu->addChild(createMenuLabel(string::f("%s: %.1f MB, %llu dropped",
+                system::getFilename(recorder.path()).c_str(), recorder.bytesWritten / 1e6,
+                (unsigned long long) recorder.droppedRecords.load())));
+        } else {
+            menu->addChild(createMenuItem("Start recording", "", [=]() {
+                module->startRecording();
+            }));
+            if (!module->recordStatus.empty()) {
+                menu->addChild(createMenuLabel(module->recordStatus));
+            } else if (!recorder.path().empty()) {
+                std::string path = recorder.path();
+                menu->addChild(createMenuItem("Replay " + system::getFilename(path), "", [=]() {
+                    module->requestReplay(path);
+                    module->setSource(MuseHeadband::SOURCE_REPLAY);
+                }));
+            }
+        }
+        menu->addChild(createBoolMenuItem("Include outputs", "",
+            [=]() {
+                return module->recordOutputs.load();
+            },
+            [=](bool record) {
+                module->recordOutputs = record;
+            }
+        ));
+        menu->addChild(createMenuLabel(MuseHeadband::recordingDirectory()));
+    }
+
+    // "60 Hz notch, 1-40 Hz IIR", or "Off"
+    static std::string filterLabel(const FilterConfig& config) {
+        static const char* bandpassNames[BANDPASS_MODES_LEN] = {"", "IIR", "FIR"};
+        std::string label;
+        if (config.notch != NOTCH_OFF) {
+            label = config.notch == NOTCH_50HZ ? "50 Hz notch" : "60 Hz notch";
+        }
+        if (config.bandpass != BANDPASS_OFF) {
+            if (!label.empty()) label += ", ";
+            label += string::f("%g-%g Hz %s", config.low, config.high, bandpassNames[config.bandpass]);
+        }
+        return label.empty() ? "Off" : label;
+    }
+
+    static void appendFilterMenu(Menu* menu, MuseHeadband* module, int stream) {
+        auto update = [=](std::function<void(FilterConfig&)> change) {
+            FilterConfig config = module->getFilterConfig(stream);
+            change(config);
+            module->setFilterConfig(stream, config);
+        };
+        // PPG runs at 64 Hz, below any mains frequency
+        if (stream == MuseHeadband::FILTER_EEG) {
+            menu->addChild(createIndexSubmenuItem("Notch",
+                {"Off", "50 Hz", "60 Hz"},
+                [=]() {
+                    return (size_t) module->getFilterConfig(stream).notch;
+                },
+                [=](size_t notch) {
+                    update([=](FilterConfig& config) {
+                        config.notch = (NotchMode) notch;
+                    });
+                }
+            ));
+        }
+        menu->addChild(createIndexSubmenuItem("Bandpass",
+            {"Off", "IIR (Butterworth, low delay)", "FIR (linear phase)"},
+            [=]() {
+                return (size_t) module->getFilterConfig(stream).bandpass;
+            },
+            [=](size_t bandpass) {
+                update([=](FilterConfig& config) {
+                    config.bandpass = (BandpassMode) bandpass;
+                });
+            }
+        ));
+
+        // Passband presets; the first is the server's own filter
+        static const float eegEdges[3][2] = {{1.f, 40.f}, {0.5f, 45.f}, {4.f, 30.f}};
+        static const float ppgEdges[3][2] = {{1.f, 10.f}, {0.5f, 5.f}, {0.5f, 15.f}};
+        const float (*edges)[2] = stream == MuseHeadband::FILTER_EEG ? eegEdges : ppgEdges;
+        std::vector<std::string> edgeLabels;
+        for (int p = 0; p < 3; p++) {
+            edgeLabels.push_back(string::f("%g-%g Hz", edges[p][0], edges[p][1]));
+        }
+        menu->addChild(createIndexSubmenuItem("Passband", edgeLabels,
+            [=]() -> size_t {
+                FilterConfig config = module->getFilterConfig(stream);
+                for (size_t p = 0; p < 3; p++) {
+                    if (config.low == edges[p][0] && config.high == edges[p][1]) return p;
+                }
+                return (size_t) 0;
+            },
+            [=](size_t p) {
+                update([=](FilterConfig& config) {
+                    config.low = edges[p][0];
+                    config.high = edges[p][1];
+                });
+            }
+        ));
+
+        // Longer FIRs cut closer to the low edge but delay everything by half their length
+        static const int firTaps[] = {16, 32, 64, 128};
+        menu->addChild(createIndexSubmenuItem("FIR length",
+            {"16 taps", "32 taps", "64 taps", "128 taps"},
+            [=]() -> size_t {
+                int taps = module->getFilterConfig(stream).firTaps;
+                for (size_t i = 0; i < 4; i++) {
+                    if (firTaps[i] == taps) return i;
+                }
+                return (size_t) 1;
+            },
+            [=](size_t i) {
+                update([=](FilterConfig& config) {
+                    config.firTaps = firTaps[i];
+                });
+            }
+        ));
+        if (stream == MuseHeadband::FILTER_EEG && module->firDelay > 0.f) {
+            menu->addChild(createMenuLabel(string::f("FIR delay: %.0f ms", module->firDelay * 1000.f)));
+        }
+    }
+
+    static void appendArtifactMenu(Menu* menu, MuseHeadband* module) {
+        menu->addChild(createIndexSubmenuItem("Flagged samples",
+            {"Report only", "Hold out of stats and bands", "Gate"},
+            [=]() {
+                return (size_t) module->artifactHandling.load();
+            },
+            [=](size_t handling) {
+                module->artifactHandling = (int) handling;
+            }
+        ));
+        // Deviation from the baseline that counts as an artifact; blinks are typically 100-300 uV
+        static const float artifactLevels[] = {100.f, 150.f, 200.f, 300.f, 500.f};
+        menu->addChild(createIndexSubmenuItem("Artifact level",
+            {"100 uV", "150 uV", "200 uV", "300 uV", "500 uV"},
+            [=]() -> size_t {
+                float level = module->artifactLevel;
+                for (size_t i = 0; i < 5; i++) {
+                    if (artifactLevels[i] == level) return i;
+                }
+                return (size_t) 2;
+            },
+            [=](size_t i) {
+                module->artifactLevel = artifactLevels[i];
+            }
+        ));
+        std::string quality = "Clean samples:";
+        for (int i = 0; i < NUM_EEG_CHANNELS; i++) {
+            quality += string::f(" %.0f%%", module->eegQualityLevel[i] * 100.f);
+        }
+        menu->addChild(createMenuLabel(quality));
+    }
+
+    void appendContextMenu(Menu* menu) override {
+        MuseHeadband* module = getModule<MuseHeadband>();
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createIndexSubmenuItem("Buffer overflow",
+            {"Drop oldest", "Fast catch-up"},
+            [=]() {
+                return (size_t) module->overflowPolicy.load();
+            },
+            [=](size_t policy) {
+                module->overflowPolicy = (int) policy;
+            }
+        ));
+
+        menu->addChild(createIndexSubmenuItem("Source",
+            {"Server", "Replay"},
+            [=]() {
+                return (size_t) module->source.load();
+            },
+            [=](size_t source) {
+                module->setSource((int) source);
+            }
+        ));
+        if (module->source == MuseHeadband::SOURCE_REPLAY) {
+            appendReplayMenu(menu, module);
+        } else {
+            appendServerMenu(menu, module);
+        }
+        menu->addChild(createSubmenuItem("Record", module->recorder.recording() ? "Recording" : "", [=](Menu* menu) {
+            appendRecordMenu(menu, module);
+        }));
+
+        menu->addChild(createMenuLabel(string::f("Output latency: EEG %.0f ms, PPG %.0f ms, %d underruns",
+            module->outputLatency * 1000.f, module->ppgLatency * 1000.f, (int) module->outputUnderruns.load())));
+
+        menu->addChild(createSubmenuItem("Stats", "", [=](Menu* menu) {
+            std::shared_ptr<MuseHub> hub = module->getHub();
+            if (hub) {
+                menu->addChild(createMenuLabel(string::f("Messages: %llu, sequence gaps: %llu",
+                    (unsigned long long) hub->messagesReceived.load(), (unsigned long long) hub->sequenceGaps.load())));
+            }
+            menu->addChild(createMenuLabel(string::f("Dropped: %llu, underruns: %llu, resyncs: %llu",
+                (unsigned long long) (module->droppedFrames.load() + module->subscription.dropped.load()),
+                (unsigned long long) module->outputUnderruns.load(), (unsigned long long) module->outputResyncs.load())));
+            if (hub) {
+                menu->addChild(createMenuLabel(histogramLabel("Arrival jitter", hub->arrivalJitter, 1000.0, "ms")));
+                menu->addChild(createMenuLabel(histogramLabel("Parse time", hub->parseTime, 1.0, "us")));
+            }
+            menu->addChild(createMenuLabel(histogramLabel("Queue depth", module->queueDepth, 1.0, "frames")));
+            menu->addChild(createMenuLabel(histogramLabel("End-to-end latency", module->endToEndLatency, 1000.0, "ms")));
+            menu->addChild(new MenuSeparator);
+            menu->addChild(createBoolMenuItem("Dump stats to file", "",
+                [=]() {
+                    return module->statsDump.load();
+                },
+                [=](bool dump) {
+                    module->statsDump = dump;
+                }
+            ));
+            menu->addChild(createMenuLabel(MuseHeadband::statsPath()));
+            menu->addChild(createMenuItem("Reset stats", "", [=]() {
+                module->resetStats();
+            }));
+        }));
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createIndexSubmenuItem("Normalization",
+            {"Min/max over window", "Z-score (EWMA)", "5th-95th percentile"},
+            [=]() {
+                return (size_t) module->normalizationMode.load();
+            },
+            [=](size_t mode) {
+                module->normalizationMode = (int) mode;
+            }
+        ));
+        menu->addChild(createSubmenuItem("Artifacts", "", [=](Menu* menu) {
+            appendArtifactMenu(menu, module);
+        }));
+        menu->addChild(createSubmenuItem("EEG filter", filterLabel(module->getFilterConfig(MuseHeadband::FILTER_EEG)),
+            [=](Menu* menu) {
+                appendFilterMenu(menu, module, MuseHeadband::FILTER_EEG);
+            }
+        ));
+        menu->addChild(createSubmenuItem("PPG filter", filterLabel(module->getFilterConfig(MuseHeadband::FILTER_PPG)),
+            [=](Menu* menu) {
+                appendFilterMenu(menu, module, MuseHeadband::FILTER_PPG);
+            }
+        ));
+        menu->addChild(createIndexSubmenuItem("Heartbeat channel",
+            {"PPG 1", "PPG 2", "PPG 3"},
+            [=]() {
+                return (size_t) module->beatChannel.load();
+            },
+            [=](size_t channel) {
+                module->beatChannel = (int) channel;
+            }
+        ));
+        float bpm = module->displayBpm;
+        menu->addChild(createMenuLabel(bpm > 0.f ? string::f("Heart rate: %.0f BPM", bpm) : "Heart rate: -"));
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuLabel(string::f("Band latency: %.0f ms", module->bandLatency * 1000.f)));
+        menu->addChild(createIndexSubmenuItem("Band reduction",
+            {"Max", "Mean", "Sum"},
+            [=]() {
+                return (size_t) module->getBandConfig().reduction;
+            },
+            [=](size_t reduction) {
+                BandConfig config = module->getBandConfig();
+                config.reduction = (BandReduction) reduction;
+                module->setBandConfig(config);
+            }
+        ));
+
+        static const int hopSizes[] = {8, 16, 32, 64, 128};
+        menu->addChild(createIndexSubmenuItem("Band hop",
+            {"8 samples", "16 samples", "32 samples", "64 samples", "128 samples"},
+            [=]() -> size_t {
+                int hopSize = module->getBandConfig().hopSize;
+                for (size_t i = 0; i < 5; i++) {
+                    if (hopSizes[i] == hopSize) return i;
+                }
+                return (size_t) 2;
+            },
+            [=](size_t i) {
+                BandConfig config = module->getBandConfig();
+                config.hopSize = hopSizes[i];
+                module->setBandConfig(config);
+            }
+        ));
+        menu->addChild(createIndexSubmenuItem("Spectrum display channel",
+            {"CH 1", "CH 2", "CH 3", "CH 4", "CH 5"},
+            [=]() {
+                return (size_t) module->displayChannel.load();
+            },
+            [=](size_t channel) {
+                module->displayChannel = (int) channel;
+            }
+        ));
+
+        // In crossPairIndex() order
+        menu->addChild(createIndexSubmenuItem("Coherence pair",
+            {"TP9-AF7", "TP9-AF8", "TP9-TP10", "AF7-AF8", "AF7-TP10", "AF8-TP10"},
+            [=]() {
+                return (size_t) module->coherencePair.load();
+            },
+            [=](size_t pair) {
+                module->coherencePair = (int) pair;
+            }
+        ));
+        static const float crossSeconds[] = {1.f, 2.f, 5.f, 10.f, 30.f};
+        menu->addChild(createIndexSubmenuItem("Coherence averaging",
+            {"1 s", "2 s", "5 s", "10 s", "30 s"},
+            [=]() -> size_t {
+                float seconds = module->getBandConfig().crossSeconds;
+                for (size_t i = 0; i < 5; i++) {
+                    if (crossSeconds[i] == seconds) return i;
+                }
+                return (size_t) 2;
+            },
+            [=](size_t i) {
+                BandConfig config = module->getBandConfig();
+                config.crossSeconds = crossSeconds[i];
+                module->setBandConfig(config);
+            }
+        ));
+
+        // Band edge presets: lib/fft.py, and the ranges printed on the panel
+        static const float presetEdges[2][NUM_BANDS + 1] = {
+            {1.f, 4.f, 8.f, 12.f, 30.f, 80.f},
+            {1.f, 4.f, 8.f, 13.f, 32.f, 100.f},
+        };
+        menu->addChild(createIndexSubmenuItem("Band edges",
+            {"1-4-8-12-30-80 Hz", "1-4-8-13-32-100 Hz"},
+            [=]() -> size_t {
+                BandConfig config = module->getBandConfig();
+                for (size_t p = 0; p < 2; p++) {
+                    bool match = true;
+                    for (int b = 0; b < NUM_BANDS; b++) {
+                        match &= (config.low[b] == presetEdges[p][b] && config.high[b] == presetEdges[p][b + 1]);
+                    }
+                    if (match) return p;
+                }
+                return (size_t) 0;
+            },
+            [=](size_t p) {
+                BandConfig config = module->getBandConfig();
+                for (int b = 0; b < NUM_BANDS; b++) {
+                    config.low[b] = presetEdges[p][b];
+                    config.high[b] = presetEdges[p][b + 1];
+                }
+                module->setBandConfig(config);
+            }
+        ));
     }
 };
 
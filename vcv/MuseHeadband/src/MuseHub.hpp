@@ -0,0 +1,369 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "WebSocket.hpp"
+#include "SampleRing.hpp"
+#include "MuseProtocol.hpp"
+#include "MuseJson.hpp"
+#include "Metrics.hpp"
+
+// Frames delivered to one subscriber of a MuseHub
+struct HubSubscription {
+    SpscRing<MuseFrame, 1024> frames;
+    // Signalled after each batch of frames and whenever the connection state changes
+    easywsclient::Wakeup* wakeup = nullptr;
+    // Frames overwritten before the subscriber drained them
+    std::atomic<uint64_t> dropped{0};
+    // What this subscriber needs from the server, a packed StreamSubscription. Call
+    // MuseHub::updateSubscription() after changing it.
+    std::atomic<uint32_t> streams{StreamSubscription().pack()};
+};
+
+// One server connection, shared by every module using the same endpoint.
+//
+// acquire() returns the hub for a URL, starting it on first use; it closes
+// when the last reference goes. The hub's thread connects with backoff,
+// decodes each message once and copies every frame into each subscriber's
+// ring, so N modules cost one socket and one parse rather than N. The
+// server streams one headband per URL (see deviceUrl()), so each headband
+// in use gets its own hub and decodes on its own thread. Subscribers
+// drain their ring on their own thread; the hub never waits on them and
+// overwrites the oldest frame of a subscriber that falls behind.
+//
+// The hub asks the server for what its subscribers need between them (see
+// StreamSubscription), on connect and whenever that changes, so channels and
+// rates nobody uses aren't sent.
+class MuseHub {
+public:
+    // Reconnect backoff, doubling from MIN_BACKOFF_MS after each failed attempt
+    static const int MIN_BACKOFF_MS = 250;
+    static const int MAX_BACKOFF_MS = 8000;
+    static const int CONNECT_TIMEOUT_MS = 2000;
+    static const int EEG_SAMPLE_RATE = 256;
+    static const int PPG_SAMPLE_RATE = 64;
+
+    const std::string url;
+
+    std::atomic<bool> connected{false};
+    // PPG's rate as this server delivers it: servers that collate PPG onto every
+    // EEG sample deliver it at EEG_SAMPLE_RATE instead of its native rate
+    std::atomic<float> ppgSampleRate{(float) PPG_SAMPLE_RATE};
+
+    // Connection instrumentation, written by the hub's thread
+    Histogram arrivalJitter; // change in transit time between messages, us
+    Histogram parseTime;     // decode time per message, us
+    std::atomic<uint64_t> messagesReceived{0};
+    std::atomic<uint64_t> sequenceGaps{0};
+
+    // The URL for `device` (an ID from the device list) on the server at
+    // `endpoint`; an empty ID is the server's first headband
+    static std::string deviceUrl(const std::string& endpoint, const std::string& device) {
+        std::string url = endpoint;
+        while (!url.empty() && url.back() == '/') {
+            url.pop_back();
+        }
+        if (device.empty()) {
+            return url;
+        }
+        url += '/';
+        for (unsigned char c : device) {
+            if (isalnum(c) || strchr("-._~:", c)) {
+                url += c;
+            } else {
+                char escaped[4];
+                snprintf(escaped, sizeof(escaped), "%%%02X", c);
+                url += escaped;
+            }
+        }
+        return url;
+    }
+
+    static std::shared_ptr<MuseHub> acquire(const std::string& url) {
+        static std::mutex registryMutex;
+        static std::map<std::string, std::weak_ptr<MuseHub>> registry;
+        std::lock_guard<std::mutex> lock(registryMutex);
+        std::shared_ptr<MuseHub> hub = registry[url].lock();
+        if (!hub) {
+            hub = std::make_shared<MuseHub>(url);
+            registry[url] = hub;
+        }
+        // Forget endpoints nobody uses any more
+        for (auto it = registry.begin(); it != registry.end();) {
+            if (it->second.expired()) {
+                it = registry.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return hub;
+    }
+
+    // Use acquire() rather than constructing hubs directly
+    explicit MuseHub(const std::string& url) : url(url) {
+        thread = std::thread([this]() {
+            run();
+        });
+    }
+
+    ~MuseHub() {
+        running = false;
+        stopWakeup.signal();
+        wakeup.signal();
+        if (thread.joinable()) {
+            thread.join();
+        }
+        if (ws) {
+            ws->close();
+        }
+    }
+
+    void subscribe(HubSubscription* subscription) {
+        {
+            std::lock_guard<std::mutex> lock(subscribersMutex);
+            subscribers.push_back(subscription);
+            subscription->wakeup->signal();
+        }
+        updateSubscription();
+    }
+
+    // Once this returns the hub no longer touches `subscription`
+    void unsubscribe(HubSubscription* subscription) {
+        {
+            std::lock_guard<std::mutex> lock(subscribersMutex);
+            subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), subscription), subscribers.end());
+        }
+        updateSubscription();
+    }
+
+    // Ask the server again for what the subscribers need, after one of them changed
+    // `streams`. Only an open connection is woken: the next one asks on connect anyway.
+    void updateSubscription() {
+        subscriptionChanged = true;
+        wakeup.signal();
+    }
+
+    size_t subscriberCount() {
+        std::lock_guard<std::mutex> lock(subscribersMutex);
+        return subscribers.size();
+    }
+
+    // The headbands the server last announced
+    std::vector<MuseDevice> getDevices() {
+        std::lock_guard<std::mutex> lock(devicesMutex);
+        return devices;
+    }
+
+private:
+    std::atomic<bool> running{true};
+    // Interrupts connecting and the backoff between attempts, only on shutdown, so
+    // the destructor doesn't block on I/O
+    easywsclient::Wakeup stopWakeup;
+    // Interrupts the wait for data on an open connection, to send a new
+    // subscription or to shut down
+    easywsclient::Wakeup wakeup;
+    std::thread thread;
+    std::unique_ptr<easywsclient::WebSocket> ws;
+    std::mutex subscribersMutex;
+    std::vector<HubSubscription*> subscribers; // guarded by subscribersMutex
+    std::mutex devicesMutex;
+    std::vector<MuseDevice> devices; // guarded by devicesMutex
+    // Last binary message sequence number
+    uint32_t lastSequence = 0;
+    bool haveSequence = false;
+    std::atomic<bool> subscriptionChanged{true};
+
+    void run() {
+        int backoffMs = MIN_BACKOFF_MS;
+        // Transit time (arrival minus source timestamp) of the last message carrying EEG, for arrivalJitter
+        double lastTransit = 0.0;
+        double lastEegTimestamp = 0.0;
+        bool haveTransit = false;
+        while (running) {
+            // updateSubscription() signals too; clear that so the wait for data blocks again
+            wakeup.clear();
+            if (!running) break;
+            if (!ws || ws->getReadyState() != easywsclient::OPEN) {
+                ws.reset(easywsclient::WebSocket::create_connection(url, BINARY_SUBPROTOCOL,
+                    stopWakeup.fd(), CONNECT_TIMEOUT_MS));
+                setConnected(ws != nullptr);
+                haveSequence = false;
+                haveTransit = false;
+                if (ws) {
+                    INFO("Connected to Muse Headband server %s (%s protocol)", url.c_str(),
+                        ws->getProtocol() == BINARY_SUBPROTOCOL ? "binary" : "JSON");
+                    backoffMs = MIN_BACKOFF_MS;
+                    subscriptionChanged = true;
+                } else {
+                    if (!running) break;
+                    WARN("Failed to connect to Muse Headband server %s, retrying in %d ms", url.c_str(), backoffMs);
+                    stopWakeup.wait(backoffMs);
+                    backoffMs = std::min(backoffMs * 2, (int) MAX_BACKOFF_MS);
+                    continue;
+                }
+            }
+
+            if (subscriptionChanged.exchange(false)) {
+                sendSubscription();
+            }
+
+            // Sleep until the socket has data; the timeout only bounds how long a missed wakeup could stall
+            if (!ws->wait(wakeup.fd(), 1000)) {
+                continue;
+            }
+
+            // Every complete message in the socket, straight out of its buffer, to every subscriber
+            int received;
+            {
+                std::lock_guard<std::mutex> lock(subscribersMutex);
+                received = ws->receive([&](const easywsclient::Message& message) {
+                    double arrival = steadyTime();
+                    double eegTimestamp = lastEegTimestamp;
+                    if (message.opcode == easywsclient::BINARY_FRAME) {
+                        if (parseBinaryData(message.data, message.size, arrival, eegTimestamp) == 0) {
+                            WARN("Invalid binary message (%d bytes)", (int) message.size);
+                        }
+                    } else if (message.opcode == easywsclient::TEXT_FRAME) {
+                        const char* json = (const char*) message.data;
+
+                        // Check if we have a complete JSON message
+                        if (message.size == 0 ||
+                            json[0] != '{' ||
+                            json[message.size - 1] != '}') {
+                            WARN("Invalid JSON message: %.*s", (int) message.size, json);
+                            return;
+                        }
+                        if (isDeviceList(json, message.size)) {
+                            updateDevices(json, message.size);
+                            return;
+                        }
+                        parseMuseData(json, message.size, arrival, eegTimestamp);
+                    } else {
+                        return;
+                    }
+                    parseTime.recordMicros(steadyTime() - arrival);
+                    messagesReceived.fetch_add(1, std::memory_order_relaxed);
+
+                    // Jitter is how much the transit time moved since the last message carrying EEG
+                    if (eegTimestamp != lastEegTimestamp) {
+                        double transit = arrival - eegTimestamp;
+                        if (haveTransit) {
+                            arrivalJitter.recordMicros(std::fabs(transit - lastTransit));
+                        }
+                        lastTransit = transit;
+                        lastEegTimestamp = eegTimestamp;
+                        haveTransit = true;
+                    }
+                });
+                for (HubSubscription* subscription : subscribers) {
+                    subscription->wakeup->signal();
+                }
+            }
+            if (received < 0) {
+                WARN("Lost connection to Muse Headband server %s", url.c_str());
+                setConnected(false);
+            }
+        }
+        setConnected(false);
+    }
+
+    void setConnected(bool state) {
+        connected = state;
+        std::lock_guard<std::mutex> lock(subscribersMutex);
+        for (HubSubscription* subscription : subscribers) {
+            subscription->wakeup->signal();
+        }
+    }
+
+    // Tell the server what the subscribers need between them. Until the first one
+    // arrives the server's default, everything, stands.
+    void sendSubscription() {
+        StreamSubscription needed = StreamSubscription::none();
+        {
+            std::lock_guard<std::mutex> lock(subscribersMutex);
+            if (subscribers.empty()) return;
+            for (HubSubscription* subscription : subscribers) {
+                needed.merge(StreamSubscription::unpack(subscription->streams.load()));
+            }
+        }
+        std::string message = needed.toJson();
+        ws->send(message);
+        // The server numbers each subscription's messages separately
+        haveSequence = false;
+        INFO("Subscribed to %s: %s", url.c_str(), message.c_str());
+    }
+
+    void updateDevices(const char* json, size_t len) {
+        std::vector<MuseDevice> list;
+        const char* error = parseDeviceList(json, len, list);
+        if (error) {
+            WARN("%s: %.*s", error, (int) len, json);
+            return;
+        }
+        INFO("Server %s has %d headband%s", url.c_str(), (int) list.size(), list.size() == 1 ? "" : "s");
+        std::lock_guard<std::mutex> lock(devicesMutex);
+        devices.swap(list);
+    }
+
+    // Called with subscribersMutex held
+    void deliver(const MuseFrame& frame, double& eegTimestamp) {
+        if (frame.hasEeg) {
+            eegTimestamp = frame.timestamp;
+        }
+        for (HubSubscription* subscription : subscribers) {
+            if (subscription->frames.pushOverwrite(frame)) {
+                subscription->dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Decode a batch of samples in the binary protocol. Returns the number of
+    // samples decoded, 0 if the message is malformed.
+    int parseBinaryData(const uint8_t* data, size_t len, double arrival, double& eegTimestamp) {
+        BinaryHeader header;
+        size_t samples = decodeBinaryMessage(data, len, arrival, header, [&](const MuseFrame& frame) {
+            deliver(frame, eegTimestamp);
+        });
+        if (samples > 0) {
+            if (header.ppgChannels > 0) {
+                ppgSampleRate = header.sampleRate;
+            }
+            if (haveSequence && header.sequence != lastSequence + 1) {
+                WARN("Binary message sequence jumped from %u to %u", lastSequence, header.sequence);
+                sequenceGaps.fetch_add(1, std::memory_order_relaxed);
+            }
+            lastSequence = header.sequence;
+            haveSequence = true;
+        }
+        return samples;
+    }
+
+    // Decode one JSON sample (MuseJson.hpp). Returns false if the message holds no usable sample.
+    bool parseMuseData(const char* json, size_t len, double arrival, double& eegTimestamp) {
+        MuseFrame frame;
+        frame.arrivalTime = arrival;
+        float sampleRate = 0.f;
+        const char* error = parseJsonSample(json, len, frame, &sampleRate);
+        if (error) {
+            WARN("%s: %.*s", error, (int) len, json);
+            return false;
+        }
+        // Older servers attach the nearest PPG sample to every EEG sample; a decimated stream states its rate
+        if (frame.hasPpg) {
+            ppgSampleRate = frame.hasEeg ? (float) EEG_SAMPLE_RATE :
+                sampleRate > 0.f ? sampleRate : (float) PPG_SAMPLE_RATE;
+        }
+        deliver(frame, eegTimestamp);
+        return true;
+    }
+};
@@ -0,0 +1,365 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <jansson.h>
+
+#include "SampleRing.hpp"
+
+// JSON sample protocol, sent by lib/livestream.py to clients that don't
+// negotiate the binary one:
+//
+//   {"timestamp": t, "eeg_channels": [...]}  or  {"timestamp": t, "ppg_channels": [...]}
+//
+// Older servers send both arrays in one message, and newer ones add
+// "device": id. A client that subscribed to some of a stream's channels
+// (StreamSubscription in MuseProtocol.hpp) gets only those, named by
+// "channels": [indices], and a decimated stream states its rate in
+// "sample_rate". parseJsonSample() reads that shape in one pass without
+// allocating (JsonCursor below) and hands anything else to jansson.
+
+// Cursor over a message for the fast path. Each read returns false on
+// anything it doesn't expect, and the caller gives up on the message.
+struct JsonCursor {
+    const char* p;
+    const char* end;
+
+    void skipSpace() {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) p++;
+    }
+
+    bool consume(char c) {
+        skipSpace();
+        if (p < end && *p == c) {
+            p++;
+            return true;
+        }
+        return false;
+    }
+
+    bool peek(char c) {
+        skipSpace();
+        return p < end && *p == c;
+    }
+
+    // A key without escapes, as [start, start + len)
+    bool key(const char*& start, size_t& len) {
+        if (!consume('"')) return false;
+        start = p;
+        while (p < end && *p != '"') {
+            if (*p == '\\') return false;
+            p++;
+        }
+        if (p == end) return false;
+        len = p - start;
+        p++;
+        return consume(':');
+    }
+
+    bool skipString() {
+        if (!consume('"')) return false;
+        while (p < end && *p != '"') {
+            p += *p == '\\' ? 2 : 1;
+        }
+        if (p >= end) return false;
+        p++;
+        return true;
+    }
+
+    // A JSON number. Keeps up to 19 significant digits and scales them by a power
+    // of ten: exact for up to 15 digits and exponents within 1e+-22, otherwise
+    // within a few ulps of strtod(), far finer than the floats samples end up in.
+    bool number(double& value) {
+        static const double POWERS[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+        };
+        skipSpace();
+        bool negative = p < end && *p == '-';
+        if (negative) p++;
+        if (p == end || *p < '0' || *p > '9') return false;
+        uint64_t mantissa = 0;
+        int digits = 0;
+        int exponent = 0;
+        if (*p == '0') {
+            p++;
+        } else {
+            for (; p < end && *p >= '0' && *p <= '9'; p++) {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    digits++;
+                } else {
+                    exponent++;
+                }
+            }
+        }
+        if (p < end && *p == '.') {
+            p++;
+            if (p == end || *p < '0' || *p > '9') return false;
+            for (; p < end && *p >= '0' && *p <= '9'; p++) {
+                if (digits < 19 && (mantissa > 0 || *p != '0')) {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    digits++;
+                    exponent--;
+                } else if (mantissa == 0) {
+                    exponent--;
+                }
+            }
+        }
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            p++;
+            bool negativeExponent = p < end && *p == '-';
+            if (p < end && (*p == '-' || *p == '+')) p++;
+            if (p == end || *p < '0' || *p > '9') return false;
+            int e = 0;
+            for (; p < end && *p >= '0' && *p <= '9'; p++) {
+                e = std::min(e * 10 + (*p - '0'), 10000);
+            }
+            exponent += negativeExponent ? -e : e;
+        }
+        double v = (double) mantissa;
+        if (exponent >= 0 && exponent <= 22) {
+            v *= POWERS[exponent];
+        } else if (exponent < 0 && exponent >= -22) {
+            v /= POWERS[-exponent];
+        } else {
+            v *= std::pow(10.0, exponent);
+        }
+        value = negative ? -v : v;
+        return true;
+    }
+
+    // An array of numbers, keeping the first `count` in `values`. Sets `found` to how many were kept.
+    bool numbers(float* values, int count, int& found) {
+        if (!consume('[')) return false;
+        found = 0;
+        if (consume(']')) return true;
+        do {
+            double value;
+            if (!number(value)) return false;
+            if (found < count) {
+                values[found++] = (float) value;
+            }
+        } while (consume(','));
+        return consume(']');
+    }
+};
+
+// Most channels a message can carry: one bit each in a StreamSubscription mask
+static const int MAX_JSON_CHANNELS = 8;
+
+// Put the `count` values of a message's array into `out`, at the indices in
+// `indices` when the message names them (`indexCount` >= 0) and in order
+// otherwise. Sets `missing` to the channels left out. Returns false on a bad index list.
+inline bool placeChannels(const float* values, int count, const float* indices, int indexCount,
+    float* out, int channels, uint8_t& missing) {
+    uint8_t present = 0;
+    if (indexCount < 0) {
+        for (int c = 0; c < std::min(count, channels); c++) {
+            out[c] = values[c];
+            present |= 1 << c;
+        }
+    } else {
+        if (indexCount != count) return false;
+        for (int i = 0; i < count; i++) {
+            float index = indices[i];
+            if (!(index >= 0.f && index < MAX_JSON_CHANNELS) || index != std::floor(index)) return false;
+            int c = (int) index;
+            if (c < channels) {
+                out[c] = values[i];
+                present |= 1 << c;
+            }
+        }
+    }
+    missing = (uint8_t) (~present & ((1 << channels) - 1));
+    return true;
+}
+
+// The fast path: parse the known shape into `frame`, and the stream's rate into
+// `sampleRate` if the message states it. Returns false for anything else (other
+// keys, escapes, bad syntax), leaving `frame` as it was.
+inline bool parseJsonSampleFast(const char* json, size_t len, MuseFrame& frame, float* sampleRate = nullptr) {
+    JsonCursor cursor{json, json + len};
+    MuseFrame parsed = frame;
+    bool hasTimestamp = false;
+    float eeg[MAX_JSON_CHANNELS];
+    float ppg[MAX_JSON_CHANNELS];
+    float channels[MAX_JSON_CHANNELS];
+    int eegCount = 0;
+    int ppgCount = 0;
+    int channelCount = -1;
+    double rate = 0.0;
+    if (!cursor.consume('{')) return false;
+    if (!cursor.peek('}')) {
+        do {
+            const char* key;
+            size_t keyLen;
+            if (!cursor.key(key, keyLen)) return false;
+            if (keyLen == 9 && !memcmp(key, "timestamp", 9)) {
+                if (!cursor.number(parsed.timestamp)) return false;
+                hasTimestamp = true;
+            } else if (keyLen == 12 && !memcmp(key, "eeg_channels", 12)) {
+                if (!cursor.numbers(eeg, MAX_JSON_CHANNELS, eegCount)) return false;
+                parsed.hasEeg = true;
+            } else if (keyLen == 12 && !memcmp(key, "ppg_channels", 12)) {
+                if (!cursor.numbers(ppg, MAX_JSON_CHANNELS, ppgCount)) return false;
+                parsed.hasPpg = true;
+            } else if (keyLen == 8 && !memcmp(key, "channels", 8)) {
+                if (!cursor.numbers(channels, MAX_JSON_CHANNELS, channelCount)) return false;
+            } else if (keyLen == 11 && !memcmp(key, "sample_rate", 11)) {
+                if (!cursor.number(rate)) return false;
+            } else if (keyLen == 6 && !memcmp(key, "device", 6)) {
+                if (!cursor.skipString()) return false;
+            } else {
+                return false;
+            }
+        } while (cursor.consume(','));
+    }
+    if (!cursor.consume('}')) return false;
+    cursor.skipSpace();
+    if (cursor.p != cursor.end || !hasTimestamp || (!parsed.hasEeg && !parsed.hasPpg)) return false;
+    // "channels" names the channels of a message's only array
+    if (channelCount >= 0 && parsed.hasEeg && parsed.hasPpg) return false;
+    if (parsed.hasEeg && !placeChannels(eeg, eegCount, channels, channelCount, parsed.eeg, NUM_EEG_CHANNELS, parsed.eegMissing)) {
+        return false;
+    }
+    if (parsed.hasPpg && !placeChannels(ppg, ppgCount, channels, channelCount, parsed.ppg, NUM_PPG_CHANNELS, parsed.ppgMissing)) {
+        return false;
+    }
+    frame = parsed;
+    if (sampleRate && rate > 0.0) {
+        *sampleRate = (float) rate;
+    }
+    return true;
+}
+
+// Read a JSON array of numbers into `values`, keeping the first MAX_JSON_CHANNELS.
+// Returns the number kept, -1 if an element isn't a number.
+inline int jsonChannelValues(json_t* array, float* values) {
+    int count = (int) std::min(json_array_size(array), (size_t) MAX_JSON_CHANNELS);
+    for (int i = 0; i < count; i++) {
+        json_t* value = json_array_get(array, i);
+        if (!json_is_number(value)) {
+            return -1;
+        }
+        values[i] = json_number_value(value);
+    }
+    return count;
+}
+
+// Parse one message into `frame`, setting hasEeg / hasPpg for the arrays
+// present, and the stream's rate into `sampleRate` if the message states it.
+// Returns nullptr on success, otherwise what was wrong with the message.
+inline const char* parseJsonSampleJansson(const char* json, size_t len, MuseFrame& frame, float* sampleRate = nullptr) {
+    json_error_t error;
+    json_t* root = json_loadb(json, len, 0, &error);
+    if (!root) {
+        return "Failed to parse JSON";
+    }
+
+    const char* problem = nullptr;
+    json_t* timestamp = json_object_get(root, "timestamp");
+    json_t* eeg_channels = json_object_get(root, "eeg_channels");
+    json_t* ppg_channels = json_object_get(root, "ppg_channels");
+    json_t* channels = json_object_get(root, "channels");
+    json_t* sample_rate = json_object_get(root, "sample_rate");
+    if (!json_is_number(timestamp)) {
+        problem = "Invalid timestamp in JSON";
+    } else {
+        frame.timestamp = json_number_value(timestamp);
+    }
+
+    float indices[MAX_JSON_CHANNELS];
+    int indexCount = -1;
+    if (!problem && channels) {
+        indexCount = json_is_array(channels) ? jsonChannelValues(channels, indices) : -1;
+        if (indexCount < 0 || (json_is_array(eeg_channels) && json_is_array(ppg_channels))) {
+            problem = "Invalid channel list in JSON";
+        }
+    }
+
+    float values[MAX_JSON_CHANNELS];
+    if (!problem && json_is_array(eeg_channels)) {
+        int count = jsonChannelValues(eeg_channels, values);
+        if (count < 0) {
+            problem = "Invalid EEG sample value";
+        } else if (!placeChannels(values, count, indices, indexCount, frame.eeg, NUM_EEG_CHANNELS, frame.eegMissing)) {
+            problem = "Invalid channel list in JSON";
+        }
+        frame.hasEeg = !problem;
+    }
+
+    if (!problem && json_is_array(ppg_channels)) {
+        int count = jsonChannelValues(ppg_channels, values);
+        if (count < 0) {
+            problem = "Invalid PPG sample value";
+        } else if (!placeChannels(values, count, indices, indexCount, frame.ppg, NUM_PPG_CHANNELS, frame.ppgMissing)) {
+            problem = "Invalid channel list in JSON";
+        }
+        frame.hasPpg = !problem;
+    }
+
+    if (!problem && !frame.hasEeg && !frame.hasPpg) {
+        problem = "No EEG or PPG channels found in JSON";
+    }
+    if (!problem && sampleRate && json_number_value(sample_rate) > 0.0) {
+        *sampleRate = json_number_value(sample_rate);
+    }
+    json_decref(root);
+    return problem;
+}
+
+inline const char* parseJsonSample(const char* json, size_t len, MuseFrame& frame, float* sampleRate = nullptr) {
+    if (parseJsonSampleFast(json, len, frame, sampleRate)) {
+        return nullptr;
+    }
+    return parseJsonSampleJansson(json, len, frame, sampleRate);
+}
+
+// A headband the server streams, from its device list
+struct MuseDevice {
+    int index = 0;
+    std::string id;
+    std::string name;
+};
+
+// The server announces its headbands on connect and whenever one appears:
+//
+//   {"devices": [{"index": 0, "id": "Muse00:55:DA:B0:12:34", "name": "Muse-1234"}, ...]}
+inline bool isDeviceList(const char* json, size_t len) {
+    static const char prefix[] = "{\"devices\"";
+    return len >= sizeof(prefix) - 1 && memcmp(json, prefix, sizeof(prefix) - 1) == 0;
+}
+
+// Parse a device list into `devices`. Returns nullptr on success, otherwise what was wrong.
+inline const char* parseDeviceList(const char* json, size_t len, std::vector<MuseDevice>& devices) {
+    json_error_t error;
+    json_t* root = json_loadb(json, len, 0, &error);
+    if (!root) {
+        return "Failed to parse JSON";
+    }
+    const char* problem = nullptr;
+    json_t* list = json_object_get(root, "devices");
+    if (!json_is_array(list)) {
+        problem = "Invalid device list";
+    } else {
+        devices.clear();
+        for (size_t i = 0; i < json_array_size(list); i++) {
+            json_t* entry = json_array_get(list, i);
+            json_t* id = json_object_get(entry, "id");
+            if (!json_is_string(id)) continue;
+            MuseDevice device;
+            device.index = json_integer_value(json_object_get(entry, "index"));
+            device.id = json_string_value(id);
+            json_t* name = json_object_get(entry, "name");
+            device.name = json_is_string(name) ? json_string_value(name) : device.id;
+            devices.push_back(device);
+        }
+    }
+    json_decref(root);
+    return problem;
+}
@@ -0,0 +1,255 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "SampleRing.hpp"
+
+// Binary sample protocol, negotiated with the "muse-binary-v1" WebSocket
+// subprotocol. Servers that don't offer it keep sending one JSON text frame
+// per sample. Encoder: lib/protocol.py
+//
+// Every binary message is one little-endian header followed by `sampleCount`
+// rows of float32 values. Each row is [dt] eeg[eegChannels] ppg[ppgChannels],
+// where dt (seconds after firstTimestamp) is present only with
+// FLAG_SAMPLE_TIMES; otherwise sample i is at firstTimestamp + i / sampleRate.
+// The server sends EEG and PPG in separate messages (the other channel count is
+// 0), each at its own sampleRate: the native one divided by the decimation the
+// client subscribed to.
+//
+// With FLAG_CHANNEL_MASKS the header is followed by two bytes, the EEG and PPG
+// channel masks, and the rows carry only the channels whose bits are set, in
+// order. Without it every channel is present.
+static const char* const BINARY_SUBPROTOCOL = "muse-binary-v1";
+static const uint8_t BINARY_MAGIC_0 = 'M';
+static const uint8_t BINARY_MAGIC_1 = 'B';
+static const uint8_t BINARY_VERSION = 1;
+static const uint8_t FLAG_SAMPLE_TIMES = 0x01;
+static const uint8_t FLAG_CHANNEL_MASKS = 0x02;
+
+static const size_t BINARY_HEADER_SIZE = 24;
+static const size_t CHANNEL_MASKS_SIZE = 2;
+
+// What a client asks the server for: which channels of each stream, and how many
+// samples to average into one. Sent as a text message on connect and whenever it
+// changes:
+//
+//   {"subscribe": {"eeg": [0, 1, 2, 3], "ppg": [1], "eeg_decimation": 1, "ppg_decimation": 2}}
+//
+// The server then leaves the other channels out of what it sends this client.
+// Servers that don't know the message ignore it and keep sending everything.
+struct StreamSubscription {
+    // The server rejects anything larger, see MAX_DECIMATION in lib/protocol.py
+    static const int MAX_DECIMATION = 16;
+
+    // Bit c for channel c
+    uint8_t eegChannels = (1 << NUM_EEG_CHANNELS) - 1;
+    uint8_t ppgChannels = (1 << NUM_PPG_CHANNELS) - 1;
+    uint8_t eegDecimation = 1;
+    uint8_t ppgDecimation = 1;
+
+    static StreamSubscription none() {
+        StreamSubscription subscription;
+        subscription.eegChannels = 0;
+        subscription.ppgChannels = 0;
+        return subscription;
+    }
+
+    // Widen this to cover `other` too: the union of the channels, at the finer decimation of each stream
+    void merge(const StreamSubscription& other) {
+        if (other.eegChannels) {
+            eegDecimation = eegChannels ? std::min(eegDecimation, other.eegDecimation) : other.eegDecimation;
+        }
+        if (other.ppgChannels) {
+            ppgDecimation = ppgChannels ? std::min(ppgDecimation, other.ppgDecimation) : other.ppgDecimation;
+        }
+        eegChannels |= other.eegChannels;
+        ppgChannels |= other.ppgChannels;
+    }
+
+    // Packed into one word so it can travel through an atomic
+    uint32_t pack() const {
+        return (uint32_t) eegChannels | ((uint32_t) ppgChannels << 8) |
+            ((uint32_t) eegDecimation << 16) | ((uint32_t) ppgDecimation << 24);
+    }
+
+    static StreamSubscription unpack(uint32_t packed) {
+        StreamSubscription subscription;
+        subscription.eegChannels = packed & 0xFF;
+        subscription.ppgChannels = (packed >> 8) & 0xFF;
+        subscription.eegDecimation = clampDecimation((packed >> 16) & 0xFF);
+        subscription.ppgDecimation = clampDecimation((packed >> 24) & 0xFF);
+        return subscription;
+    }
+
+    bool operator==(const StreamSubscription& other) const {
+        return pack() == other.pack();
+    }
+
+    bool operator!=(const StreamSubscription& other) const {
+        return pack() != other.pack();
+    }
+
+    // The control message
+    std::string toJson() const {
+        std::string json = "{\"subscribe\": {\"eeg\": " + channelList(eegChannels, NUM_EEG_CHANNELS) +
+            ", \"ppg\": " + channelList(ppgChannels, NUM_PPG_CHANNELS);
+        char decimation[64];
+        snprintf(decimation, sizeof(decimation), ", \"eeg_decimation\": %d, \"ppg_decimation\": %d}}",
+            (int) clampDecimation(eegDecimation), (int) clampDecimation(ppgDecimation));
+        return json + decimation;
+    }
+
+private:
+    static uint8_t clampDecimation(int decimation) {
+        return (uint8_t) std::min(std::max(decimation, 1), (int) MAX_DECIMATION);
+    }
+
+    static std::string channelList(uint8_t mask, int channels) {
+        std::string list = "[";
+        for (int c = 0; c < channels; c++) {
+            if (!(mask & (1 << c))) continue;
+            if (list.size() > 1) {
+                list += ", ";
+            }
+            list += (char) ('0' + c);
+        }
+        return list + "]";
+    }
+};
+
+struct BinaryHeader {
+    uint8_t version;
+    uint8_t flags;
+    uint8_t eegChannels;
+    uint8_t ppgChannels;
+    uint16_t sampleCount;
+    float sampleRate;
+    uint32_t sequence;
+    double firstTimestamp;
+    // Which channels the rows carry: every channel unless FLAG_CHANNEL_MASKS is set
+    uint8_t eegMask;
+    uint8_t ppgMask;
+    // Offset of the first row
+    size_t rowsOffset;
+};
+
+inline int countBits(uint8_t mask) {
+    int count = 0;
+    for (; mask; mask &= mask - 1) {
+        count++;
+    }
+    return count;
+}
+
+inline uint16_t readU16LE(const uint8_t* p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+inline uint32_t readU32LE(const uint8_t* p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+inline float readF32LE(const uint8_t* p) {
+    uint32_t bits = readU32LE(p);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+inline double readF64LE(const uint8_t* p) {
+    uint64_t bits = (uint64_t) readU32LE(p) | ((uint64_t) readU32LE(p + 4) << 32);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+// Parse and validate the header. Returns false if `data` isn't a complete v1 message.
+inline bool parseBinaryHeader(const uint8_t* data, size_t len, BinaryHeader& header) {
+    if (len < BINARY_HEADER_SIZE || data[0] != BINARY_MAGIC_0 || data[1] != BINARY_MAGIC_1) {
+        return false;
+    }
+    header.version = data[2];
+    header.flags = data[3];
+    header.eegChannels = data[4];
+    header.ppgChannels = data[5];
+    header.sampleCount = readU16LE(data + 6);
+    header.sampleRate = readF32LE(data + 8);
+    header.sequence = readU32LE(data + 12);
+    header.firstTimestamp = readF64LE(data + 16);
+    if (header.version != BINARY_VERSION || !(header.sampleRate > 0.f)) {
+        return false;
+    }
+    header.rowsOffset = BINARY_HEADER_SIZE;
+    if (header.flags & FLAG_CHANNEL_MASKS) {
+        if (len < BINARY_HEADER_SIZE + CHANNEL_MASKS_SIZE) {
+            return false;
+        }
+        header.eegMask = data[BINARY_HEADER_SIZE];
+        header.ppgMask = data[BINARY_HEADER_SIZE + 1];
+        header.rowsOffset += CHANNEL_MASKS_SIZE;
+        if (countBits(header.eegMask) != header.eegChannels || countBits(header.ppgMask) != header.ppgChannels) {
+            return false;
+        }
+    } else {
+        // Channels beyond the 8 a mask can name are skipped anyway
+        header.eegMask = (uint8_t) ((1u << std::min((int) header.eegChannels, 8)) - 1);
+        header.ppgMask = (uint8_t) ((1u << std::min((int) header.ppgChannels, 8)) - 1);
+    }
+    size_t rowSize = 4 * ((header.flags & FLAG_SAMPLE_TIMES ? 1 : 0) + header.eegChannels + header.ppgChannels);
+    return len >= header.rowsOffset + rowSize * header.sampleCount;
+}
+
+// Copy the values of the channels set in `mask` from a row into `values`, leaving
+// the others 0. Returns the mask of channels MuseFrame has no value for.
+inline uint8_t scatterChannels(const uint8_t* row, uint8_t mask, float* values, int channels) {
+    int present = 0;
+    for (int c = 0; c < 8; c++) {
+        if (!(mask & (1 << c))) continue;
+        if (c < channels) {
+            values[c] = readF32LE(row + 4 * present);
+        }
+        present++;
+    }
+    return (uint8_t) (~mask & ((1 << channels) - 1));
+}
+
+// Decode every sample in a binary message straight out of the receive buffer,
+// calling `sink(const MuseFrame&)` for each one. Channels beyond what MuseFrame
+// holds are skipped, and those the message leaves out are marked missing.
+// Returns the number of samples decoded, 0 on a bad message.
+template <typename Sink>
+size_t decodeBinaryMessage(const uint8_t* data, size_t len, double arrivalTime, BinaryHeader& header, Sink sink) {
+    if (!parseBinaryHeader(data, len, header)) {
+        return 0;
+    }
+    bool sampleTimes = header.flags & FLAG_SAMPLE_TIMES;
+    double samplePeriod = 1.0 / header.sampleRate;
+
+    const uint8_t* row = data + header.rowsOffset;
+    for (size_t i = 0; i < header.sampleCount; i++) {
+        MuseFrame frame;
+        frame.arrivalTime = arrivalTime;
+        if (sampleTimes) {
+            frame.timestamp = header.firstTimestamp + readF32LE(row);
+            row += 4;
+        } else {
+            frame.timestamp = header.firstTimestamp + i * samplePeriod;
+        }
+        frame.hasEeg = header.eegChannels > 0;
+        if (frame.hasEeg) {
+            frame.eegMissing = scatterChannels(row, header.eegMask, frame.eeg, NUM_EEG_CHANNELS);
+        }
+        row += 4 * header.eegChannels;
+        frame.hasPpg = header.ppgChannels > 0;
+        if (frame.hasPpg) {
+            frame.ppgMissing = scatterChannels(row, header.ppgMask, frame.ppg, NUM_PPG_CHANNELS);
+        }
+        row += 4 * header.ppgChannels;
+        sink(frame);
+    }
+    return header.sampleCount;
+}
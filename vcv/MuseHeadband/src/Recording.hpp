@@ -0,0 +1,498 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SampleRing.hpp"
+
+// Recordings for the replay source.
+//
+// Three layouts are read:
+// - CSV rows of timestamp, 5 EEG, 3 PPG, as lib/eeg.py writes to RECORDING_FILE
+//   (and fake_data.csv). PPG in these is collated onto every EEG sample.
+// - The columnar binary layout below, which is used in place straight out of
+//   the memory map. writeRecording() converts a loaded CSV into it.
+// - Session logs, as SessionRecorder writes while the module runs. These are
+//   decoded into columns when opened.
+//
+// Binary layout, little-endian, every array 8-byte aligned:
+//   header (64 bytes): magic "MUSEREC\0", version u32, eegChannels u32,
+//                      ppgChannels u32, reserved u32, eegCount u64, ppgCount u64
+//   eeg timestamps f64[eegCount], then eegChannels columns of f32[eegCount]
+//   ppg timestamps f64[ppgCount], then ppgChannels columns of f32[ppgCount]
+//
+// Session log layout, little-endian, appended to as it is recorded:
+//   header (64 bytes): magic "MUSELOG\0", version u32, eegChannels u32,
+//                      ppgChannels u32, outputChannels u32, startTime f64 (Unix)
+//   then blocks, each a 32-byte block header: type u32, payloadBytes u32,
+//   records u32, reserved u32, firstTimestamp f64, lastTimestamp f64
+//   - SESSION_DATA blocks hold records back to back: timestamp f64, kind u8,
+//     channels u8, reserved u16, f32[channels]
+//   - SESSION_INDEX blocks follow every few data blocks and at the end. They
+//     hold the offset of the previous index block (0 for none) as u64, then
+//     offset u64, firstTimestamp f64, lastTimestamp f64 for each data block
+//     since it, so a reader can find a time without decoding the data.
+// A log cut short by a crash is readable up to its last complete block.
+static const char RECORDING_MAGIC[8] = {'M', 'U', 'S', 'E', 'R', 'E', 'C', '\0'};
+static const uint32_t RECORDING_VERSION = 1;
+static const size_t RECORDING_HEADER_SIZE = 64;
+static const char* const RECORDING_EXTENSION = ".museb";
+
+static const char SESSION_MAGIC[8] = {'M', 'U', 'S', 'E', 'L', 'O', 'G', '\0'};
+static const uint32_t SESSION_VERSION = 1;
+static const size_t SESSION_BLOCK_HEADER_SIZE = 32;
+static const size_t SESSION_RECORD_HEADER_SIZE = 12;
+static const size_t SESSION_INDEX_ENTRY_SIZE = 24;
+static const char* const SESSION_EXTENSION = ".muselog";
+
+enum SessionBlockType {
+    SESSION_DATA = 1,
+    SESSION_INDEX = 2
+};
+
+enum SessionRecordKind {
+    RECORD_EEG,
+    RECORD_PPG,
+    RECORD_OUTPUT
+};
+
+// Widest stream a recording holds: the module's outputs, one channel each
+static const int MAX_RECORDING_CHANNELS = 16;
+
+// Read-only memory map of a whole file
+class MappedFile {
+    void* base = nullptr;
+    size_t length = 0;
+
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        base = p;
+        length = st.st_size;
+        return true;
+    }
+
+    void close() {
+        if (base) {
+            munmap(base, length);
+            base = nullptr;
+            length = 0;
+        }
+    }
+
+    const uint8_t* data() const { return (const uint8_t*) base; }
+    size_t size() const { return length; }
+};
+
+// One stream of a recording: ascending timestamps and a column per channel
+struct RecordingStream {
+    size_t count = 0;
+    int channels = 0;
+    const double* timestamps = nullptr;
+    const float* columns[MAX_RECORDING_CHANNELS] = {};
+
+    // Index of the first sample at or after `t`; the timestamps are the index
+    size_t seek(double t) const {
+        return std::lower_bound(timestamps, timestamps + count, t) - timestamps;
+    }
+
+    // Mean rate over the stream, 0 if it's too short to tell
+    double sampleRate() const {
+        if (count < 2 || timestamps[count - 1] <= timestamps[0]) return 0.0;
+        return (count - 1) / (timestamps[count - 1] - timestamps[0]);
+    }
+};
+
+// Collects a stream sample by sample while a CSV or session log is decoded
+struct StreamBuilder {
+    int channels = 0;
+    std::vector<double> timestamps;
+    std::vector<float> values[MAX_RECORDING_CHANNELS];
+
+    // Samples whose timestamp goes backwards are skipped
+    void append(double t, const float* sample) {
+        if (!timestamps.empty() && t < timestamps.back()) return;
+        timestamps.push_back(t);
+        for (int c = 0; c < channels; c++) {
+            values[c].push_back(sample[c]);
+        }
+    }
+};
+
+class Recording {
+    MappedFile file;
+    // Columns decoded from a CSV or session log live here; a binary file is used in place
+    struct OwnedStream {
+        std::vector<double> timestamps;
+        std::vector<float> columns;
+    };
+    OwnedStream owned[3];
+    bool csv = false;
+
+public:
+    RecordingStream eeg;
+    RecordingStream ppg;
+    // The module's outputs, from session logs recorded with them
+    RecordingStream outputs;
+
+    bool fromCsv() const { return csv; }
+
+    double start() const {
+        double t = eeg.count ? eeg.timestamps[0] : 0.0;
+        return ppg.count ? std::min(t, ppg.timestamps[0]) : t;
+    }
+
+    double end() const {
+        double t = eeg.count ? eeg.timestamps[eeg.count - 1] : 0.0;
+        return ppg.count ? std::max(t, ppg.timestamps[ppg.count - 1]) : t;
+    }
+
+    double duration() const {
+        return end() - start();
+    }
+
+    // Map `path` and index it. On failure returns false and sets `error`.
+    bool open(const std::string& path, std::string& error) {
+        if (!file.open(path)) {
+            error = "Can't open " + path;
+            return false;
+        }
+        bool ok;
+        if (file.size() >= RECORDING_HEADER_SIZE && memcmp(file.data(), RECORDING_MAGIC, 8) == 0) {
+            ok = openBinary(error);
+        } else if (file.size() >= RECORDING_HEADER_SIZE && memcmp(file.data(), SESSION_MAGIC, 8) == 0) {
+            ok = openSession(error);
+            file.close();
+        } else {
+            ok = openCsv(error);
+            file.close();
+        }
+        if (ok && eeg.count == 0 && ppg.count == 0) {
+            error = "No samples in " + path;
+            ok = false;
+        }
+        return ok;
+    }
+
+private:
+    static size_t align8(size_t n) {
+        return (n + 7) & ~(size_t) 7;
+    }
+
+    bool openBinary(std::string& error) {
+        const uint8_t* p = file.data();
+        uint32_t version, eegChannels, ppgChannels;
+        uint64_t eegCount, ppgCount;
+        memcpy(&version, p + 8, 4);
+        memcpy(&eegChannels, p + 12, 4);
+        memcpy(&ppgChannels, p + 16, 4);
+        memcpy(&eegCount, p + 24, 8);
+        memcpy(&ppgCount, p + 32, 8);
+        if (version != RECORDING_VERSION || eegChannels > NUM_EEG_CHANNELS || ppgChannels > NUM_PPG_CHANNELS) {
+            error = "Unsupported recording version or layout";
+            return false;
+        }
+        size_t pos = RECORDING_HEADER_SIZE;
+        if (!mapStream(eeg, eegChannels, eegCount, pos) || !mapStream(ppg, ppgChannels, ppgCount, pos)) {
+            error = "Recording is truncated";
+            return false;
+        }
+        for (const RecordingStream* stream : {&eeg, &ppg}) {
+            for (size_t i = 1; i < stream->count; i++) {
+                if (stream->timestamps[i] < stream->timestamps[i - 1]) {
+                    error = "Recording timestamps are out of order";
+                    return false;
+                }
+            }
+        }
+        csv = false;
+        return true;
+    }
+
+    bool mapStream(RecordingStream& stream, uint32_t channels, uint64_t count, size_t& pos) {
+        size_t timestampBytes = count * sizeof(double);
+        size_t columnBytes = align8(count * sizeof(float) * channels);
+        if (count > file.size() || pos + timestampBytes + columnBytes > file.size()) {
+            return false;
+        }
+        stream.count = count;
+        stream.channels = channels;
+        stream.timestamps = (const double*) (file.data() + pos);
+        pos += timestampBytes;
+        for (uint32_t c = 0; c < channels; c++) {
+            stream.columns[c] = (const float*) (file.data() + pos) + c * count;
+        }
+        pos += columnBytes;
+        return true;
+    }
+
+    // Rows of timestamp, eeg..., ppg... Lines that don't start with a number
+    // (headers) are skipped, as are rows whose timestamp goes backwards.
+    bool openCsv(std::string& error) {
+        const char* p = (const char*) file.data();
+        const char* end = p + file.size();
+        const int MAX_COLUMNS = 1 + NUM_EEG_CHANNELS + NUM_PPG_CHANNELS;
+        StreamBuilder eegBuilder, ppgBuilder;
+        eegBuilder.channels = NUM_EEG_CHANNELS;
+        int rowColumns = 0;
+        char line[1024];
+        while (p < end) {
+            const char* eol = (const char*) memchr(p, '\n', end - p);
+            if (!eol) eol = end;
+            size_t len = std::min((size_t) (eol - p), sizeof(line) - 1);
+            memcpy(line, p, len);
+            line[len] = '\0';
+            p = eol + 1;
+
+            float row[MAX_COLUMNS];
+            double timestamp = 0.0;
+            int columns = 0;
+            char* cursor = line;
+            while (columns < MAX_COLUMNS) {
+                char* next;
+                double value = strtod(cursor, &next);
+                if (next == cursor) break;
+                if (columns == 0) {
+                    timestamp = value;
+                } else {
+                    row[columns - 1] = value;
+                }
+                columns++;
+                cursor = next;
+                while (*cursor == ',' || *cursor == ' ') cursor++;
+            }
+            if (columns < 1 + NUM_EEG_CHANNELS) continue;
+            if (rowColumns == 0) {
+                rowColumns = columns;
+                ppgBuilder.channels = std::min(rowColumns - 1 - NUM_EEG_CHANNELS, NUM_PPG_CHANNELS);
+            }
+            if (columns < rowColumns) continue;
+            if (!eegBuilder.timestamps.empty() && timestamp < eegBuilder.timestamps.back()) continue;
+            eegBuilder.append(timestamp, row);
+            if (ppgBuilder.channels > 0) {
+                ppgBuilder.append(timestamp, row + NUM_EEG_CHANNELS);
+            }
+        }
+        if (eegBuilder.timestamps.empty()) {
+            error = "No CSV samples found";
+            return false;
+        }
+        adopt(eegBuilder, eeg, owned[0]);
+        adopt(ppgBuilder, ppg, owned[1]);
+        csv = true;
+        return true;
+    }
+
+    // Decode every complete data block. Index blocks only help readers that seek.
+    bool openSession(std::string& error) {
+        const uint8_t* p = file.data();
+        uint32_t version, channels[3];
+        memcpy(&version, p + 8, 4);
+        memcpy(channels, p + 12, 12);
+        if (version != SESSION_VERSION || channels[0] > NUM_EEG_CHANNELS || channels[1] > NUM_PPG_CHANNELS ||
+                channels[2] > MAX_RECORDING_CHANNELS) {
+            error = "Unsupported session log version or layout";
+            return false;
+        }
+        StreamBuilder builders[3];
+        for (int k = 0; k < 3; k++) {
+            builders[k].channels = channels[k];
+        }
+        size_t pos = RECORDING_HEADER_SIZE;
+        while (pos + SESSION_BLOCK_HEADER_SIZE <= file.size()) {
+            uint32_t type, payloadBytes, records;
+            memcpy(&type, p + pos, 4);
+            memcpy(&payloadBytes, p + pos + 4, 4);
+            memcpy(&records, p + pos + 8, 4);
+            size_t payload = pos + SESSION_BLOCK_HEADER_SIZE;
+            if (payload + payloadBytes > file.size()) break;
+            pos = payload + payloadBytes;
+            if (type != SESSION_DATA) continue;
+
+            size_t r = payload;
+            for (uint32_t i = 0; i < records && r + SESSION_RECORD_HEADER_SIZE <= pos; i++) {
+                double timestamp;
+                memcpy(&timestamp, p + r, 8);
+                uint8_t kind = p[r + 8];
+                uint8_t count = p[r + 9];
+                size_t next = r + SESSION_RECORD_HEADER_SIZE + count * sizeof(float);
+                if (next > pos) break;
+                if (kind <= RECORD_OUTPUT && count == builders[kind].channels) {
+                    float sample[MAX_RECORDING_CHANNELS];
+                    memcpy(sample, p + r + SESSION_RECORD_HEADER_SIZE, count * sizeof(float));
+                    builders[kind].append(timestamp, sample);
+                }
+                r = next;
+            }
+        }
+        adopt(builders[0], eeg, owned[0]);
+        adopt(builders[1], ppg, owned[1]);
+        adopt(builders[2], outputs, owned[2]);
+        csv = false;
+        return true;
+    }
+
+    // Move a built stream into `storage`, laid out as one block of columns
+    static void adopt(StreamBuilder& builder, RecordingStream& stream, OwnedStream& storage) {
+        size_t count = builder.timestamps.size();
+        storage.timestamps.swap(builder.timestamps);
+        storage.columns.resize(count * builder.channels);
+        for (int c = 0; c < builder.channels; c++) {
+            std::copy(builder.values[c].begin(), builder.values[c].end(), storage.columns.begin() + c * count);
+        }
+        stream.count = count;
+        stream.channels = count > 0 ? builder.channels : 0;
+        stream.timestamps = storage.timestamps.data();
+        for (int c = 0; c < builder.channels; c++) {
+            stream.columns[c] = storage.columns.data() + c * count;
+        }
+    }
+};
+
+inline bool pathExists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+// `base` + `extension`, or with -1, -2... after `base` if that or the outputs file
+// exportCsv() would write next to it is taken, so an export never replaces a
+// recording. Empty if every name up to -999 is taken.
+inline std::string unusedPath(const std::string& base, const std::string& extension) {
+    for (int n = 0; n < 1000; n++) {
+        std::string stem = n == 0 ? base : base + "-" + std::to_string(n);
+        if (!pathExists(stem + extension) && !pathExists(stem + "-outputs.csv")) {
+            return stem + extension;
+        }
+    }
+    return "";
+}
+
+// Files are written under a temporary name and renamed over `path` once complete,
+// so a failed write leaves nothing behind rather than a truncated file
+inline FILE* openTemporary(const std::string& path, const char* mode, std::string& error) {
+    FILE* f = fopen((path + ".tmp").c_str(), mode);
+    if (!f) {
+        error = "Can't write " + path;
+    }
+    return f;
+}
+
+inline bool finishTemporary(FILE* f, bool ok, const std::string& path, std::string& error) {
+    std::string tmpPath = path + ".tmp";
+    if (ferror(f)) ok = false;
+    if (fclose(f) != 0) ok = false;
+    if (ok && std::rename(tmpPath.c_str(), path.c_str()) != 0) ok = false;
+    if (!ok) {
+        std::remove(tmpPath.c_str());
+        error = "Failed writing " + path;
+    }
+    return ok;
+}
+
+// Write `recording` in the columnar binary layout
+inline bool writeRecording(const std::string& path, const Recording& recording, std::string& error) {
+    FILE* f = openTemporary(path, "wb", error);
+    if (!f) {
+        return false;
+    }
+    uint8_t header[RECORDING_HEADER_SIZE] = {};
+    memcpy(header, RECORDING_MAGIC, 8);
+    uint32_t eegChannels = recording.eeg.channels;
+    uint32_t ppgChannels = recording.ppg.channels;
+    uint64_t eegCount = recording.eeg.count;
+    uint64_t ppgCount = recording.ppg.count;
+    memcpy(header + 8, &RECORDING_VERSION, 4);
+    memcpy(header + 12, &eegChannels, 4);
+    memcpy(header + 16, &ppgChannels, 4);
+    memcpy(header + 24, &eegCount, 8);
+    memcpy(header + 32, &ppgCount, 8);
+    bool ok = fwrite(header, 1, sizeof(header), f) == sizeof(header);
+    static const uint8_t padding[8] = {};
+    for (const RecordingStream* stream : {&recording.eeg, &recording.ppg}) {
+        ok = ok && fwrite(stream->timestamps, sizeof(double), stream->count, f) == stream->count;
+        for (int c = 0; c < stream->channels; c++) {
+            ok = ok && fwrite(stream->columns[c], sizeof(float), stream->count, f) == stream->count;
+        }
+        size_t columnBytes = stream->count * sizeof(float) * stream->channels;
+        size_t pad = ((columnBytes + 7) & ~(size_t) 7) - columnBytes;
+        ok = ok && fwrite(padding, 1, pad, f) == pad;
+    }
+    return finishTemporary(f, ok, path, error);
+}
+
+// Write `recording` as CSV in lib/eeg.py's layout: one row per EEG sample with
+// the latest PPG sample held alongside. Recorded outputs, if there are any, go
+// to a second file named like `path` with "-outputs" before the extension.
+inline bool exportCsv(const std::string& path, const Recording& recording, std::string& error) {
+    FILE* f = openTemporary(path, "w", error);
+    if (!f) {
+        return false;
+    }
+    const RecordingStream& eeg = recording.eeg;
+    const RecordingStream& ppg = recording.ppg;
+    size_t p = 0;
+    for (size_t i = 0; i < eeg.count; i++) {
+        fprintf(f, "%.6f", eeg.timestamps[i]);
+        for (int c = 0; c < eeg.channels; c++) {
+            fprintf(f, ",%.9g", eeg.columns[c][i]);
+        }
+        while (p + 1 < ppg.count && ppg.timestamps[p + 1] <= eeg.timestamps[i]) {
+            p++;
+        }
+        for (int c = 0; c < ppg.channels; c++) {
+            fprintf(f, ",%.9g", ppg.columns[c][p]);
+        }
+        fputc('\n', f);
+    }
+    if (!finishTemporary(f, true, path, error)) {
+        return false;
+    }
+
+    const RecordingStream& outputs = recording.outputs;
+    if (outputs.count == 0) {
+        return true;
+    }
+    size_t dot = path.rfind('.');
+    std::string outputsPath = (dot == std::string::npos ? path : path.substr(0, dot)) + "-outputs.csv";
+    f = openTemporary(outputsPath, "w", error);
+    if (!f) {
+        return false;
+    }
+    for (size_t i = 0; i < outputs.count; i++) {
+        fprintf(f, "%.6f", outputs.timestamps[i]);
+        for (int c = 0; c < outputs.channels; c++) {
+            fprintf(f, ",%.6g", outputs.columns[c][i]);
+        }
+        fputc('\n', f);
+    }
+    return finishTemporary(f, true, outputsPath, error);
+}
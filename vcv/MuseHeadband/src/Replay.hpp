@@ -0,0 +1,137 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+#include "Recording.hpp"
+
+// Plays a Recording back as MuseFrames, merging its EEG and PPG streams in
+// timestamp order, in real time or sped up.
+//
+// Emitted timestamps are on the playback clock rather than the recording's,
+// so they keep increasing through loops and seeks and are spaced
+// 1 / speed apart in recording time: consumers should scale their idea of
+// the source rate by `speed`.
+class ReplayPlayer {
+    std::unique_ptr<Recording> recording;
+    size_t eegIndex = 0;
+    size_t ppgIndex = 0;
+    // Playhead in recording time, and the playback clock
+    double position = 0.0;
+    double clock = 0.0;
+    // Maps recording time to playback time: clock = clockBase + (t - positionBase) / speed
+    double positionBase = 0.0;
+    double clockBase = 0.0;
+    double speed = 1.0;
+
+public:
+    bool loop = true;
+    bool finished = false;
+
+    void load(std::unique_ptr<Recording> loaded) {
+        recording = std::move(loaded);
+        finished = false;
+        seek(recording->start());
+    }
+
+    bool loaded() const {
+        return recording != nullptr;
+    }
+
+    const Recording& getRecording() const {
+        return *recording;
+    }
+
+    // Seconds into the recording
+    double elapsed() const {
+        return loaded() ? position - recording->start() : 0.0;
+    }
+
+    void setSpeed(double newSpeed) {
+        if (newSpeed == speed) return;
+        anchor(0.0);
+        speed = newSpeed;
+    }
+
+    // Jump to recording time `t`, O(log n) through each stream's timestamps
+    void seek(double t) {
+        if (!loaded()) return;
+        position = std::min(std::max(t, recording->start()), recording->end());
+        eegIndex = recording->eeg.seek(position);
+        ppgIndex = recording->ppg.seek(position);
+        finished = false;
+        // Leave one sample period on the playback clock across the jump
+        anchor(samplePeriod() / speed);
+    }
+
+    // Advance playback by `seconds` of wall time, calling `sink(const MuseFrame&)`
+    // for every sample that is now due. Returns the number of frames emitted.
+    template <typename Sink>
+    size_t advance(double seconds, Sink sink) {
+        if (!loaded() || finished) return 0;
+        clock += seconds;
+        position += seconds * speed;
+        size_t emitted = 0;
+        while (true) {
+            const RecordingStream& eeg = recording->eeg;
+            const RecordingStream& ppg = recording->ppg;
+            bool eegNext = eegIndex < eeg.count;
+            bool ppgNext = ppgIndex < ppg.count;
+            if (eegNext && ppgNext) {
+                // Ties go to EEG, so collated rows come out EEG first
+                eegNext = eeg.timestamps[eegIndex] <= ppg.timestamps[ppgIndex];
+                ppgNext = !eegNext;
+            }
+            if (!eegNext && !ppgNext) {
+                if (!loop || recording->duration() <= 0.0) {
+                    finished = true;
+                    break;
+                }
+                // Wrap, carrying the overshoot into the next pass
+                double overshoot = std::fmod(position - recording->end(), recording->duration());
+                seek(recording->start() + std::max(overshoot, 0.0));
+                continue;
+            }
+            const RecordingStream& stream = eegNext ? eeg : ppg;
+            size_t& index = eegNext ? eegIndex : ppgIndex;
+            double t = stream.timestamps[index];
+            if (t > position) break;
+
+            MuseFrame frame;
+            frame.timestamp = clockBase + (t - positionBase) / speed;
+            float* values = eegNext ? frame.eeg : frame.ppg;
+            for (int c = 0; c < stream.channels; c++) {
+                values[c] = stream.columns[c][index];
+            }
+            frame.hasEeg = eegNext;
+            frame.hasPpg = !eegNext;
+            sink(frame);
+            index++;
+            emitted++;
+        }
+        return emitted;
+    }
+
+    // Wall seconds until the next sample is due, or -1 if there is none
+    double untilNext() const {
+        if (!loaded() || finished) return -1.0;
+        double next = INFINITY;
+        if (eegIndex < recording->eeg.count) next = recording->eeg.timestamps[eegIndex];
+        if (ppgIndex < recording->ppg.count) next = std::min(next, recording->ppg.timestamps[ppgIndex]);
+        if (std::isinf(next)) return loop ? 0.0 : -1.0;
+        return std::max(next - position, 0.0) / speed;
+    }
+
+private:
+    double samplePeriod() const {
+        double rate = std::max(recording->eeg.sampleRate(), recording->ppg.sampleRate());
+        return rate > 0.0 ? 1.0 / rate : 0.0;
+    }
+
+    // Re-anchor the playback clock at the playhead, `gap` seconds ahead
+    void anchor(double gap) {
+        positionBase = position;
+        clockBase = clock + gap;
+        clock = clockBase;
+    }
+};
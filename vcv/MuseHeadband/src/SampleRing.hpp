@@ -0,0 +1,126 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+static const int NUM_EEG_CHANNELS = 5;
+static const int NUM_PPG_CHANNELS = 3;
+static const size_t CACHE_LINE_SIZE = 64;
+
+// Monotonic wall time in seconds, for latency measurements
+inline double steadyTime() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// One flat sample as it travels from the WebSocket thread to process()
+struct MuseFrame {
+    // Source timestamp from the server, and steadyTime() when the frame was decoded
+    double timestamp = 0.0;
+    double arrivalTime = 0.0;
+    float eeg[NUM_EEG_CHANNELS] = {};
+    float ppg[NUM_PPG_CHANNELS] = {};
+    // EEG and PPG normally arrive as separate streams; older servers send both in one frame
+    bool hasEeg = false;
+    bool hasPpg = false;
+    // Bit c set if EEG channel c failed its quality checks (SignalQuality.hpp)
+    uint8_t eegFlagged = 0;
+    // Bit c set for each channel the server left out because no subscriber asked
+    // for it (StreamSubscription in MuseProtocol.hpp); those read 0
+    uint8_t eegMissing = 0;
+    uint8_t ppgMissing = 0;
+};
+
+// Fixed-capacity single-producer/single-consumer ring.
+//
+// The producer owns `head` and the consumer owns `tail`, padded onto separate
+// cache lines so the two threads don't false-share. Neither side locks or allocates.
+// The only time the producer touches `tail` is pushOverwrite() on a full ring;
+// the consumer therefore advances `tail` with a CAS and discards a copy whose
+// slot was reclaimed underneath it.
+template <typename T, size_t CAPACITY>
+struct SpscRing {
+    static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "SpscRing capacity must be a power of two");
+    static const size_t MASK = CAPACITY - 1;
+
+    std::atomic<size_t> head{0};
+    char headPad[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail{0};
+    char tailPad[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    T slots[CAPACITY];
+
+    size_t capacity() const {
+        return CAPACITY;
+    }
+
+    // Approximate fill level; exact when called from either owning thread.
+    size_t size() const {
+        size_t t = tail.load(std::memory_order_acquire);
+        size_t h = head.load(std::memory_order_acquire);
+        return h - t;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Producer: append `item`, or return false if the ring is full.
+    bool push(const T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        if (h - t >= CAPACITY) {
+            return false;
+        }
+        slots[h & MASK] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer: append `item`, discarding the oldest entry if the ring is full.
+    // Returns true if an entry had to be dropped.
+    bool pushOverwrite(const T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        bool dropped = false;
+        while (h - t >= CAPACITY) {
+            if (tail.compare_exchange_weak(t, t + 1, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                dropped = true;
+                break;
+            }
+        }
+        slots[h & MASK] = item;
+        head.store(h + 1, std::memory_order_release);
+        return dropped;
+    }
+
+    // Consumer: remove the oldest entry into `out`, or return false if empty.
+    bool pop(T& out) {
+        size_t t = tail.load(std::memory_order_acquire);
+        while (true) {
+            size_t h = head.load(std::memory_order_acquire);
+            if (t == h) {
+                return false;
+            }
+            out = slots[t & MASK];
+            if (tail.compare_exchange_weak(t, t + 1, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                return true;
+            }
+        }
+    }
+
+    // Consumer: drop up to `count` of the oldest entries. Returns how many were dropped.
+    size_t discard(size_t count) {
+        size_t t = tail.load(std::memory_order_acquire);
+        while (true) {
+            size_t h = head.load(std::memory_order_acquire);
+            size_t n = std::min(count, h - t);
+            if (n == 0) {
+                return 0;
+            }
+            if (tail.compare_exchange_weak(t, t + n, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                return n;
+            }
+        }
+    }
+};
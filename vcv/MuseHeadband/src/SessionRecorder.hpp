@@ -0,0 +1,287 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Recording.hpp"
+
+// Records what the module receives, and optionally what it outputs, to a
+// session log (layout in Recording.hpp) without the producing threads ever
+// touching the disk.
+//
+// Each producer thread has its own lane of two fixed pages: it appends records
+// to one while the writer thread writes out the other. A page is handed over
+// when it fills or has been open FLUSH_SECONDS; if the writer still has the
+// other page, the producer keeps filling its own, and once that is full
+// records are dropped and counted rather than waited for. record() never
+// locks or allocates.
+//
+// start() and stop() are for one control thread (the UI). stop() waits for
+// the producers to leave record() and for the writer to finish the file.
+class SessionRecorder {
+public:
+    enum Lane {
+        LANE_INPUT,  // sourceThread: EEG and PPG as received
+        LANE_OUTPUT, // audio thread: output voltages
+        LANES_LEN
+    };
+    static const size_t PAGE_SIZE = 32768;
+    static constexpr double FLUSH_SECONDS = 1.0;
+    // An index block follows every this many data blocks
+    static const int INDEX_INTERVAL = 16;
+    static const int WRITER_POLL_MS = 20;
+
+    // Read by the UI
+    std::atomic<uint64_t> bytesWritten{0};
+    std::atomic<uint64_t> recordsWritten{0};
+    std::atomic<uint64_t> droppedRecords{0};
+    // Set by the writer if the disk refused anything
+    std::atomic<bool> writeFailed{false};
+
+    SessionRecorder() {}
+    SessionRecorder(const SessionRecorder&) = delete;
+    SessionRecorder& operator=(const SessionRecorder&) = delete;
+    ~SessionRecorder() {
+        stop();
+    }
+
+    // Create `path` and start recording streams with the given channel counts.
+    // On failure returns false and sets `error`.
+    bool start(const std::string& path, int eegChannels, int ppgChannels, int outputChannels, std::string& error) {
+        stop();
+        file = fopen(path.c_str(), "wb");
+        if (!file) {
+            error = "Can't write " + path;
+            return false;
+        }
+        uint8_t header[RECORDING_HEADER_SIZE] = {};
+        uint32_t fields[4] = {SESSION_VERSION, (uint32_t) eegChannels, (uint32_t) ppgChannels, (uint32_t) outputChannels};
+        double startTime = (double) std::time(nullptr);
+        memcpy(header, SESSION_MAGIC, 8);
+        memcpy(header + 8, fields, sizeof(fields));
+        memcpy(header + 24, &startTime, 8);
+        if (fwrite(header, 1, sizeof(header), file) != sizeof(header)) {
+            fclose(file);
+            file = nullptr;
+            error = "Failed writing " + path;
+            return false;
+        }
+        offset = sizeof(header);
+        lastIndex = 0;
+        pending.clear();
+        writeFailed = false;
+        bytesWritten = offset;
+        recordsWritten = 0;
+        droppedRecords = 0;
+        currentPath = path;
+
+        for (LaneState& lane : lanes) {
+            for (Page& page : lane.pages) {
+                page.data.resize((size_t) PAGE_SIZE);
+                page.clear(0.0);
+                page.state = PAGE_FREE;
+            }
+            lane.filling = 0;
+            lane.pages[0].state = PAGE_FILLING;
+        }
+        finishing = false;
+        writer = std::thread([this]() {
+            writerLoop();
+        });
+        active = true;
+        return true;
+    }
+
+    // Finish and close the file. Safe to call when not recording.
+    void stop() {
+        if (!writer.joinable()) return;
+        active = false;
+        // After this no producer is inside record(), and none will enter it
+        for (LaneState& lane : lanes) {
+            while (lane.busy) {
+                std::this_thread::yield();
+            }
+        }
+        finishing = true;
+        writer.join();
+    }
+
+    bool recording() const {
+        return active;
+    }
+
+    // The file being recorded, or last recorded
+    const std::string& path() const {
+        return currentPath;
+    }
+
+    // Append one sample. Called only by the lane's own producer thread.
+    void record(Lane laneId, SessionRecordKind kind, double timestamp, const float* values, int channels) {
+        LaneState& lane = lanes[laneId];
+        lane.busy = true;
+        if (!active) {
+            lane.busy = false;
+            return;
+        }
+        size_t size = SESSION_RECORD_HEADER_SIZE + channels * sizeof(float);
+        Page* page = &lane.pages[lane.filling];
+        bool full = page->used + size > PAGE_SIZE;
+        double now = steadyTime();
+        if (full || (page->records > 0 && now - page->opened >= FLUSH_SECONDS)) {
+            Page& other = lane.pages[1 - lane.filling];
+            if (other.state.load(std::memory_order_acquire) == PAGE_FREE) {
+                page->state.store(PAGE_READY, std::memory_order_release);
+                lane.filling = 1 - lane.filling;
+                page = &other;
+                page->clear(now);
+                page->state.store(PAGE_FILLING, std::memory_order_relaxed);
+            } else if (full) {
+                droppedRecords.fetch_add(1, std::memory_order_relaxed);
+                lane.busy = false;
+                return;
+            }
+        }
+        if (page->records == 0) {
+            page->first = timestamp;
+            page->opened = now;
+        }
+        page->last = timestamp;
+        uint8_t* dst = page->data.data() + page->used;
+        memcpy(dst, &timestamp, 8);
+        dst[8] = (uint8_t) kind;
+        dst[9] = (uint8_t) channels;
+        dst[10] = 0;
+        dst[11] = 0;
+        memcpy(dst + SESSION_RECORD_HEADER_SIZE, values, channels * sizeof(float));
+        page->used += size;
+        page->records++;
+        lane.busy = false;
+    }
+
+private:
+    enum PageState {
+        PAGE_FREE,
+        PAGE_FILLING,
+        PAGE_READY
+    };
+
+    struct Page {
+        std::vector<uint8_t> data;
+        size_t used = 0;
+        uint32_t records = 0;
+        double first = 0.0;
+        double last = 0.0;
+        double opened = 0.0;
+        std::atomic<int> state{PAGE_FREE};
+
+        void clear(double now) {
+            used = 0;
+            records = 0;
+            opened = now;
+        }
+    };
+
+    struct LaneState {
+        Page pages[2];
+        int filling = 0;    // producer only
+        std::atomic<bool> busy{false};
+    };
+
+    struct IndexEntry {
+        uint64_t offset;
+        double first;
+        double last;
+    };
+
+    LaneState lanes[LANES_LEN];
+    std::atomic<bool> active{false};
+    std::atomic<bool> finishing{false};
+    std::thread writer;
+    std::string currentPath;
+
+    // Writer thread only, between start() and stop()
+    FILE* file = nullptr;
+    uint64_t offset = 0;
+    uint64_t lastIndex = 0;
+    std::vector<IndexEntry> pending;
+
+    void writerLoop() {
+        while (!finishing) {
+            writeReady(false);
+            std::this_thread::sleep_for(std::chrono::milliseconds((int) WRITER_POLL_MS));
+        }
+        // The producers are out: take what is ready, then what they were filling
+        writeReady(false);
+        writeReady(true);
+        if (!pending.empty()) {
+            writeIndex();
+        }
+        if (fclose(file) != 0) {
+            writeFailed = true;
+        }
+        file = nullptr;
+    }
+
+    void writeReady(bool partial) {
+        for (LaneState& lane : lanes) {
+            for (Page& page : lane.pages) {
+                int state = page.state.load(std::memory_order_acquire);
+                if (state == PAGE_READY || (partial && state == PAGE_FILLING)) {
+                    if (page.records > 0) {
+                        writeData(page);
+                    }
+                    page.state.store(PAGE_FREE, std::memory_order_release);
+                }
+            }
+        }
+    }
+
+    void writeData(const Page& page) {
+        pending.push_back(IndexEntry{offset, page.first, page.last});
+        writeBlock(SESSION_DATA, page.data.data(), page.used, page.records, page.first, page.last);
+        recordsWritten.fetch_add(page.records, std::memory_order_relaxed);
+        if (pending.size() >= (size_t) INDEX_INTERVAL) {
+            writeIndex();
+        }
+    }
+
+    void writeIndex() {
+        std::vector<uint8_t> payload(8 + pending.size() * SESSION_INDEX_ENTRY_SIZE);
+        memcpy(payload.data(), &lastIndex, 8);
+        double first = pending.front().first;
+        double last = pending.front().last;
+        for (size_t i = 0; i < pending.size(); i++) {
+            uint8_t* entry = payload.data() + 8 + i * SESSION_INDEX_ENTRY_SIZE;
+            memcpy(entry, &pending[i].offset, 8);
+            memcpy(entry + 8, &pending[i].first, 8);
+            memcpy(entry + 16, &pending[i].last, 8);
+            first = std::min(first, pending[i].first);
+            last = std::max(last, pending[i].last);
+        }
+        lastIndex = offset;
+        writeBlock(SESSION_INDEX, payload.data(), payload.size(), pending.size(), first, last);
+        pending.clear();
+        fflush(file);
+    }
+
+    void writeBlock(uint32_t type, const uint8_t* payload, size_t payloadBytes, uint32_t records, double first, double last) {
+        uint8_t header[SESSION_BLOCK_HEADER_SIZE] = {};
+        uint32_t fields[3] = {type, (uint32_t) payloadBytes, records};
+        memcpy(header, fields, sizeof(fields));
+        memcpy(header + 16, &first, 8);
+        memcpy(header + 24, &last, 8);
+        if (fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+                fwrite(payload, 1, payloadBytes, file) != payloadBytes) {
+            writeFailed = true;
+        }
+        offset += sizeof(header) + payloadBytes;
+        bytesWritten.store(offset, std::memory_order_relaxed);
+    }
+};
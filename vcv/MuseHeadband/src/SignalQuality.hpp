@@ -0,0 +1,128 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// Why ChannelQuality flagged a sample
+enum QualityFlag {
+    QUALITY_SATURATED = 1 << 0, // at the headband's rails
+    QUALITY_FLAT = 1 << 1,      // unchanged for FLAT_SECONDS: a dead or disconnected electrode
+    QUALITY_ARTIFACT = 1 << 2,  // further than the artifact level from the baseline: blinks, jaw clenches
+};
+
+// What happens to flagged EEG samples
+enum ArtifactHandling {
+    // Only reported on the quality output
+    ARTIFACTS_FLAG,
+    // Left out of the normalization stats, and held at the last clean value for band powers
+    ARTIFACTS_HOLD_OUT,
+    // Replaced by the last clean value everywhere, outputs included
+    ARTIFACTS_GATE,
+    ARTIFACT_HANDLINGS_LEN
+};
+
+// Streaming quality checks for one EEG channel, in microvolts.
+//
+// Every check is O(1) per sample. The baseline follows clean samples only,
+// so an artifact can't drag it along, but an excursion lasting longer than
+// MAX_ARTIFACT_SECONDS is taken to be a new level. A flag lingers for
+// HOLD_SECONDS so the edges of an artifact are caught with it. `quality` is
+// the share of clean samples over roughly the last QUALITY_SECONDS.
+struct ChannelQuality {
+    // The Muse reports +-1000 uV in steps of about 0.49 uV
+    static constexpr float SATURATION_LEVEL = 999.f;
+    static constexpr float FLAT_TOLERANCE = 1.f;
+    static constexpr double FLAT_SECONDS = 0.25;
+    static constexpr double BASELINE_SECONDS = 1.0;
+    static constexpr double MAX_ARTIFACT_SECONDS = 2.0;
+    static constexpr double HOLD_SECONDS = 0.1;
+    static constexpr double QUALITY_SECONDS = 2.0;
+
+    float quality = 1.f;
+    // The latest sample that wasn't flagged
+    float lastClean = 0.f;
+
+    void setSampleRate(float rate) {
+        flatSamples = (int) std::ceil(FLAT_SECONDS * rate);
+        maxArtifactSamples = (int) std::ceil(MAX_ARTIFACT_SECONDS * rate);
+        holdSamples = (int) std::ceil(HOLD_SECONDS * rate);
+        baselineWeight = (float) (1.0 / (BASELINE_SECONDS * rate));
+        qualityWeight = (float) (1.0 / (QUALITY_SECONDS * rate));
+        reset();
+    }
+
+    void reset() {
+        quality = 1.f;
+        lastClean = 0.f;
+        haveBaseline = false;
+        flatReference = 0.f;
+        flatRun = 0;
+        artifactRun = 0;
+        heldFlags = 0;
+        holdRemaining = 0;
+    }
+
+    // Flags for `value` (a combination of QualityFlags), 0 if it is clean
+    int process(float value, float artifactLevel) {
+        if (!haveBaseline) {
+            baseline = value;
+            flatReference = value;
+            haveBaseline = true;
+        }
+
+        int flags = 0;
+        if (std::fabs(value) >= SATURATION_LEVEL) {
+            flags |= QUALITY_SATURATED;
+        }
+
+        if (std::fabs(value - flatReference) > FLAT_TOLERANCE) {
+            flatReference = value;
+            flatRun = 0;
+        } else if (++flatRun >= flatSamples) {
+            flags |= QUALITY_FLAT;
+        }
+
+        if (std::fabs(value - baseline) > artifactLevel) {
+            if (++artifactRun >= maxArtifactSamples) {
+                baseline = value;
+                artifactRun = 0;
+            } else {
+                flags |= QUALITY_ARTIFACT;
+            }
+        } else {
+            artifactRun = 0;
+        }
+
+        if (flags) {
+            heldFlags |= flags;
+            holdRemaining = holdSamples;
+        } else if (holdRemaining > 0) {
+            holdRemaining--;
+            flags = heldFlags;
+        } else {
+            heldFlags = 0;
+        }
+
+        if (!flags) {
+            baseline += baselineWeight * (value - baseline);
+            lastClean = value;
+        }
+        quality += qualityWeight * ((flags ? 0.f : 1.f) - quality);
+        return flags;
+    }
+
+private:
+    int flatSamples = 64;
+    int maxArtifactSamples = 512;
+    int holdSamples = 26;
+    float baselineWeight = 1.f / 256.f;
+    float qualityWeight = 1.f / 512.f;
+
+    bool haveBaseline = false;
+    float baseline = 0.f;
+    float flatReference = 0.f;
+    int flatRun = 0;
+    int artifactRun = 0;
+    int heldFlags = 0;
+    int holdRemaining = 0;
+};
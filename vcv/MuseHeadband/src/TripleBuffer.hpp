@@ -0,0 +1,44 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Wait-free single-writer/single-reader snapshot.
+//
+// The writer fills writeBuffer() and calls publish(); the reader calls update()
+// and then reads read(). Neither side ever blocks, and the reader always sees
+// the most recently published complete snapshot.
+template <typename T>
+struct TripleBuffer {
+    static const uint8_t INDEX_MASK = 0x3;
+    static const uint8_t DIRTY = 0x4;
+
+    T buffers[3];
+    // Index of the buffer in the middle, plus DIRTY if it holds an unread snapshot
+    std::atomic<uint8_t> middle{1};
+    uint8_t back = 0;
+    uint8_t front = 2;
+
+    // Writer: the buffer to fill before the next publish()
+    T& writeBuffer() {
+        return buffers[back];
+    }
+
+    // Writer: hand the filled buffer to the reader
+    void publish() {
+        back = middle.exchange(back | DIRTY, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    // Reader: pick up the latest snapshot. Returns false if nothing new was published.
+    bool update() {
+        if (!(middle.load(std::memory_order_acquire) & DIRTY)) {
+            return false;
+        }
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX_MASK;
+        return true;
+    }
+
+    // Reader: the snapshot picked up by the last successful update()
+    const T& read() const {
+        return buffers[front];
+    }
+};
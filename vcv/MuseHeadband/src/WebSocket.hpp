@@ -1,204 +1,309 @@
-
 // Websocket implementation - single header, no dependencies
+#pragma once
+#include "WebSocketFrame.hpp"
+
 namespace easywsclient {
     enum ReadyState { CLOSING, CLOSED, CONNECTING, OPEN };
 
+    // Lets another thread interrupt a poll() on the connection thread.
+    // eventfd on Linux, a self-pipe elsewhere.
+    class Wakeup {
+        int readFd = -1;
+        int writeFd = -1;
+
+    public:
+        Wakeup() {
+#ifdef __linux__
+            readFd = writeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+            int fds[2];
+            if (pipe(fds) == 0) {
+                readFd = fds[0];
+                writeFd = fds[1];
+                fcntl(readFd, F_SETFL, O_NONBLOCK);
+                fcntl(writeFd, F_SETFL, O_NONBLOCK);
+            }
+#endif
+        }
+
+        ~Wakeup() {
+            if (writeFd != readFd && writeFd != -1) ::close(writeFd);
+            if (readFd != -1) ::close(readFd);
+        }
+
+        int fd() const {
+            return readFd;
+        }
+
+        void signal() {
+            uint64_t one = 1;
+            ssize_t written = ::write(writeFd, &one, sizeof(one));
+            (void) written;
+        }
+
+        // Sleep for up to `timeoutMs`. Returns true if signal() was called.
+        bool wait(int timeoutMs) {
+            struct pollfd pfd = {readFd, POLLIN, 0};
+            return ::poll(&pfd, 1, timeoutMs) > 0;
+        }
+
+        // Consume pending signals so waits block again
+        void clear() {
+            uint64_t value;
+            while (::read(readFd, &value, sizeof(value)) > 0) {
+            }
+        }
+    };
+
+    // Wait for `events` on `fd`. Returns false on timeout, or as soon as `wakeFd` is readable.
+    inline bool waitFor(int fd, short events, int wakeFd, int timeoutMs) {
+        struct pollfd fds[2] = {{fd, events, 0}, {wakeFd, POLLIN, 0}};
+        int n = ::poll(fds, wakeFd >= 0 ? 2 : 1, timeoutMs);
+        if (n <= 0 || (wakeFd >= 0 && (fds[1].revents & POLLIN))) {
+            return false;
+        }
+        return (fds[0].revents & (events | POLLERR | POLLHUP)) != 0;
+    }
+
     class WebSocket {
     protected:
+        // Bytes requested from the kernel per read; the buffer holds at least this much free space
+        static const size_t READ_SIZE = 64 * 1024;
+
         int sockfd = -1;
         ReadyState state = CLOSED;
-        std::string messageBuffer;  // Buffer for incomplete messages
+        std::string protocol;  // Subprotocol accepted by the server, empty if none
+
+        FrameDecoder decoder{2 * READ_SIZE};
+
+        uint32_t maskSeed = 0x9E3779B9u;
 
     public:
         WebSocket() {}
         virtual ~WebSocket() { close(); }
-        
-        static WebSocket* create_connection(const std::string& url) {
+
+        // `protocols` is an optional comma-separated Sec-WebSocket-Protocol offer.
+        // Connecting and the handshake each give up after `timeoutMs`, or early
+        // if `wakeFd` becomes readable. The returned socket is non-blocking.
+        static WebSocket* create_connection(const std::string& url, const std::string& protocols = "",
+                                            int wakeFd = -1, int timeoutMs = 2000) {
+            // ws://host[:port][/path]
             char host[128];
-            int port;
-            sscanf(url.c_str(), "ws://%[^:/]:%d", host, &port);
-            
+            char path[512] = "/";
+            int port = 80;
+            int fields = sscanf(url.c_str(), "ws://%127[^:/]:%d%511s", host, &port, path);
+            if (fields < 1) {
+                WARN("Invalid WebSocket URL: %s", url.c_str());
+                return nullptr;
+            }
+            if (fields == 1) {
+                sscanf(url.c_str(), "ws://%*[^:/]%511s", path);
+            }
+
             struct addrinfo hints;
             struct addrinfo *result;
             memset(&hints, 0, sizeof(hints));
             hints.ai_family = AF_UNSPEC;
             hints.ai_socktype = SOCK_STREAM;
             hints.ai_protocol = IPPROTO_TCP;
-            
+
             char sport[16];
             snprintf(sport, 16, "%d", port);
             if (getaddrinfo(host, sport, &hints, &result) != 0) {
                 return nullptr;
             }
-            
+
             int sockfd = -1;
             for(struct addrinfo *p = result; p != nullptr; p = p->ai_next) {
                 sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
                 if (sockfd == -1) continue;
-                if (connect(sockfd, p->ai_addr, p->ai_addrlen) != -1) {
+                fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+                if (connect(sockfd, p->ai_addr, p->ai_addrlen) == 0) {
                     break;
                 }
+                if (errno == EINPROGRESS && waitFor(sockfd, POLLOUT, wakeFd, timeoutMs)) {
+                    int error = 0;
+                    socklen_t errorLen = sizeof(error);
+                    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &errorLen) == 0 && error == 0) {
+                        break;
+                    }
+                }
                 ::close(sockfd);
                 sockfd = -1;
             }
             freeaddrinfo(result);
-            
+
             if (sockfd != -1) {
                 // Send WebSocket handshake
-                std::string handshake = 
-                    "GET / HTTP/1.1\r\n"
+                std::string handshake =
+                    "GET " + std::string(path) + " HTTP/1.1\r\n"
                     "Host: " + std::string(host) + ":" + sport + "\r\n"
                     "Upgrade: websocket\r\n"
                     "Connection: Upgrade\r\n"
                     "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"  // This is a static key for simplicity
-                    "Sec-WebSocket-Version: 13\r\n"
-                    "\r\n";
+                    "Sec-WebSocket-Version: 13\r\n";
+                if (!protocols.empty()) {
+                    handshake += "Sec-WebSocket-Protocol: " + protocols + "\r\n";
+                }
+                handshake += "\r\n";
 
+                int noDelay = 1;
+                setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+                WebSocket* ws = new WebSocket();
+                ws->sockfd = sockfd;
                 INFO("Sending WebSocket handshake: %s", handshake.c_str());
-                if (::send(sockfd, handshake.c_str(), handshake.length(), 0) < 0) {
+                if (!ws->sendAll((const uint8_t*) handshake.c_str(), handshake.length())) {
                     WARN("Failed to send handshake");
-                    ::close(sockfd);
+                    delete ws;
                     return nullptr;
                 }
 
-                // Receive handshake response
-                char buffer[1024];
-                ssize_t bytes = recv(sockfd, buffer, sizeof(buffer)-1, 0);
-                if (bytes > 0) {
-                    buffer[bytes] = '\0';
-                    INFO("Received handshake response: %s", buffer);
-
-                    // Check if response contains "101 Switching Protocols"
-                    if (strstr(buffer, "101 Switching Protocols") == nullptr) {
-                        WARN("Invalid handshake response");
-                        ::close(sockfd);
+                // Receive handshake response. The server may send its first frames
+                // in the same segment, so anything after the headers is kept.
+                size_t headerEnd = 0;
+                while (headerEnd == 0) {
+                    ws->decoder.rx.reserve(1024 + 1);
+                    if (!waitFor(sockfd, POLLIN, wakeFd, timeoutMs)) {
+                        WARN("No handshake response received");
+                        delete ws;
                         return nullptr;
                     }
+                    ssize_t bytes = recv(sockfd, ws->decoder.rx.writePtr(), 1024, 0);
+                    if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+                        continue;
+                    }
+                    if (bytes <= 0 || ws->decoder.rx.readable() + bytes > 16 * 1024) {
+                        WARN("No handshake response received");
+                        delete ws;
+                        return nullptr;
+                    }
+                    ws->decoder.rx.commit(bytes);
+                    *ws->decoder.rx.writePtr() = '\0';
+                    const char* response = (const char*) ws->decoder.rx.readPtr();
+                    const char* end = strstr(response, "\r\n\r\n");
+                    if (end) {
+                        headerEnd = end + 4 - response;
+                    }
+                }
+
+                std::string response((const char*) ws->decoder.rx.readPtr(), headerEnd);
+                INFO("Received handshake response: %s", response.c_str());
 
-                    WebSocket* ws = new WebSocket();
-                    ws->sockfd = sockfd;
-                    ws->state = OPEN;
-                    return ws;
+                // Check if response contains "101 Switching Protocols"
+                if (response.find("101 Switching Protocols") == std::string::npos) {
+                    WARN("Invalid handshake response");
+                    delete ws;
+                    return nullptr;
                 }
 
-                WARN("No handshake response received");
-                ::close(sockfd);
-                return nullptr;
+                ws->decoder.rx.consume(headerEnd);
+                ws->state = OPEN;
+                const char* protocolHeader = strcasestr(response.c_str(), "Sec-WebSocket-Protocol:");
+                if (protocolHeader) {
+                    protocolHeader += strlen("Sec-WebSocket-Protocol:");
+                    protocolHeader += strspn(protocolHeader, " ");
+                    ws->protocol.assign(protocolHeader, strcspn(protocolHeader, "\r\n"));
+                }
+                return ws;
             }
             return nullptr;
         }
 
-        bool decodeFrame(const char* input, size_t inputLen, std::vector<char>& output) {
-            if (inputLen < 2) {
-                DEBUG("Frame too short (%zu bytes), waiting for more data", inputLen);
+        // Send one client frame. Client-to-server payloads must be masked.
+        bool sendFrame(int opcode, const uint8_t* data, size_t len) {
+            if (sockfd == -1) {
                 return false;
             }
-            
-            unsigned char first_byte = input[0];
-            bool fin = (first_byte & 0x80) != 0;
-            unsigned char opcode = first_byte & 0x0F;
-            
-            unsigned char second_byte = input[1];
-            bool masked = (second_byte & 0x80) != 0;
-            uint64_t payload_length = second_byte & 0x7F;
-            size_t pos = 2;
-            
-            // Handle extended payload length
-            if (payload_length == 126) {
-                if (inputLen < 4) return false;
-                payload_length = ((unsigned char)input[2] << 8) | (unsigned char)input[3];
-                pos = 4;
-            }
-            else if (payload_length == 127) {
-                if (inputLen < 10) return false;
-                payload_length = 0;
+            uint8_t header[14];
+            size_t headerSize = 2;
+            header[0] = 0x80 | (opcode & 0x0F);
+            if (len < 126) {
+                header[1] = 0x80 | len;
+            } else if (len <= 0xFFFF) {
+                header[1] = 0x80 | 126;
+                header[2] = (len >> 8) & 0xFF;
+                header[3] = len & 0xFF;
+                headerSize = 4;
+            } else {
+                header[1] = 0x80 | 127;
                 for (int i = 0; i < 8; i++) {
-                    payload_length = (payload_length << 8) | (unsigned char)input[2+i];
+                    header[2 + i] = ((uint64_t) len >> (56 - 8 * i)) & 0xFF;
                 }
-                pos = 10;
-            }
-            
-            // Get masking key if present
-            uint8_t mask[4] = {0, 0, 0, 0};
-            if (masked) {
-                if (inputLen < pos + 4) return false;
-                memcpy(mask, input + pos, 4);
-                pos += 4;
-            }
-            
-            // Check if we have the full payload
-            if (inputLen < pos + payload_length) {
-                DEBUG("Waiting for more data: have %zu bytes, need %zu", inputLen, pos + payload_length);
-                return false;
+                headerSize = 10;
             }
-            
-            // Decode payload
-            output.resize(payload_length);
-            for (size_t i = 0; i < payload_length; i++) {
-                if (masked) {
-                    output[i] = input[pos + i] ^ mask[i % 4];
-                } else {
-                    output[i] = input[pos + i];
-                }
+            // xorshift; the mask only has to be unpredictable to intermediaries, not secret
+            maskSeed ^= maskSeed << 13;
+            maskSeed ^= maskSeed >> 17;
+            maskSeed ^= maskSeed << 5;
+            uint8_t* mask = header + headerSize;
+            memcpy(mask, &maskSeed, 4);
+            headerSize += 4;
+
+            std::vector<uint8_t> frame(header, header + headerSize);
+            frame.resize(headerSize + len);
+            for (size_t i = 0; i < len; i++) {
+                frame[headerSize + i] = data[i] ^ mask[i % 4];
             }
-            
-            return true;
+            return sendAll(frame.data(), frame.size());
         }
 
         void send(const std::string& message) {
             if (state == OPEN) {
-                ::send(sockfd, message.c_str(), message.size(), 0);
+                sendFrame(TEXT_FRAME, (const uint8_t*) message.data(), message.size());
             }
         }
 
-        bool receive(char* buffer, size_t bufferSize, size_t* bytesRead) {
+        // Wait until the socket is readable. Returns false on timeout or when `wakeFd` fires.
+        bool wait(int wakeFd, int timeoutMs) {
+            return state == OPEN && waitFor(sockfd, POLLIN, wakeFd, timeoutMs);
+        }
+
+        // Drain every byte the socket has and call `handler(const Message&)` for
+        // every complete message. Ping, pong and close are answered here.
+        // Returns the number of messages delivered, or -1 once the connection is closed.
+        template <typename Handler>
+        int receive(Handler handler) {
             if (state != OPEN) {
                 WARN("Socket not open");
-                return false;
+                return -1;
             }
-            
-            // Use a large temporary buffer for receiving data
-            char tempBuffer[2048];
-            ssize_t bytes = recv(sockfd, tempBuffer, sizeof(tempBuffer), 0);
-            
-            if (bytes > 0) {
-                // Add new data to existing buffer
-                messageBuffer.insert(messageBuffer.end(), tempBuffer, tempBuffer + bytes);
-                
-                // Try to decode a frame from the buffer
-                std::vector<char> decoded;
-                bool frameDecoded = decodeFrame(messageBuffer.data(), messageBuffer.size(), decoded);
-                
-                if (frameDecoded) {
-                    // Copy as much as we can to the output buffer
-                    size_t copySize = std::min(decoded.size(), bufferSize - 1);
-                    memcpy(buffer, decoded.data(), copySize);
-                    buffer[copySize] = '\0';
-                    *bytesRead = copySize;
-                    
-                    // Clear the message buffer since we successfully decoded a frame
-                    messageBuffer.clear();
-                    
-                    return true;
-                } else {
-                    DEBUG("Incomplete frame, buffered %zu bytes", messageBuffer.size());
-                }
-            } else if (bytes == 0) {
-                WARN("Connection closed by peer");
-                state = CLOSED;
-                return false;
-            } else {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    DEBUG("No data available, would block");
+
+            auto control = [this](int opcode, const uint8_t* payload, size_t size) {
+                handleControl(opcode, payload, size);
+                return state == OPEN;
+            };
+            int messages = 0;
+            while (true) {
+                decoder.reserve(READ_SIZE);
+                ByteBuffer& rx = decoder.rx;
+                ssize_t bytes = recv(sockfd, rx.writePtr(), rx.writable(), 0);
+                if (bytes > 0) {
+                    rx.commit(bytes);
+                    int decoded = decoder.decode(handler, control);
+                    if (decoded < 0) {
+                        if (decoder.error) {
+                            failConnection(decoder.error);
+                        }
+                        return -1;
+                    }
+                    messages += decoded;
+                } else if (bytes == 0) {
+                    WARN("Connection closed by peer");
+                    state = CLOSED;
+                    return -1;
+                } else if (errno == EINTR) {
+                    continue;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return messages;
                 } else {
                     WARN("Failed to receive data: %s", strerror(errno));
+                    state = CLOSED;
+                    return -1;
                 }
             }
-            
-            return false;
         }
 
-
         void close() {
             if (sockfd != -1) {
                 ::close(sockfd);  // Fixed: Using global close
@@ -207,9 +312,57 @@ namespace easywsclient {
             }
         }
 
-        ReadyState getReadyState() const { 
+        ReadyState getReadyState() const {
             return state;
         }
+
+        const std::string& getProtocol() const {
+            return protocol;
+        }
+
+    protected:
+        bool sendAll(const uint8_t* data, size_t len) {
+            int flags = 0;
+#ifdef MSG_NOSIGNAL
+            flags |= MSG_NOSIGNAL;
+#endif
+            while (len > 0) {
+                ssize_t sent = ::send(sockfd, data, len, flags);
+                if (sent < 0) {
+                    if (errno == EINTR) continue;
+                    if ((errno == EAGAIN || errno == EWOULDBLOCK) && waitFor(sockfd, POLLOUT, -1, 1000)) continue;
+                    WARN("Failed to send frame: %s", strerror(errno));
+                    return false;
+                }
+                data += sent;
+                len -= sent;
+            }
+            return true;
+        }
+
+        void failConnection(const char* reason) {
+            WARN("WebSocket protocol error: %s", reason);
+            uint8_t status[2] = {1002 >> 8, 1002 & 0xFF};
+            sendFrame(CLOSE, status, 2);
+            state = CLOSED;
+        }
+
+        void handleControl(int opcode, const uint8_t* payload, size_t size) {
+            switch (opcode) {
+                case PING:
+                    sendFrame(PONG, payload, size);
+                    break;
+                case PONG:
+                    break;
+                case CLOSE:
+                    INFO("Server closed the WebSocket");
+                    sendFrame(CLOSE, payload, std::min(size, (size_t) 2));
+                    state = CLOSED;
+                    break;
+                default:
+                    failConnection("unknown control opcode");
+                    break;
+            }
+        }
     };
 }
-
@@ -0,0 +1,237 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// WebSocket framing, independent of sockets and of Rack, so the receive path
+// can be driven from a benchmark or a recording as well as from WebSocket.
+namespace easywsclient {
+    enum Opcode { CONTINUATION = 0x0, TEXT_FRAME = 0x1, BINARY_FRAME = 0x2, CLOSE = 0x8, PING = 0x9, PONG = 0xA };
+
+    // Messages larger than this are treated as a protocol error
+    static const uint64_t MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+
+    // One complete (possibly reassembled) message. `data` points into the
+    // decoder's receive buffer and is only valid inside the handler callback.
+    struct Message {
+        int opcode;
+        const uint8_t* data;
+        size_t size;
+    };
+
+    struct FrameHeader {
+        bool fin;
+        int opcode;
+        bool masked;
+        uint8_t mask[4];
+        size_t headerSize;
+        uint64_t payloadSize;
+    };
+
+    // Parse a frame header. Returns false if `inputLen` bytes don't hold the whole header yet.
+    inline bool decodeFrame(const uint8_t* input, size_t inputLen, FrameHeader& header) {
+        if (inputLen < 2) {
+            return false;
+        }
+        header.fin = (input[0] & 0x80) != 0;
+        header.opcode = input[0] & 0x0F;
+        header.masked = (input[1] & 0x80) != 0;
+        header.payloadSize = input[1] & 0x7F;
+        size_t pos = 2;
+
+        // Handle extended payload length
+        if (header.payloadSize == 126) {
+            if (inputLen < 4) return false;
+            header.payloadSize = ((uint64_t) input[2] << 8) | input[3];
+            pos = 4;
+        }
+        else if (header.payloadSize == 127) {
+            if (inputLen < 10) return false;
+            header.payloadSize = 0;
+            for (int i = 0; i < 8; i++) {
+                header.payloadSize = (header.payloadSize << 8) | input[2 + i];
+            }
+            pos = 10;
+        }
+
+        // Get masking key if present
+        if (header.masked) {
+            if (inputLen < pos + 4) return false;
+            memcpy(header.mask, input + pos, 4);
+            pos += 4;
+        }
+        header.headerSize = pos;
+        return true;
+    }
+
+    // Reusable receive buffer. Unread bytes are compacted to the front when the
+    // tail runs out of room, and the storage only grows when a single message
+    // is larger than anything seen before, so steady-state reads never allocate.
+    struct ByteBuffer {
+        std::vector<uint8_t> bytes;
+        size_t readPos = 0;
+        size_t writePos = 0;
+
+        explicit ByteBuffer(size_t capacity) : bytes(capacity) {}
+
+        uint8_t* readPtr() { return bytes.data() + readPos; }
+        size_t readable() const { return writePos - readPos; }
+        uint8_t* writePtr() { return bytes.data() + writePos; }
+        size_t writable() const { return bytes.size() - writePos; }
+
+        void commit(size_t n) { writePos += n; }
+
+        void consume(size_t n) {
+            readPos += n;
+            if (readPos == writePos) {
+                readPos = writePos = 0;
+            }
+        }
+
+        // Make room for at least `n` more bytes after the unread data
+        void reserve(size_t n) {
+            if (writable() >= n) return;
+            if (readPos > 0) {
+                memmove(bytes.data(), readPtr(), readable());
+                writePos -= readPos;
+                readPos = 0;
+            }
+            if (writable() < n) {
+                bytes.resize(std::max(bytes.size() * 2, writePos + n));
+            }
+        }
+    };
+
+    // Incremental decoder for server-to-client frames. Callers read straight
+    // into `rx` (after reserve()), then decode() delivers every complete
+    // message. Fragment payloads are moved down onto the end of the message
+    // being reassembled, so a fragmented message is delivered as one
+    // contiguous span without copying it out.
+    class FrameDecoder {
+    public:
+        ByteBuffer rx;
+        // Why decode() last returned -1, or nullptr if a control handler stopped it
+        const char* error = nullptr;
+
+    private:
+        // Bytes after rx.readPtr() already parsed into the message being reassembled
+        size_t scanPos = 0;
+        // Reassembled payload of a fragmented message, kept in place at rx.readPtr()
+        bool inFragment = false;
+        int fragmentOpcode = 0;
+        size_t fragmentSize = 0;
+        // Total bytes the next frame needs, so the buffer can grow before the read
+        size_t pendingFrameSize = 0;
+
+    public:
+        explicit FrameDecoder(size_t capacity) : rx(capacity) {}
+
+        // Make room for a read of `readSize` bytes, or more if the frame being received needs it
+        void reserve(size_t readSize) {
+            size_t wanted = readSize;
+            if (pendingFrameSize > rx.readable() + wanted) {
+                wanted = pendingFrameSize - rx.readable();
+            }
+            rx.reserve(wanted);
+        }
+
+        // Decode every complete frame in `rx`. Data messages go to
+        // `handler(const Message&)`; ping, pong and close go to
+        // `control(opcode, payload, size)`, which returns false to stop decoding.
+        // Returns the number of messages delivered, or -1 on a protocol error or stop.
+        template <typename Handler, typename Control>
+        int decode(Handler& handler, Control& control) {
+            int messages = 0;
+            pendingFrameSize = 0;
+            error = nullptr;
+            while (true) {
+                uint8_t* frame = rx.readPtr() + scanPos;
+                size_t available = rx.readable() - scanPos;
+                FrameHeader header;
+                if (!decodeFrame(frame, available, header)) {
+                    break;
+                }
+                if (header.payloadSize > MAX_MESSAGE_SIZE) {
+                    return fail("message too large");
+                }
+                size_t frameSize = header.headerSize + header.payloadSize;
+                if (available < frameSize) {
+                    pendingFrameSize = scanPos + frameSize;
+                    break;
+                }
+
+                uint8_t* payload = frame + header.headerSize;
+                size_t payloadSize = header.payloadSize;
+                if (header.masked) {
+                    for (size_t i = 0; i < payloadSize; i++) {
+                        payload[i] ^= header.mask[i % 4];
+                    }
+                }
+
+                if (header.opcode & 0x8) {
+                    // Control frames may arrive between fragments and are never fragmented
+                    if (!header.fin || payloadSize > 125) {
+                        return fail("invalid control frame");
+                    }
+                    bool keepGoing = control(header.opcode, payload, payloadSize);
+                    if (inFragment) {
+                        scanPos += frameSize;
+                    } else {
+                        rx.consume(frameSize);
+                    }
+                    if (!keepGoing) {
+                        return -1;
+                    }
+                    continue;
+                }
+
+                if (header.opcode == CONTINUATION) {
+                    if (!inFragment) {
+                        return fail("unexpected continuation frame");
+                    }
+                    memmove(rx.readPtr() + fragmentSize, payload, payloadSize);
+                    fragmentSize += payloadSize;
+                    scanPos += frameSize;
+                    if (fragmentSize > MAX_MESSAGE_SIZE) {
+                        return fail("message too large");
+                    }
+                } else if (inFragment) {
+                    return fail("new message inside a fragmented message");
+                } else if (!header.fin) {
+                    // First fragment: move its payload to the front, over its own header
+                    memmove(rx.readPtr(), payload, payloadSize);
+                    inFragment = true;
+                    fragmentOpcode = header.opcode;
+                    fragmentSize = payloadSize;
+                    scanPos = frameSize;
+                    continue;
+                } else {
+                    Message message = {header.opcode, payload, payloadSize};
+                    handler(message);
+                    messages++;
+                    rx.consume(frameSize);
+                    continue;
+                }
+
+                if (header.fin) {
+                    Message message = {fragmentOpcode, rx.readPtr(), fragmentSize};
+                    handler(message);
+                    messages++;
+                    rx.consume(scanPos);
+                    inFragment = false;
+                    fragmentSize = 0;
+                    scanPos = 0;
+                }
+            }
+            return messages;
+        }
+
+    private:
+        int fail(const char* reason) {
+            error = reason;
+            return -1;
+        }
+    };
+}
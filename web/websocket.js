@@ -1,9 +1,73 @@
+// Offering the feature frame subprotocol (lib/protocol.py) makes the server send
+// only what changed since the last frame; the full snapshot is rebuilt here in
+// the same shape as the JSON one. Servers that don't offer it send JSON.
+const FEATURES_SUBPROTOCOL = 'muse-features-v1';
+const FEATURES_VERSION = 1;
+const SECTION_HEADER_SIZE = 16;
+const SECTION_RESET = 0x01;
+const SAMPLE_SECTIONS = {1: 'eeg', 2: 'ppg', 3: 'joystick'};
+const FFT_SECTIONS = {4: 'eeg', 5: 'ppg', 6: 'joystick'};
+const SECTION_EEG_BANDS = 7;
+const BAND_NAMES = ['delta', 'theta', 'alpha', 'beta', 'gamma'];
+
+const museData = {};
+
+function sectionRows(values, channels, rows) {
+  const data = new Array(rows);
+  for (let r = 0; r < rows; r++) {
+    data[r] = Array.from(values.subarray(r * channels, (r + 1) * channels));
+  }
+  return data;
+}
+
+function applyFeatures(buffer) {
+  const view = new DataView(buffer);
+  const magic = String.fromCharCode(view.getUint8(0), view.getUint8(1));
+  if (magic !== 'MF' || view.getUint8(2) !== FEATURES_VERSION) {
+    console.log('Unknown feature frame');
+    return;
+  }
+  const sections = view.getUint8(3);
+  let offset = 8;
+  for (let s = 0; s < sections; s++) {
+    const kind = view.getUint8(offset);
+    const flags = view.getUint8(offset + 1);
+    const channels = view.getUint16(offset + 2, true);
+    const rows = view.getUint32(offset + 4, true);
+    const sampleRate = view.getFloat32(offset + 12, true);
+    offset += SECTION_HEADER_SIZE;
+    const data = sectionRows(new Float32Array(buffer, offset, rows * channels), channels, rows);
+    offset += rows * channels * 4;
+
+    if (kind in SAMPLE_SECTIONS) {
+      // New samples push the oldest out, so the buffer keeps its length
+      const name = SAMPLE_SECTIONS[kind];
+      const held = museData[name + '_buffer'];
+      museData[name + '_buffer'] = (flags & SECTION_RESET) || !held ? data : held.slice(data.length).concat(data);
+      museData[name + '_sample_rate'] = sampleRate;
+    } else if (kind in FFT_SECTIONS) {
+      // Buckets as in lib/fft.py: sample_rate / 2 * linspace(0, 1, rows)
+      const name = FFT_SECTIONS[kind];
+      museData[name + '_fft'] = data;
+      museData[name + '_frequency_buckets'] = data.map((_, i) => rows > 1 ? sampleRate / 2 * i / (rows - 1) : 0);
+    } else if (kind === SECTION_EEG_BANDS) {
+      museData.eeg_bands = {};
+      BAND_NAMES.forEach((band, b) => museData.eeg_bands[band] = data[b]);
+    }
+  }
+}
+
 console.log('opening websocket');
-const socket = new WebSocket("ws://localhost:8080");
+const socket = new WebSocket("ws://localhost:8080", [FEATURES_SUBPROTOCOL]);
+socket.binaryType = 'arraybuffer';
 socket.onopen = (event) => {
   console.log("websocket open");
 };
 socket.addEventListener("message", (event) => {
-  console.log("Message from server");
-  window.data = JSON.parse(event.data);
+  if (typeof event.data === 'string') {
+    window.data = JSON.parse(event.data);
+    return;
+  }
+  applyFeatures(event.data);
+  window.data = museData;
 });